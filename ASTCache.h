@@ -0,0 +1,173 @@
+//==--- ASTCache.h - On-disk cache of parsed translation units ------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "clang/Basic/Version.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Serialization/PCHContainerOperations.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// ASTCache keeps the AST files of parsed programs in a directory, named by a
+/// hash of the source, the parser arguments and the Clang version. A hit
+/// deserializes the translation unit instead of lexing, parsing and checking
+/// the program again. Next to every AST file the time its parse took is
+/// stored, so a hit can tell how much time it saved. Programs are parsed
+/// from a remapped buffer, so their AST files embed the source and loading
+/// them checks nothing against the file system.
+class ASTCache
+{
+	std::string mDirectory;
+	std::vector<std::string> mArgs;
+	std::shared_ptr<clang::PCHContainerOperations> mPCHOps;
+	std::string mKey;
+	bool mHit;
+	/// Seconds spent parsing the program, now or when it was stored
+	double mParseTime;
+	/// Seconds spent loading the AST file on a hit
+	double mLoadTime;
+
+	typedef std::chrono::steady_clock Clock;
+
+	std::string path(llvm::StringRef extension)
+	{
+		llvm::SmallString<128> file(mDirectory);
+		llvm::sys::path::append(file, llvm::Twine(mKey) + extension);
+		return std::string(file.str());
+	}
+
+	std::string key(const llvm::MemoryBuffer &source)
+	{
+		llvm::SHA1 hash;
+		hash.update(clang::getClangFullVersion());
+		for (const std::string &arg : mArgs)
+		{
+			hash.update(arg);
+			hash.update(llvm::StringRef("", 1));
+		}
+		hash.update(source.getBuffer());
+		return llvm::toHex(hash.final(), true);
+	}
+
+	std::unique_ptr<clang::ASTUnit> load()
+	{
+		std::string file = path(".ast");
+		if (!llvm::sys::fs::exists(file))
+			return nullptr;
+		Clock::time_point start = Clock::now();
+		std::unique_ptr<clang::ASTUnit> unit = clang::ASTUnit::LoadFromASTFile(
+			file, mPCHOps->getRawReader(), clang::ASTUnit::LoadEverything,
+			clang::CompilerInstance::createDiagnostics(new clang::DiagnosticOptions()), clang::FileSystemOptions());
+		mLoadTime = std::chrono::duration<double>(Clock::now() - start).count();
+		if (!unit)
+			return nullptr;
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> time = llvm::MemoryBuffer::getFile(path(".time"));
+		mParseTime = 0;
+		if (time)
+			(*time)->getBuffer().trim().getAsDouble(mParseTime);
+		return unit;
+	}
+
+	/// Let write fill a fresh temporary file, then rename it to the file of
+	/// extension, so concurrent runs never see half a file
+	bool save(llvm::StringRef extension, llvm::function_ref<bool(llvm::StringRef temp)> write)
+	{
+		llvm::SmallString<128> temp;
+		int fd;
+		if (llvm::sys::fs::createUniqueFile(path(extension) + "-%%%%%%%%", fd, temp))
+			return false;
+		::close(fd);
+		if (write(temp) && !llvm::sys::fs::rename(temp, path(extension)))
+			return true;
+		llvm::sys::fs::remove(temp);
+		return false;
+	}
+
+	/// Store unit, unless its program has errors. The time goes first, so
+	/// an AST file that can be seen has its time next to it
+	void store(clang::ASTUnit &unit)
+	{
+		if (unit.getDiagnostics().hasErrorOccurred() || llvm::sys::fs::create_directories(mDirectory))
+			return;
+		bool timed = save(".time", [this](llvm::StringRef temp) {
+			std::error_code error;
+			llvm::raw_fd_ostream os(temp, error);
+			if (error)
+				return false;
+			os << mParseTime << "\n";
+			os.close();
+			return !os.has_error();
+		});
+		if (timed)
+			save(".ast", [&unit](llvm::StringRef temp) { return !unit.Save(temp); });
+	}
+
+public:
+	ASTCache(llvm::StringRef directory, const std::vector<std::string> &args)
+		: mDirectory(directory), mArgs(args), mPCHOps(std::make_shared<clang::PCHContainerOperations>()), mKey(),
+		  mHit(false), mParseTime(0), mLoadTime(0)
+	{
+	}
+
+	/// The translation unit of source, loaded from the cache or parsed and
+	/// stored in it, with the diagnostics of a parse printed to diagnostics.
+	/// Null if Clang could not produce one.
+	std::unique_ptr<clang::ASTUnit> get(const llvm::MemoryBuffer &source, llvm::StringRef name,
+										llvm::raw_ostream &diagnostics)
+	{
+		mKey = key(source);
+		std::unique_ptr<clang::ASTUnit> unit = load();
+		mHit = unit != nullptr;
+		if (mHit)
+			return unit;
+		std::string file = name.str();
+		std::vector<const char *> commandLine(1, "clang-tool");
+		for (const std::string &arg : mArgs)
+			commandLine.push_back(arg.c_str());
+		commandLine.push_back(file.c_str());
+		/// The unit owns the buffer and frees it
+		clang::ASTUnit::RemappedFile remapped(file,
+											  llvm::MemoryBuffer::getMemBufferCopy(source.getBuffer(), name).release());
+		llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> options(new clang::DiagnosticOptions());
+		Clock::time_point start = Clock::now();
+		unit.reset(clang::ASTUnit::LoadFromCommandLine(
+			commandLine.data(), commandLine.data() + commandLine.size(), mPCHOps,
+			clang::CompilerInstance::createDiagnostics(options.get(),
+													   new clang::TextDiagnosticPrinter(diagnostics, options.get())),
+			"", false, clang::CaptureDiagsKind::None, remapped));
+		mParseTime = std::chrono::duration<double>(Clock::now() - start).count();
+		if (unit)
+			store(*unit);
+		return unit;
+	}
+
+	/// Whether the last get loaded its unit from the cache
+	bool hit()
+	{
+		return mHit;
+	}
+
+	void print(llvm::raw_ostream &os)
+	{
+		os << "ast-cache: " << (mHit ? "hit " : "miss ") << mKey.substr(0, 12);
+		if (mHit)
+			os << ", loaded in " << llvm::format("%.1f", mLoadTime * 1000) << " ms, saved "
+			   << llvm::format("%.1f", (mParseTime - mLoadTime) * 1000) << " ms\n";
+		else
+			os << ", parsed in " << llvm::format("%.1f", mParseTime * 1000) << " ms\n";
+	}
+};
@@ -1,191 +1,558 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool --------------===//
 //===----------------------------------------------------------------------===//
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "clang/AST/ASTConsumer.h"
-#include "clang/AST/EvaluatedExprVisitor.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
 
 using namespace clang;
 
+#include "ASTCache.h"
+#include "Batch.h"
+#include "Console.h"
 #include "Environment.h"
+#include "BytecodeCompiler.h"
+#include "BytecodeFile.h"
+#include "Inliner.h"
+#include "LoopOpt.h"
+#include "Server.h"
+#include "VM.h"
+#include "JIT.h"
 
-class InterpreterVisitor : public EvaluatedExprVisitor<InterpreterVisitor>
+/// Execution engines selectable with --engine=
+enum Engine
 {
-public:
-   explicit InterpreterVisitor(const ASTContext &context, Environment *env)
-       : EvaluatedExprVisitor(context), mEnv(env), isReturned(false) {}
-   virtual ~InterpreterVisitor() {}
+   ENGINE_AST,
+   ENGINE_BYTECODE,
+   /// Bytecode with hot functions compiled to native code
+   ENGINE_JIT
+};
 
-   virtual void VisitIntegerLiteral(IntegerLiteral *literal)
-   {
-      if (isReturned)
-         return;
-      mEnv->intliteral(literal);
-   }
+/// Default of --inline-threshold, in bytecode instructions
+const int DEFAULT_INLINE_THRESHOLD = 24;
 
-   virtual void VisitCharacterLiteral(CharacterLiteral *literal)
-   {
-      if (isReturned)
-         return;
-      mEnv->charliteral(literal);
-   }
+/// Settings taken from the command line
+struct InterpreterOptions
+{
+   Engine engine;
+   /// Maximum number of nested interpreted calls
+   size_t maxDepth;
+   /// Print statistics of the passes run before execution
+   bool stats;
+   /// -O0 runs the program as written, -O1 folds constants first
+   int optLevel;
+   /// Calls plus loop iterations after which the jit engine compiles a function
+   unsigned jitThreshold;
+   /// Cache the results of pure functions
+   bool memoize;
+   /// Print the most frequent opcodes, opcode pairs and triples the VM ran
+   bool profileOpcodes;
+   /// Hoist loop invariants and strength reduce addresses in the bytecode at -O1
+   bool loopOpt;
+   /// Print what the loop optimizer did to every loop
+   bool loopReport;
+   /// Functions of at most this many instructions are inlined into their callers at -O1, 0 disables inlining
+   int inlineThreshold;
+   /// Print every inlined call
+   bool inlineReport;
+   /// Directory of the AST cache, empty to parse every time
+   std::string astCache;
+   /// Write the compiled program to this file for ast-runner instead of running it
+   std::string emitBytecode;
+   /// Unix domain socket to serve requests on, - for stdin and stdout, empty to run one program
+   std::string serve;
+   /// Processes serving the socket, 0 for one per processor
+   unsigned workers;
+   /// Time a served program may run
+   unsigned timeoutMs;
+   /// Memory a served program may use on top of what the interpreter maps and reserves
+   unsigned memoryLimitMB;
+   /// Cap the memory of the run at memoryLimitMB, set for served programs
+   bool limitMemory;
+   /// Directory of programs to run side by side, empty to run one program
+   std::string batch;
+   /// Threads running the programs of a batch, 0 for one per processor
+   unsigned jobs;
 
-   virtual void VisitUnaryOperator(UnaryOperator *uop)
-   {
-      if (isReturned)
-         return;
-      VisitStmt(uop);
-      mEnv->unop(uop);
-   }
+   /// What a command line without flags runs with
+   InterpreterOptions()
+       : engine(ENGINE_AST), maxDepth(DEFAULT_MAX_DEPTH), stats(false), optLevel(1), jitThreshold(1000),
+         memoize(false), profileOpcodes(false), loopOpt(true), loopReport(false),
+         inlineThreshold(DEFAULT_INLINE_THRESHOLD), inlineReport(false), astCache(), emitBytecode(), serve(),
+         workers(0), timeoutMs(DEFAULT_SERVE_TIMEOUT_MS), memoryLimitMB(DEFAULT_SERVE_MEMORY_MB), limitMemory(false),
+         batch(), jobs(0) {}
+};
 
-   virtual void VisitBinaryOperator(BinaryOperator *bop)
-   {
-      if (isReturned)
-         return;
-      VisitStmt(bop);
-      mEnv->binop(bop);
-   }
+/// Host stack reserved per nested call of the tree walker, plus a fixed base
+const size_t WALKER_STACK_PER_CALL = 8192;
+const size_t WALKER_STACK_BASE = 8 << 20;
+/// Host stack the walker keeps free for what runs between two of its checks
+const size_t WALKER_STACK_HEADROOM = 256 << 10;
+/// Host stack reserved per nested call of native code
+const size_t NATIVE_STACK_PER_CALL = 1024;
+/// Entries of each table printed by --profile-opcodes
+const unsigned PROFILE_ROWS = 20;
 
-   virtual void VisitDeclRefExpr(DeclRefExpr *expr)
+/// Counters of the memo cache, printed once the program finished
+static void printMemoStats(llvm::raw_ostream &os, unsigned functions, MemoCache &memo)
+{
+   os << "memoize: " << functions << " functions, " << memo.hits() << " hits, " << memo.misses() << " misses\n";
+}
+
+static void *runThunk(void *fn)
+{
+   (*static_cast<llvm::function_ref<void()> *>(fn))();
+   return nullptr;
+}
+
+/// Run fn on a thread with a stack of size bytes. The stack is reserved
+/// without backing so only the pages the walker touches cost memory.
+static void runOnStack(size_t size, llvm::function_ref<void()> fn)
+{
+   size_t page = sysconf(_SC_PAGESIZE);
+   size = (size + page - 1) & ~(page - 1);
+   void *stack = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (stack == MAP_FAILED)
    {
-      if (isReturned)
-         return;
-      VisitStmt(expr);
-      mEnv->declref(expr);
+      fn();
+      return;
    }
+   /// Guard page below the stack
+   mprotect(stack, page, PROT_NONE);
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setstack(&attr, stack, size);
+   pthread_t thread;
+   if (pthread_create(&thread, &attr, runThunk, &fn) == 0)
+      pthread_join(thread, nullptr);
+   else
+      fn();
+   pthread_attr_destroy(&attr);
+   munmap(stack, size);
+}
+
+/// Lowest address the stack of the calling thread may grow to while
+/// WALKER_STACK_HEADROOM of it stays free, 0 if it cannot be told
+static uintptr_t stackLimit()
+{
+   pthread_attr_t attr;
+   if (pthread_getattr_np(pthread_self(), &attr) != 0)
+      return 0;
+   void *low = nullptr;
+   size_t size = 0;
+   pthread_attr_getstack(&attr, &low, &size);
+   pthread_attr_destroy(&attr);
+   return (uintptr_t)low + WALKER_STACK_HEADROOM;
+}
+
+/// How a statement finished, anything but CC_NORMAL skips the statements after it
+enum Completion
+{
+   CC_NORMAL,
+   /// The function returned, trapped or handed its frame to a tail callee
+   CC_RETURN,
+   CC_BREAK,
+   CC_CONTINUE
+};
+
+/// InterpreterVisitor walks function bodies. Nodes are dispatched with a
+/// switch over their class, statements report how they completed and
+/// expressions whether the frame is being unwound, so no node needs to look
+/// at a flag before it runs.
+class InterpreterVisitor
+{
+public:
+   explicit InterpreterVisitor(Environment *env) : mEnv(env), mTailBody(nullptr) {}
 
-   virtual void VisitCastExpr(CastExpr *expr)
+   Completion Exec(Stmt *stmt)
    {
-      if (isReturned)
-         return;
-      VisitStmt(expr);
-      mEnv->cast(expr);
+      if (!stmt)
+         return CC_NORMAL;
+      if (mEnv->stackExhausted())
+         return CC_RETURN;
+      switch (stmt->getStmtClass())
+      {
+      case Stmt::CompoundStmtClass:
+         for (Stmt *child : cast<CompoundStmt>(stmt)->body())
+         {
+            Completion done = Exec(child);
+            if (done != CC_NORMAL)
+               return done;
+         }
+         return CC_NORMAL;
+      case Stmt::DeclStmtClass:
+      {
+         DeclStmt *declstmt = cast<DeclStmt>(stmt);
+         /// The initializers and the sizes of variable length arrays
+         for (Stmt *child : declstmt->children())
+            if (!Eval(cast<Expr>(child)))
+               return CC_RETURN;
+         mEnv->decl(declstmt);
+         return CC_NORMAL;
+      }
+      case Stmt::IfStmtClass:
+      {
+         IfStmt *ifstmt = cast<IfStmt>(stmt);
+         bool truth;
+         if (!Cond(ifstmt->getCond(), truth))
+            return CC_RETURN;
+         return Exec(truth ? ifstmt->getThen() : ifstmt->getElse());
+      }
+      case Stmt::WhileStmtClass:
+         return ExecWhile(cast<WhileStmt>(stmt));
+      case Stmt::ForStmtClass:
+         return ExecFor(cast<ForStmt>(stmt));
+      case Stmt::SwitchStmtClass:
+         return ExecSwitch(cast<SwitchStmt>(stmt));
+      case Stmt::CaseStmtClass:
+      case Stmt::DefaultStmtClass:
+         return Exec(cast<SwitchCase>(stmt)->getSubStmt());
+      case Stmt::ReturnStmtClass:
+      {
+         ReturnStmt *retstmt = cast<ReturnStmt>(stmt);
+         /// A value that trapped or was a tail call left nothing to return
+         if (Expr *value = retstmt->getRetValue())
+            if (!Eval(value))
+               return CC_RETURN;
+         mEnv->ret(retstmt);
+         return CC_RETURN;
+      }
+      case Stmt::BreakStmtClass:
+         return CC_BREAK;
+      case Stmt::ContinueStmtClass:
+         return CC_CONTINUE;
+      case Stmt::NullStmtClass:
+         return CC_NORMAL;
+      default:
+         break;
+      }
+      Expr *expr = dyn_cast<Expr>(stmt);
+      if (!expr)
+      {
+         /// Statements without their own case only wrap other statements
+         for (Stmt *child : stmt->children())
+         {
+            Completion done = Exec(child);
+            if (done != CC_NORMAL)
+               return done;
+         }
+         return CC_NORMAL;
+      }
+      /// An expression statement, its value is dropped
+      size_t mark = mEnv->mark();
+      if (!Eval(expr))
+         return CC_RETURN;
+      mEnv->release(mark);
+      return CC_NORMAL;
    }
 
-   virtual void VisitCallExpr(CallExpr *call)
+private:
+   /// Push the value of expr, false if a trap or a tail call unwinds the frame
+   bool Eval(Expr *expr)
    {
-      if (isReturned)
-         return;
-      VisitStmt(call);
-      if (Stmt *body = mEnv->call(call))
+      if (mEnv->stackExhausted())
+         return false;
+      switch (expr->getStmtClass())
+      {
+      case Stmt::IntegerLiteralClass:
+         mEnv->intliteral(cast<IntegerLiteral>(expr));
+         return true;
+      case Stmt::CharacterLiteralClass:
+         mEnv->charliteral(cast<CharacterLiteral>(expr));
+         return true;
+      case Stmt::DeclRefExprClass:
+         mEnv->declref(cast<DeclRefExpr>(expr));
+         return true;
+      case Stmt::ImplicitCastExprClass:
+      case Stmt::CStyleCastExprClass:
+      {
+         CastExpr *castexpr = cast<CastExpr>(expr);
+         if (!Eval(castexpr->getSubExpr()))
+            return false;
+         mEnv->cast(castexpr);
+         return true;
+      }
+      case Stmt::UnaryOperatorClass:
+      {
+         UnaryOperator *uop = cast<UnaryOperator>(expr);
+         if (uop->isIncrementDecrementOp())
+         {
+            if (!EvalLValue(uop->getSubExpr()))
+               return false;
+            mEnv->incdec(uop);
+            return true;
+         }
+         if (!Eval(uop->getSubExpr()))
+            return false;
+         mEnv->unop(uop);
+         return true;
+      }
+      case Stmt::BinaryOperatorClass:
       {
-         VisitStmt(body);
-         if (!isReturned)
+         BinaryOperator *bop = cast<BinaryOperator>(expr);
+         if (bop->isLogicalOp())
          {
-            mEnv->ret(nullptr);
+            bool truth;
+            if (!Cond(bop, truth))
+               return false;
+            mEnv->push(truth);
+            return true;
          }
-         isReturned = false;
+         if (bop->isAssignmentOp() ? !EvalLValue(bop->getLHS()) : !Eval(bop->getLHS()))
+            return false;
+         if (!Eval(bop->getRHS()))
+            return false;
+         mEnv->binop(bop);
+         return true;
+      }
+      case Stmt::CompoundAssignOperatorClass:
+      {
+         CompoundAssignOperator *bop = cast<CompoundAssignOperator>(expr);
+         if (!EvalLValue(bop->getLHS()) || !Eval(bop->getRHS()))
+            return false;
+         mEnv->compound(bop);
+         return true;
+      }
+      case Stmt::ConditionalOperatorClass:
+      {
+         ConditionalOperator *condop = cast<ConditionalOperator>(expr);
+         bool truth;
+         if (!Cond(condop->getCond(), truth))
+            return false;
+         return Eval(truth ? condop->getTrueExpr() : condop->getFalseExpr());
+      }
+      case Stmt::CallExprClass:
+         return EvalCall(cast<CallExpr>(expr));
+      case Stmt::ArraySubscriptExprClass:
+      {
+         ArraySubscriptExpr *arrsub = cast<ArraySubscriptExpr>(expr);
+         if (!Eval(arrsub->getLHS()) || !Eval(arrsub->getRHS()))
+            return false;
+         mEnv->arrsub(arrsub);
+         return true;
+      }
+      case Stmt::UnaryExprOrTypeTraitExprClass:
+      {
+         UnaryExprOrTypeTraitExpr *uett = cast<UnaryExprOrTypeTraitExpr>(expr);
+         if (!EvalChildren(uett))
+            return false;
+         mEnv->uettop(uett);
+         return true;
+      }
+      case Stmt::ParenExprClass:
+         return Eval(cast<ParenExpr>(expr)->getSubExpr());
+      default:
+         return EvalChildren(expr);
       }
    }
 
-   virtual void VisitDeclStmt(DeclStmt *declstmt)
+   /// Evaluate a condition into truth without going through the operand
+   /// stack for && and ||, whose right operand only runs if it decides
+   bool Cond(Expr *cond, bool &truth)
    {
-      if (isReturned)
-         return;
-      VisitStmt(declstmt);
-      mEnv->decl(declstmt);
+      BinaryOperator *bop = dyn_cast<BinaryOperator>(cond->IgnoreParens());
+      if (bop && bop->isLogicalOp())
+      {
+         if (!Cond(bop->getLHS(), truth))
+            return false;
+         if (truth == (bop->getOpcode() == BO_LOr))
+            return true;
+         return Cond(bop->getRHS(), truth);
+      }
+      if (!Eval(cond))
+         return false;
+      truth = mEnv->pop() != 0;
+      return true;
    }
 
-   virtual void VisitReturnStmt(ReturnStmt *retstmt)
+   bool EvalChildren(Stmt *stmt)
    {
-      if (isReturned)
-         return;
-      VisitStmt(retstmt);
-      mEnv->ret(retstmt);
-      isReturned = true;
+      for (Stmt *child : stmt->children())
+         if (child && !Eval(cast<Expr>(child)))
+            return false;
+      return true;
    }
 
-   virtual void VisitIfStmt(IfStmt *ifstmt)
+   /// Push the operands locating the target of an assignment or update, but not its value
+   bool EvalLValue(Expr *expr)
    {
-      if (isReturned)
-         return;
-      Visit(ifstmt->getCond());
-      if (mEnv->getStmtVal(ifstmt->getCond()))
-      {
-         Visit(ifstmt->getThen());
-      }
-      else if (Stmt *elsestmt = ifstmt->getElse())
-      {
-         Visit(elsestmt);
-      }
+      expr = expr->IgnoreParens();
+      if (ArraySubscriptExpr *arrsub = dyn_cast<ArraySubscriptExpr>(expr))
+         return Eval(arrsub->getBase()) && Eval(arrsub->getIdx());
+      if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr))
+         return Eval(uop->getSubExpr());
+      return true;
    }
 
-   virtual void VisitWhileStmt(WhileStmt *whilestmt)
+   bool EvalCall(CallExpr *call)
    {
-      if (isReturned)
-         return;
-      Visit(whilestmt->getCond());
-      while (mEnv->getStmtVal(whilestmt->getCond()))
+      if (!EvalChildren(call))
+         return false;
+      Stmt *body = mEnv->call(call);
+      if (body)
       {
-         Visit(whilestmt->getBody());
-         if (isReturned)
-            return;
-         Visit(whilestmt->getCond());
+         /// A tail call unwinds to the call that pushed the frame, which runs the callee
+         if (mEnv->tailCalled())
+         {
+            mTailBody = body;
+            return false;
+         }
+         for (;;)
+         {
+            Completion done = Exec(body);
+            if (mTailBody)
+            {
+               body = mTailBody;
+               mTailBody = nullptr;
+               continue;
+            }
+            if (done != CC_RETURN)
+               mEnv->ret(nullptr);
+            break;
+         }
       }
+      /// A call beyond the maximum depth unwinds every caller
+      return !mEnv->trapped();
    }
 
-   virtual void VisitForStmt(ForStmt *forstmt)
+   Completion ExecWhile(WhileStmt *whilestmt)
    {
-      if (isReturned)
-         return;
-      for (Visit(forstmt->getInit()), Visit(forstmt->getCond()); mEnv->getStmtVal(forstmt->getCond()); Visit(forstmt->getInc()), Visit(forstmt->getCond()))
+      for (;;)
       {
-         Visit(forstmt->getBody());
-         if (isReturned)
-            return;
+         bool truth;
+         if (!Cond(whilestmt->getCond(), truth))
+            return CC_RETURN;
+         if (!truth)
+            return CC_NORMAL;
+         Completion done = Exec(whilestmt->getBody());
+         if (done == CC_BREAK)
+            return CC_NORMAL;
+         if (done == CC_RETURN)
+            return CC_RETURN;
       }
    }
 
-   virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *expr)
+   /// Jump to the body statement holding the matching label and fall through
+   /// the rest of the body, break leaves the switch and continue the loop around it
+   Completion ExecSwitch(SwitchStmt *switchstmt)
    {
-      if (isReturned)
-         return;
-      VisitStmt(expr);
-      mEnv->arrsub(expr);
-   }
-
-   virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *expr)
-   {
-      if (isReturned)
-         return;
-      VisitStmt(expr);
-      mEnv->uettop(expr);
+      if (!Eval(switchstmt->getCond()))
+         return CC_RETURN;
+      const std::vector<Stmt *> *path;
+      int start = mEnv->switchIndex(switchstmt, path);
+      if (start < 0)
+         return CC_RETURN;
+      Stmt *body = switchstmt->getBody();
+      CompoundStmt *compound = dyn_cast<CompoundStmt>(body);
+      unsigned count = compound ? compound->size() : 1;
+      for (unsigned i = start; i < count; i++)
+      {
+         Completion done = path && i == start ? Enter(*path, 0) : Exec(compound ? compound->body_begin()[i] : body);
+         if (done == CC_BREAK)
+            return CC_NORMAL;
+         if (done != CC_NORMAL)
+            return done;
+      }
+      return CC_NORMAL;
    }
 
-   virtual void VisitParenExpr(ParenExpr *expr)
+   /// Run path[depth] from the label at the end of path, which is nested in
+   /// it, as if execution had reached the label from the statement before
+   Completion Enter(const std::vector<Stmt *> &path, size_t depth)
    {
-      if (isReturned)
-         return;
-      VisitStmt(expr);
-      mEnv->paren(expr);
+      Stmt *stmt = path[depth];
+      if (depth + 1 == path.size())
+         return Exec(stmt);
+      switch (stmt->getStmtClass())
+      {
+      case Stmt::IfStmtClass:
+      case Stmt::CaseStmtClass:
+      case Stmt::DefaultStmtClass:
+         return Enter(path, depth + 1);
+      case Stmt::WhileStmtClass:
+      {
+         /// The rest of the iteration, then the loop goes on as usual
+         Completion done = Enter(path, depth + 1);
+         if (done == CC_BREAK)
+            return CC_NORMAL;
+         if (done == CC_RETURN)
+            return CC_RETURN;
+         return ExecWhile(cast<WhileStmt>(stmt));
+      }
+      case Stmt::ForStmtClass:
+      {
+         ForStmt *forstmt = cast<ForStmt>(stmt);
+         Completion done = Enter(path, depth + 1);
+         if (done == CC_BREAK)
+            return CC_NORMAL;
+         if (done == CC_RETURN || Exec(forstmt->getInc()) == CC_RETURN)
+            return CC_RETURN;
+         return ExecForLoop(forstmt);
+      }
+      default:
+      {
+         /// Compound statements and the statements that only wrap others go
+         /// on with the children after the one holding the label
+         bool entered = false;
+         for (Stmt *child : stmt->children())
+         {
+            if (!entered && child != path[depth + 1])
+               continue;
+            Completion done = entered ? Exec(child) : Enter(path, depth + 1);
+            entered = true;
+            if (done != CC_NORMAL)
+               return done;
+         }
+         return CC_NORMAL;
+      }
+      }
    }
 
-   virtual void VisitStmt(Stmt *stmt)
+   Completion ExecFor(ForStmt *forstmt)
    {
-      if (isReturned)
-         return;
-      EvaluatedExprVisitor::VisitStmt(stmt);
+      if (Exec(forstmt->getInit()) == CC_RETURN)
+         return CC_RETURN;
+      return ExecForLoop(forstmt);
    }
 
-   virtual void Visit(Stmt *stmt)
+   /// The iterations of a for loop whose initialization ran
+   Completion ExecForLoop(ForStmt *forstmt)
    {
-      if (isReturned || !stmt)
-         return;
-      EvaluatedExprVisitor::Visit(stmt);
+      for (;;)
+      {
+         bool truth = true;
+         if (forstmt->getCond() && !Cond(forstmt->getCond(), truth))
+            return CC_RETURN;
+         if (!truth)
+            return CC_NORMAL;
+         Completion done = Exec(forstmt->getBody());
+         if (done == CC_BREAK)
+            return CC_NORMAL;
+         if (done == CC_RETURN)
+            return CC_RETURN;
+         if (Exec(forstmt->getInc()) == CC_RETURN)
+            return CC_RETURN;
+      }
    }
 
-private:
    Environment *mEnv;
-   bool isReturned;
+   /// Body of a tail callee, run by the call that pushed the frame it took over
+   Stmt *mTailBody;
 };
 
 class InterpreterConsumer : public ASTConsumer
 {
 public:
-   explicit InterpreterConsumer(const ASTContext &context) : mEnv(),
-                                                             mVisitor(context, &mEnv)
+   explicit InterpreterConsumer(const ASTContext &context, const InterpreterOptions &options, Console &console)
+       : mEnv(), mVisitor(&mEnv), mOptions(options), mConsole(console)
    {
    }
    virtual ~InterpreterConsumer() {}
@@ -193,32 +560,367 @@ public:
    virtual void HandleTranslationUnit(clang::ASTContext &Context)
    {
       TranslationUnitDecl *decl = Context.getTranslationUnitDecl();
+      if (mOptions.engine == ENGINE_BYTECODE || mOptions.engine == ENGINE_JIT || !mOptions.emitBytecode.empty())
+      {
+         BCProgram program;
+         BytecodeCompiler compiler(Context, program, mOptions.optLevel);
+         compiler.setMemoize(mOptions.memoize);
+         compiler.setConsole(&mConsole);
+         if (compiler.compile(decl))
+         {
+            if (mOptions.optLevel > 0 && mOptions.inlineThreshold > 0)
+            {
+               Inliner inliner(mOptions.inlineThreshold);
+               inliner.run(program);
+               if (mOptions.inlineReport)
+                  inliner.print(mConsole.out());
+            }
+            if (mOptions.optLevel > 0 && mOptions.loopOpt)
+            {
+               LoopOptimizer loops;
+               loops.run(program);
+               if (mOptions.loopReport)
+                  loops.print(mConsole.out());
+            }
+            if (!mOptions.emitBytecode.empty())
+            {
+               emit(program);
+               return;
+            }
+            VM vm(program, mOptions.maxDepth);
+            vm.setConsole(&mConsole);
+            if (mOptions.profileOpcodes)
+               vm.enableProfile();
+            std::unique_ptr<JIT> jit;
+            if (mOptions.engine == ENGINE_JIT)
+               jit = JIT::create(program, mOptions.jitThreshold);
+            if (!jit)
+            {
+               limitMemory(0);
+               vm.run();
+            }
+            else
+            {
+               /// Native calls nest on the host stack
+               vm.setTier(jit.get());
+               limitMemory(WALKER_STACK_BASE + mOptions.maxDepth * NATIVE_STACK_PER_CALL);
+               runOnStack(WALKER_STACK_BASE + mOptions.maxDepth * NATIVE_STACK_PER_CALL, [&]() { vm.run(); });
+            }
+            if (mOptions.stats && mOptions.memoize)
+            {
+               unsigned memoized = 0;
+               for (const BCFunction &func : program.functions)
+                  memoized += func.memoize;
+               printMemoStats(mConsole.out(), memoized, vm.getMemo());
+            }
+            if (OpcodeProfile *profile = vm.getProfile())
+               profile->print(mConsole.out(), PROFILE_ROWS);
+            return;
+         }
+         if (!mOptions.emitBytecode.empty())
+         {
+            mConsole.out() << "error: the program needs the AST engine, no bytecode image written\n";
+            return;
+         }
+         mConsole.out() << "bytecode: falling back to the AST engine\n";
+      }
+      mEnv.setMaxDepth(mOptions.maxDepth);
+      mEnv.setOptLevel(mOptions.optLevel);
+      mEnv.setMemoize(mOptions.memoize);
+      mEnv.setConsole(&mConsole);
       mEnv.init(decl);
+      if (mOptions.stats)
+      {
+         mConsole.out() << "fold: folded " << mEnv.getFoldedNodes() << " expressions, pruned "
+                        << mEnv.getPrunedStmts() << " statements\n";
+         mConsole.out() << "canonicalize: removed " << mEnv.getRemovedNodes() << " of "
+                        << mEnv.getExprNodes() << " expression nodes\n";
+      }
 
       FunctionDecl *entry = mEnv.getEntry();
-      mVisitor.VisitStmt(entry->getBody());
+      limitMemory(WALKER_STACK_BASE + mOptions.maxDepth * WALKER_STACK_PER_CALL);
+      runOnStack(WALKER_STACK_BASE + mOptions.maxDepth * WALKER_STACK_PER_CALL, [&]() {
+         mEnv.setStackLimit(stackLimit());
+         mVisitor.Exec(entry->getBody());
+      });
+      if (mOptions.stats && mOptions.memoize)
+         printMemoStats(mConsole.out(), mEnv.getMemoized().size(), mEnv.getMemo());
    }
 
 private:
+   /// Cap a served program once it is known how much stack its engine
+   /// reserves, the limit is on top of that
+   void limitMemory(size_t stack)
+   {
+      if (mOptions.limitMemory && !Server::limitMemory(stack + ((size_t)mOptions.memoryLimitMB << 20)))
+         mConsole.out() << "warning: cannot limit memory\n";
+   }
+
+   /// Write the program image for --emit-bytecode
+   void emit(const BCProgram &program)
+   {
+      std::error_code error;
+      llvm::raw_fd_ostream os(mOptions.emitBytecode, error);
+      if (error)
+      {
+         mConsole.out() << "error: cannot write " << mOptions.emitBytecode << ": " << error.message() << "\n";
+         return;
+      }
+      BCImageWriter(os).write(program);
+   }
+
    Environment mEnv;
    InterpreterVisitor mVisitor;
+   InterpreterOptions mOptions;
+   Console &mConsole;
 };
 
 class InterpreterClassAction : public ASTFrontendAction
 {
 public:
+   explicit InterpreterClassAction(const InterpreterOptions &options, Console &console)
+       : mOptions(options), mConsole(console) {}
+
    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
        clang::CompilerInstance &Compiler, llvm::StringRef InFile)
    {
       return std::unique_ptr<clang::ASTConsumer>(
-          new InterpreterConsumer(Compiler.getASTContext()));
+          new InterpreterConsumer(Compiler.getASTContext(), mOptions, mConsole));
    }
+
+private:
+   InterpreterOptions mOptions;
+   Console &mConsole;
 };
 
-int main(int argc, char **argv)
+/// Interpret the program in source, named name in diagnostics, on console.
+/// Clang reads the buffer in place, it is not copied
+static bool runProgram(const InterpreterOptions &options, const llvm::MemoryBuffer &source, llvm::StringRef name,
+                       Console &console)
 {
-   if (argc > 1)
+   /// Programs are parsed as C++ whatever their file name says, the interpreter walks that AST
+   std::vector<std::string> args(1, "-xc++");
+   if (!options.astCache.empty())
    {
-      clang::tooling::runToolOnCode(std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction), argv[1]);
+      ASTCache cache(options.astCache, args);
+      std::unique_ptr<ASTUnit> unit = cache.get(source, name, console.out());
+      if (!unit)
+         return false;
+      if (options.stats)
+         cache.print(console.out());
+      InterpreterConsumer consumer(unit->getASTContext(), options, console);
+      consumer.HandleTranslationUnit(unit->getASTContext());
+      return !unit->getDiagnostics().hasErrorOccurred();
    }
+   /// What runToolOnCodeWithArgs does, but with the diagnostics going to the console
+   llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> overlay(
+       new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem()));
+   llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> memory(new llvm::vfs::InMemoryFileSystem());
+   overlay->pushOverlay(memory);
+   memory->addFile(name, 0, llvm::MemoryBuffer::getMemBuffer(source.getBuffer(), name));
+   llvm::IntrusiveRefCntPtr<FileManager> files(new FileManager(FileSystemOptions(), overlay));
+   std::vector<std::string> commandLine = {"clang-tool", "-fsyntax-only"};
+   commandLine.insert(commandLine.end(), args.begin(), args.end());
+   commandLine.push_back(name);
+   clang::tooling::ToolInvocation invocation(
+       commandLine, std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction(options, console)),
+       files.get());
+   /// The terminal keeps the printer Clang sets up, colored where stderr is a terminal
+   TextDiagnosticPrinter printer(console.out(), new DiagnosticOptions());
+   if (&console != &Console::terminal())
+      invocation.setDiagnosticConsumer(&printer);
+   return invocation.run();
+}
+
+/// Parse the flags in front of the program into options, the index of the
+/// first argument that is not a flag, -1 after reporting an invalid one
+static int parseOptions(int argc, const char *const *argv, InterpreterOptions &options)
+{
+   int argi = 1;
+   for (; argi < argc; argi++)
+   {
+      llvm::StringRef arg(argv[argi]);
+      if (arg == "--engine=ast")
+         options.engine = ENGINE_AST;
+      else if (arg == "--engine=bytecode")
+         options.engine = ENGINE_BYTECODE;
+      else if (arg == "--engine=jit")
+         options.engine = ENGINE_JIT;
+      else if (arg.startswith("--jit-threshold="))
+      {
+         if (arg.substr(strlen("--jit-threshold=")).getAsInteger(10, options.jitThreshold))
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return -1;
+         }
+      }
+      else if (arg == "-O0")
+         options.optLevel = 0;
+      else if (arg == "-O1")
+         options.optLevel = 1;
+      else if (arg == "--stats")
+         options.stats = true;
+      else if (arg == "--memoize")
+         options.memoize = true;
+      else if (arg == "--profile-opcodes")
+         options.profileOpcodes = true;
+      else if (arg == "--no-loop-opt")
+         options.loopOpt = false;
+      else if (arg == "--loop-report")
+         options.loopReport = true;
+      else if (arg.startswith("--inline-threshold="))
+      {
+         if (arg.substr(strlen("--inline-threshold=")).getAsInteger(10, options.inlineThreshold) ||
+             options.inlineThreshold < 0)
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return -1;
+         }
+      }
+      else if (arg == "--inline-report")
+         options.inlineReport = true;
+      else if (arg.startswith("--emit-bytecode="))
+         options.emitBytecode = arg.substr(strlen("--emit-bytecode="));
+      else if (arg.startswith("--ast-cache="))
+         options.astCache = arg.substr(strlen("--ast-cache="));
+      else if (arg.startswith("--max-depth="))
+      {
+         if (arg.substr(strlen("--max-depth=")).getAsInteger(10, options.maxDepth) || options.maxDepth == 0)
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return -1;
+         }
+      }
+      else if (arg.startswith("--serve="))
+         options.serve = arg.substr(strlen("--serve="));
+      else if (arg.startswith("--workers="))
+      {
+         if (arg.substr(strlen("--workers=")).getAsInteger(10, options.workers))
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return -1;
+         }
+      }
+      else if (arg.startswith("--timeout="))
+      {
+         if (arg.substr(strlen("--timeout=")).getAsInteger(10, options.timeoutMs) || options.timeoutMs == 0)
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return -1;
+         }
+      }
+      else if (arg.startswith("--memory-limit="))
+      {
+         if (arg.substr(strlen("--memory-limit=")).getAsInteger(10, options.memoryLimitMB) || options.memoryLimitMB == 0)
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return -1;
+         }
+      }
+      else if (arg.startswith("--batch="))
+         options.batch = arg.substr(strlen("--batch="));
+      else if (arg.startswith("-j"))
+      {
+         /// -jN or -j N, as make takes it
+         llvm::StringRef jobs = arg.substr(strlen("-j"));
+         if (jobs.empty() && argi + 1 < argc)
+            jobs = argv[++argi];
+         if (jobs.getAsInteger(10, options.jobs))
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return -1;
+         }
+      }
+      else
+         break;
+   }
+   if (options.profileOpcodes && options.engine == ENGINE_AST)
+      llvm::errs() << "warning: --profile-opcodes counts bytecode, it needs --engine=bytecode or --engine=jit\n";
+   if (options.loopReport && options.engine == ENGINE_AST)
+      llvm::errs() << "warning: --loop-report describes bytecode loops, it needs --engine=bytecode or --engine=jit\n";
+   if (options.inlineReport && options.engine == ENGINE_AST)
+      llvm::errs() << "warning: --inline-report describes bytecode calls, it needs --engine=bytecode or --engine=jit\n";
+   return argi;
+}
+
+/// Run the program named by input: a file, mapped into memory, - for stdin, or its text itself
+static int runInput(const InterpreterOptions &options, llvm::StringRef input)
+{
+   if (input == "-" || input.find_first_of("\n;{") == llvm::StringRef::npos)
+   {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> source = llvm::MemoryBuffer::getFileOrSTDIN(input);
+      if (!source)
+      {
+         llvm::errs() << "error: cannot read " << input << ": " << source.getError().message() << "\n";
+         return 1;
+      }
+      return runProgram(options, **source, input == "-" ? "<stdin>" : input, Console::terminal()) ? 0 : 1;
+   }
+   std::unique_ptr<llvm::MemoryBuffer> text = llvm::MemoryBuffer::getMemBuffer(input, "input.cc");
+   return runProgram(options, *text, "input.cc", Console::terminal()) ? 0 : 1;
+}
+
+/// Serve requests with the flags of the command line as defaults
+static int serve(const InterpreterOptions &defaults)
+{
+   Server server(
+       [defaults](llvm::StringRef source, const std::vector<std::string> &flags) -> int {
+          InterpreterOptions options = defaults;
+          options.serve.clear();
+          std::vector<const char *> argv(1, "ast-interpreter");
+          for (const std::string &flag : flags)
+             argv.push_back(flag.c_str());
+          int argi = parseOptions(argv.size(), argv.data(), options);
+          if (argi < 0)
+             return 1;
+          if (argi < argv.size() || !options.serve.empty() || !options.emitBytecode.empty() || !options.batch.empty())
+          {
+             llvm::errs() << "error: a request takes execution flags only\n";
+             return 1;
+          }
+          /// Parsing is capped too, the run raises the cap by the stack its engine reserves
+          options.limitMemory = true;
+          if (!Server::limitMemory((size_t)options.memoryLimitMB << 20))
+             llvm::errs() << "warning: cannot limit memory\n";
+          /// Requests carry their source in a std::string, which is null terminated
+          std::unique_ptr<llvm::MemoryBuffer> text = llvm::MemoryBuffer::getMemBuffer(source, "input.cc");
+          return runProgram(options, *text, "input.cc", Console::terminal()) ? 0 : 1;
+       },
+       defaults.workers, defaults.timeoutMs);
+   return defaults.serve == "-" ? server.stream() : server.listen(defaults.serve);
+}
+
+/// Run every program of the --batch directory with the flags of the command
+/// line and print the summary
+static int batch(const InterpreterOptions &options)
+{
+   if (!options.serve.empty() || !options.emitBytecode.empty())
+   {
+      llvm::errs() << "error: --batch cannot be combined with --serve or --emit-bytecode\n";
+      return 1;
+   }
+   Batch batch(
+       [&options](const llvm::MemoryBuffer &source, llvm::StringRef name, Console &console) {
+          return runProgram(options, source, name, console);
+       },
+       options.jobs);
+   if (!batch.run(options.batch))
+      return 1;
+   batch.print(llvm::outs());
+   return batch.passed() ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+   InterpreterOptions options;
+   int argi = parseOptions(argc, argv, options);
+   if (argi < 0)
+      return 1;
+   if (!options.batch.empty())
+      return batch(options);
+   if (!options.serve.empty())
+      return serve(options);
+   if (argi < argc)
+      return runInput(options, argv[argi]);
+   return 0;
 }
@@ -0,0 +1,207 @@
+//==--- Batch.h - Running a directory of programs side by side -------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Console.h"
+
+/// How a program of a batch ended
+enum BatchStatus
+{
+	/// Its output is the expected one
+	BATCH_PASSED,
+	BATCH_FAILED,
+	/// It ran, there was no expected output to compare with
+	BATCH_RAN,
+	/// It could not be read or did not compile
+	BATCH_ERROR
+};
+
+struct BatchResult
+{
+	/// Path of the program, relative to the directory of the batch
+	std::string name;
+	BatchStatus status;
+	/// What the program and the interpreter printed
+	std::string output;
+	/// Wall time of reading, parsing and running it
+	int64_t micros;
+};
+
+/// Batch runs every .c file of a directory on a pool of threads. A program
+/// reads GET values from the file of the same name ending in .in, if there
+/// is one, and everything it prints is collected per program and compared
+/// with the file ending in .out, if there is one, up to a trailing newline.
+/// Each program gets its own console and its own interpreter state,
+/// programs share nothing but the process.
+class Batch
+{
+public:
+	/// Parses and runs source on console, false if it did not compile
+	typedef std::function<bool(const llvm::MemoryBuffer &source, llvm::StringRef name, Console &console)> RunFn;
+
+private:
+	RunFn mRun;
+	unsigned mJobs;
+	std::string mDirectory;
+	std::vector<BatchResult> mResults;
+	int64_t mMicros;
+
+	typedef std::chrono::steady_clock Clock;
+
+	static int64_t micros(Clock::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+	}
+
+	/// The file next to program with its extension replaced
+	static std::string sibling(llvm::StringRef program, llvm::StringRef extension)
+	{
+		llvm::SmallString<128> path(program);
+		llvm::sys::path::replace_extension(path, extension);
+		return std::string(path.str());
+	}
+
+	/// Text without one trailing newline, which editors add to expected outputs
+	static llvm::StringRef chomp(llvm::StringRef text)
+	{
+		return text.endswith("\n") ? text.drop_back() : text;
+	}
+
+	void runOne(BatchResult &result)
+	{
+		Clock::time_point start = Clock::now();
+		llvm::SmallString<128> path(mDirectory);
+		llvm::sys::path::append(path, result.name);
+		llvm::raw_string_ostream os(result.output);
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> source = llvm::MemoryBuffer::getFile(path);
+		if (!source)
+		{
+			os << "error: cannot read " << path << ": " << source.getError().message() << "\n";
+			os.flush();
+			result.status = BATCH_ERROR;
+			result.micros = micros(start);
+			return;
+		}
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> input = llvm::MemoryBuffer::getFile(sibling(path, "in"));
+		Console console(input ? (*input)->getBuffer() : llvm::StringRef(), os);
+		bool compiled = mRun(**source, path, console);
+		os.flush();
+		result.micros = micros(start);
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> expected = llvm::MemoryBuffer::getFile(sibling(path, "out"));
+		if (!compiled)
+			result.status = BATCH_ERROR;
+		else if (!expected)
+			result.status = BATCH_RAN;
+		else
+			result.status = chomp((*expected)->getBuffer()) == chomp(result.output) ? BATCH_PASSED : BATCH_FAILED;
+	}
+
+	unsigned count(BatchStatus status)
+	{
+		return std::count_if(mResults.begin(), mResults.end(),
+							 [status](const BatchResult &result) { return result.status == status; });
+	}
+
+	static const char *statusName(BatchStatus status)
+	{
+		static const char *const names[] = {"passed", "failed", "ran", "error"};
+		return names[status];
+	}
+
+public:
+	Batch(RunFn run, unsigned jobs) : mRun(run), mJobs(jobs), mDirectory(), mResults(), mMicros(0)
+	{
+		if (mJobs == 0)
+			mJobs = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	/// Run the programs of directory, false after reporting that it cannot be listed
+	bool run(llvm::StringRef directory)
+	{
+		mDirectory = directory;
+		mResults.clear();
+		std::error_code error;
+		for (llvm::sys::fs::directory_iterator it(directory, error), end; it != end && !error; it.increment(error))
+			if (llvm::sys::path::extension(it->path()) == ".c")
+				mResults.push_back(BatchResult{llvm::sys::path::filename(it->path()).str(), BATCH_ERROR, "", 0});
+		if (error)
+		{
+			llvm::errs() << "error: cannot list " << directory << ": " << error.message() << "\n";
+			return false;
+		}
+		std::sort(mResults.begin(), mResults.end(),
+				  [](const BatchResult &left, const BatchResult &right) { return left.name < right.name; });
+
+		Clock::time_point start = Clock::now();
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < std::min<size_t>(mJobs, mResults.size()); i++)
+			threads.emplace_back([&]() {
+				for (size_t index = next++; index < mResults.size(); index = next++)
+					runOne(mResults[index]);
+			});
+		for (std::thread &thread : threads)
+			thread.join();
+		mMicros = micros(start);
+		return true;
+	}
+
+	/// Whether every program compiled and printed what was expected of it
+	bool passed()
+	{
+		return count(BATCH_FAILED) == 0 && count(BATCH_ERROR) == 0;
+	}
+
+	/// Summary as JSON: the counts, the wall time of the batch and the sum of
+	/// the times of its programs, then every program with its status and time.
+	/// The output of programs that failed or did not compile is included.
+	void print(llvm::raw_ostream &os)
+	{
+		int64_t total = 0;
+		for (const BatchResult &result : mResults)
+			total += result.micros;
+		llvm::json::OStream json(os, 2);
+		json.object([&]() {
+			json.attribute("directory", mDirectory);
+			json.attribute("jobs", (int64_t)mJobs);
+			json.attribute("programs", (int64_t)mResults.size());
+			json.attribute("passed", (int64_t)count(BATCH_PASSED));
+			json.attribute("failed", (int64_t)count(BATCH_FAILED));
+			json.attribute("ran", (int64_t)count(BATCH_RAN));
+			json.attribute("errors", (int64_t)count(BATCH_ERROR));
+			json.attribute("wall_us", mMicros);
+			json.attribute("total_us", total);
+			json.attributeArray("results", [&]() {
+				for (const BatchResult &result : mResults)
+					json.object([&]() {
+						json.attribute("name", result.name);
+						json.attribute("status", statusName(result.status));
+						json.attribute("time_us", result.micros);
+						if (result.status == BATCH_FAILED || result.status == BATCH_ERROR)
+							json.attribute("output", llvm::json::isUTF8(result.output) ? result.output
+																		 : llvm::json::fixUTF8(result.output));
+					});
+			});
+		});
+		os << "\n";
+	}
+};
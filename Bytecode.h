@@ -0,0 +1,206 @@
+//==--- Bytecode.h - Register bytecode executed by the VM ------------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <string>
+#include <vector>
+
+/// Opcodes of the register machine, operands are named a, b and c.
+/// Registers are frame relative, jump targets are instruction indices
+/// inside the current function and addresses index the VM Memory.
+enum BCOp : unsigned char
+{
+	OP_CONST,  /// a = b
+	OP_MOV,    /// a = reg b
+	OP_LDG_I,  /// a = int at address b
+	OP_LDG_C,  /// a = char at address b
+	OP_STG_I,  /// int at address a = reg b
+	OP_STG_C,  /// char at address a = reg b
+	OP_LD_I,   /// a = int at address reg b
+	OP_LD_C,   /// a = char at address reg b
+	OP_ST_I,   /// int at address reg a = reg b
+	OP_ST_C,   /// char at address reg a = reg b
+	OP_LDX_I,  /// a = int at address reg b + 4 * reg c
+	OP_LDX_C,  /// a = char at address reg b + reg c
+	OP_STX_I,  /// int at address reg a + 4 * reg b = reg c
+	OP_STX_C,  /// char at address reg a + reg b = reg c
+	OP_ADD,    /// a = reg b + reg c
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_REM,
+	OP_LT,
+	OP_GT,
+	OP_LE,
+	OP_GE,
+	OP_EQ,
+	OP_NE,
+	OP_MULI,   /// a = reg b * c, scales pointer offsets
+	OP_DIVI,   /// a = reg b / c, scales pointer differences
+	OP_ADDI,   /// a = reg b + c
+	OP_NEG,    /// a = -reg b
+	OP_NOT,    /// a = !reg b
+	OP_TRUNC_C, /// a = (char)reg b
+	OP_JMP,    /// goto a
+	OP_JZ,     /// if (!reg a) goto b
+	OP_JNZ,    /// if (reg a) goto b
+	OP_JLT,    /// if (reg a < reg b) goto c
+	OP_JGT,
+	OP_JLE,
+	OP_JGE,
+	OP_JEQ,
+	OP_JNE,
+	OP_JLTI,   /// if (reg a < b) goto c
+	OP_JGTI,
+	OP_JLEI,
+	OP_JGEI,
+	OP_JEQI,
+	OP_JNEI,
+	OP_SWITCH, /// goto entry reg a - low of jump table b, or c if it is out of range
+	OP_CALL,   /// a = call function b with arguments starting at reg c
+	OP_TAILCALL, /// return call function a with arguments starting at reg b, reusing the frame
+	OP_RET,    /// return reg a
+	OP_RET0,   /// return 0
+	OP_ALLOCA, /// a = address of reg b bytes released when the function returns
+	OP_GET,    /// a = GET()
+	OP_PRINT,  /// PRINT(reg a)
+	OP_MALLOC, /// a = MALLOC(reg b)
+	OP_FREE,   /// FREE(reg a)
+	OP_COUNT
+};
+
+/// Mnemonic of op for listings and profiles
+inline const char *opName(BCOp op)
+{
+	static const char *const names[] = {
+		"CONST", "MOV", "LDG_I", "LDG_C", "STG_I", "STG_C", "LD_I", "LD_C", "ST_I", "ST_C",
+		"LDX_I", "LDX_C", "STX_I", "STX_C", "ADD", "SUB", "MUL", "DIV", "REM", "LT",
+		"GT", "LE", "GE", "EQ", "NE", "MULI", "DIVI", "ADDI", "NEG", "NOT",
+		"TRUNC_C", "JMP", "JZ", "JNZ", "JLT", "JGT", "JLE", "JGE", "JEQ", "JNE",
+		"JLTI", "JGTI", "JLEI", "JGEI", "JEQI", "JNEI", "SWITCH", "CALL", "TAILCALL", "RET",
+		"RET0", "ALLOCA", "GET", "PRINT", "MALLOC", "FREE"};
+	static_assert(sizeof(names) / sizeof(names[0]) == OP_COUNT, "every opcode needs a name");
+	return op < OP_COUNT ? names[op] : "?";
+}
+
+struct BCInstr
+{
+	BCOp op;
+	int a;
+	int b;
+	int c;
+};
+
+/// Operand holding the target of a jump, null if in does not jump.
+/// For SWITCH the default target, the others are in its jump table
+inline int *jumpTarget(BCInstr &in)
+{
+	if (in.op == OP_JMP)
+		return &in.a;
+	if (in.op == OP_JZ || in.op == OP_JNZ)
+		return &in.b;
+	if ((in.op >= OP_JLT && in.op <= OP_JNEI) || in.op == OP_SWITCH)
+		return &in.c;
+	return nullptr;
+}
+
+inline const int *jumpTarget(const BCInstr &in)
+{
+	return jumpTarget(const_cast<BCInstr &>(in));
+}
+
+enum
+{
+	OPERAND_A = 1,
+	OPERAND_B = 2,
+	OPERAND_C = 4
+};
+
+/// Operands of op naming registers, read or written. Calls name the first
+/// register of their argument range
+inline unsigned registerOperands(BCOp op)
+{
+	switch (op)
+	{
+	case OP_CONST:
+	case OP_LDG_I:
+	case OP_LDG_C:
+	case OP_JZ:
+	case OP_JNZ:
+	case OP_JLTI:
+	case OP_JGTI:
+	case OP_JLEI:
+	case OP_JGEI:
+	case OP_JEQI:
+	case OP_JNEI:
+	case OP_SWITCH:
+	case OP_RET:
+	case OP_GET:
+	case OP_PRINT:
+	case OP_FREE:
+		return OPERAND_A;
+	case OP_STG_I:
+	case OP_STG_C:
+	case OP_TAILCALL:
+		return OPERAND_B;
+	case OP_MOV:
+	case OP_LD_I:
+	case OP_LD_C:
+	case OP_ST_I:
+	case OP_ST_C:
+	case OP_MULI:
+	case OP_DIVI:
+	case OP_ADDI:
+	case OP_NEG:
+	case OP_NOT:
+	case OP_TRUNC_C:
+	case OP_JLT:
+	case OP_JGT:
+	case OP_JLE:
+	case OP_JGE:
+	case OP_JEQ:
+	case OP_JNE:
+	case OP_ALLOCA:
+	case OP_MALLOC:
+		return OPERAND_A | OPERAND_B;
+	case OP_CALL:
+		return OPERAND_A | OPERAND_C;
+	case OP_JMP:
+	case OP_RET0:
+	case OP_COUNT:
+		return 0;
+	default:
+		return OPERAND_A | OPERAND_B | OPERAND_C;
+	}
+}
+
+/// Targets of a SWITCH for the values low, low + 1, ...
+struct BCJumpTable
+{
+	int low;
+	std::vector<int> targets;
+};
+
+struct BCFunction
+{
+	std::string name;
+	/// Parameters occupy the first registers of the frame
+	int numParams;
+	int numRegs;
+	std::vector<BCInstr> code;
+	std::vector<BCJumpTable> tables;
+	/// Results are cached by argument tuple, set for pure functions under --memoize
+	bool memoize;
+};
+
+struct BCProgram
+{
+	std::vector<BCFunction> functions;
+	/// Initial image of the global variables, loaded at address 0
+	std::vector<char> data;
+	int entry;
+
+	BCProgram() : functions(), data(), entry(-1)
+	{
+	}
+};
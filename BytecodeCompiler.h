@@ -0,0 +1,1203 @@
+//==--- BytecodeCompiler.h - Lower function bodies to register bytecode ----===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <algorithm>
+#include <map>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+
+#include "Bytecode.h"
+#include "Console.h"
+#include "Memo.h"
+#include "Purity.h"
+
+using namespace clang;
+
+/// BytecodeCompiler translates every FunctionDecl body of a translation unit
+/// into a BCFunction. Scalar locals and parameters live in registers, arrays
+/// and globals live in memory.
+class BytecodeCompiler
+{
+	const ASTContext &mContext;
+	BCProgram &mProgram;
+	/// Optimization level, 0 compiles every expression as written
+	int mOptLevel;
+	/// Mark the pure functions for memoization
+	bool mMemoize;
+
+	/// Maps canonical Function Declaration to its index in the program
+	std::map<const FunctionDecl *, int> mFunctions;
+	/// Maps canonical global Variable Declaration to its address
+	std::map<const VarDecl *, int> mGlobals;
+
+	const FunctionDecl *mFree; /// Declartions to the built-in functions
+	const FunctionDecl *mMalloc;
+	const FunctionDecl *mInput;
+	const FunctionDecl *mOutput;
+
+	/// State of the function being compiled
+	BCFunction *mFunc;
+	/// Maps canonical local Variable Declaration to its register
+	std::map<const VarDecl *, int> mLocals;
+	/// Registers below mLocalTop hold variables, the ones above are temporaries
+	int mLocalTop;
+	int mNextReg;
+	/// Jumps of break and continue statements to patch once the enclosing loop
+	/// or switch is compiled, null outside of one
+	std::vector<int> *mBreaks;
+	std::vector<int> *mContinues;
+	/// Position of every case and default label compiled so far
+	std::map<const SwitchCase *, int> mLabels;
+	bool mFailed;
+	/// Where unsupported constructs are reported
+	Console *mConsole;
+
+	enum
+	{
+		/// A run of cases goes through a jump table if it has at least
+		/// MIN_TABLE_CASES cases and they fill at least half of its entries
+		MIN_TABLE_CASES = 4,
+		/// Fewer cases are compared one after the other
+		MIN_SEARCH_CASES = 4
+	};
+
+	void unsupported(Stmt *stmt)
+	{
+		if (!mFailed)
+			mConsole->out() << "bytecode: unsupported " << stmt->getStmtClassName() << "\n";
+		mFailed = true;
+	}
+
+	int emit(BCOp op, int a = 0, int b = 0, int c = 0)
+	{
+		mFunc->code.push_back(BCInstr{op, a, b, c});
+		return mFunc->code.size() - 1;
+	}
+
+	int here()
+	{
+		return mFunc->code.size();
+	}
+
+	/// Point the jump at index to the next emitted instruction
+	void patch(int index)
+	{
+		*jumpTarget(mFunc->code[index]) = here();
+	}
+
+	void patch(const std::vector<int> &jumps, int target)
+	{
+		for (int index : jumps)
+			*jumpTarget(mFunc->code[index]) = target;
+	}
+
+	int temp()
+	{
+		int reg = mNextReg++;
+		if (mNextReg > mFunc->numRegs)
+			mFunc->numRegs = mNextReg;
+		return reg;
+	}
+
+	int target(int dst)
+	{
+		return dst >= 0 ? dst : temp();
+	}
+
+	/// Make sure the value in reg ends up in dst if a destination was requested
+	int finish(int reg, int dst)
+	{
+		if (dst >= 0 && dst != reg)
+		{
+			emit(OP_MOV, dst, reg);
+			return dst;
+		}
+		return reg;
+	}
+
+	int sizeOf(QualType type)
+	{
+		if (type->isVoidType() || type->isCharType())
+			return 1;
+		return mContext.getTypeSizeInChars(type).getQuantity();
+	}
+
+	/// Scalars are accessed as a single char or as an int, pointers included
+	bool isByte(QualType type)
+	{
+		return type->isCharType();
+	}
+
+	int local(const VarDecl *vardecl)
+	{
+		std::map<const VarDecl *, int>::iterator it = mLocals.find(vardecl->getCanonicalDecl());
+		return it == mLocals.end() ? -1 : it->second;
+	}
+
+	int global(const VarDecl *vardecl)
+	{
+		std::map<const VarDecl *, int>::iterator it = mGlobals.find(vardecl->getCanonicalDecl());
+		return it == mGlobals.end() ? -1 : it->second;
+	}
+
+	int declare(const VarDecl *vardecl)
+	{
+		int reg = mLocalTop++;
+		mNextReg = mLocalTop;
+		if (mLocalTop > mFunc->numRegs)
+			mFunc->numRegs = mLocalTop;
+		mLocals[vardecl->getCanonicalDecl()] = reg;
+		return reg;
+	}
+
+	/// Constant sized local arrays are allocated once in the prologue
+	void collectArrays(Stmt *stmt, std::vector<const VarDecl *> &arrays)
+	{
+		if (!stmt)
+			return;
+		if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt))
+		{
+			for (Decl *decl : declstmt->decls())
+				if (VarDecl *vardecl = dyn_cast<VarDecl>(decl))
+					if (mContext.getAsConstantArrayType(vardecl->getType()))
+						arrays.push_back(vardecl);
+		}
+		for (Stmt *child : stmt->children())
+			collectArrays(child, arrays);
+	}
+
+	/// Compute the address of an lvalue
+	int address(Expr *expr, int dst)
+	{
+		expr = expr->IgnoreParens();
+		if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr))
+		{
+			if (VarDecl *vardecl = dyn_cast<VarDecl>(declref->getDecl()))
+			{
+				int addr = global(vardecl);
+				if (addr >= 0)
+				{
+					int reg = target(dst);
+					emit(OP_CONST, reg, addr);
+					return reg;
+				}
+				if (vardecl->getType()->isArrayType() && local(vardecl) >= 0)
+					return finish(local(vardecl), dst);
+			}
+		}
+		else if (ArraySubscriptExpr *arrsub = dyn_cast<ArraySubscriptExpr>(expr))
+		{
+			int base = this->expr(arrsub->getBase(), -1);
+			int idx = this->expr(arrsub->getIdx(), -1);
+			int size = sizeOf(arrsub->getType());
+			if (size != 1)
+			{
+				int scaled = temp();
+				emit(OP_MULI, scaled, idx, size);
+				idx = scaled;
+			}
+			int reg = target(dst);
+			emit(OP_ADD, reg, base, idx);
+			return reg;
+		}
+		else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr))
+		{
+			if (uop->getOpcode() == UO_Deref)
+				return this->expr(uop->getSubExpr(), dst);
+		}
+		unsupported(expr);
+		return target(dst);
+	}
+
+	/// Registers holding the base and the index of a subscript whose element
+	/// size matches the scale of the indexed accesses, false if the address
+	/// has to be computed
+	bool indexed(Expr *expr, int &base, int &idx)
+	{
+		ArraySubscriptExpr *arrsub = dyn_cast<ArraySubscriptExpr>(expr);
+		if (mOptLevel == 0 || !arrsub)
+			return false;
+		if (sizeOf(arrsub->getType()) != (isByte(arrsub->getType()) ? 1 : (int)sizeof(int)))
+			return false;
+		base = this->expr(arrsub->getBase(), -1);
+		idx = this->expr(arrsub->getIdx(), -1);
+		return true;
+	}
+
+	/// Read the value of an lvalue
+	int load(Expr *expr, int dst)
+	{
+		expr = expr->IgnoreParens();
+		if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr))
+		{
+			if (VarDecl *vardecl = dyn_cast<VarDecl>(declref->getDecl()))
+			{
+				int addr = global(vardecl);
+				if (addr < 0 && local(vardecl) >= 0)
+					return finish(local(vardecl), dst);
+				if (addr < 0)
+				{
+					unsupported(expr);
+					return target(dst);
+				}
+				int reg = target(dst);
+				emit(isByte(expr->getType()) ? OP_LDG_C : OP_LDG_I, reg, addr);
+				return reg;
+			}
+		}
+		int base, idx;
+		if (indexed(expr, base, idx))
+		{
+			int reg = target(dst);
+			emit(isByte(expr->getType()) ? OP_LDX_C : OP_LDX_I, reg, base, idx);
+			return reg;
+		}
+		int addr = address(expr, -1);
+		int reg = target(dst);
+		emit(isByte(expr->getType()) ? OP_LD_C : OP_LD_I, reg, addr);
+		return reg;
+	}
+
+	int assign(BinaryOperator *bop, int dst)
+	{
+		Expr *left = bop->getLHS()->IgnoreParens();
+		if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(left))
+		{
+			if (VarDecl *vardecl = dyn_cast<VarDecl>(declref->getDecl()))
+			{
+				int addr = global(vardecl);
+				if (addr < 0 && local(vardecl) >= 0)
+				{
+					int reg = local(vardecl);
+					expr(bop->getRHS(), reg);
+					return finish(reg, dst);
+				}
+				if (addr < 0)
+				{
+					unsupported(left);
+					return target(dst);
+				}
+				int val = expr(bop->getRHS(), dst);
+				emit(isByte(left->getType()) ? OP_STG_C : OP_STG_I, addr, val);
+				return val;
+			}
+		}
+		int base, idx;
+		if (indexed(left, base, idx))
+		{
+			int val = expr(bop->getRHS(), dst);
+			emit(isByte(left->getType()) ? OP_STX_C : OP_STX_I, base, idx, val);
+			return val;
+		}
+		int addr = address(left, -1);
+		int val = expr(bop->getRHS(), dst);
+		emit(isByte(left->getType()) ? OP_ST_C : OP_ST_I, addr, val);
+		return val;
+	}
+
+	/// Apply op with right, or with one for ++ and -- if right is null, to the
+	/// lvalue left. Its address is computed once for the load and the store,
+	/// locals are updated in place. Yields the previous value if post is set
+	int update(Expr *left, BinaryOperatorKind op, Expr *right, bool post, int dst)
+	{
+		left = left->IgnoreParens();
+		int reg = -1, addr = -1, base = -1, idx = -1, gaddr = -1;
+		if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(left))
+		{
+			VarDecl *vardecl = dyn_cast<VarDecl>(declref->getDecl());
+			gaddr = vardecl ? global(vardecl) : -1;
+			if (vardecl && gaddr < 0)
+				reg = local(vardecl);
+			if (gaddr < 0 && reg < 0)
+			{
+				unsupported(left);
+				return target(dst);
+			}
+		}
+		else if (!indexed(left, base, idx))
+			addr = address(left, -1);
+
+		/// Pointers step by their element size
+		int scale = left->getType()->isPointerType() ? sizeOf(left->getType()->getPointeeType()) : 1;
+		bool additive = op == BO_Add || op == BO_Sub;
+		int imm = 1;
+		int rightval = -1;
+		if (right && !(additive && constant(right, imm)))
+		{
+			rightval = expr(right, -1);
+			if (additive && scale != 1)
+			{
+				int scaled = temp();
+				emit(OP_MULI, scaled, rightval, scale);
+				rightval = scaled;
+			}
+		}
+
+		bool byte = isByte(left->getType());
+		if (reg < 0)
+		{
+			reg = temp();
+			if (gaddr >= 0)
+				emit(byte ? OP_LDG_C : OP_LDG_I, reg, gaddr);
+			else if (base >= 0)
+				emit(byte ? OP_LDX_C : OP_LDX_I, reg, base, idx);
+			else
+				emit(byte ? OP_LD_C : OP_LD_I, reg, addr);
+		}
+		int old = -1;
+		if (post)
+		{
+			old = target(dst);
+			emit(OP_MOV, old, reg);
+		}
+
+		if (rightval < 0)
+		{
+			imm *= scale;
+			emit(OP_ADDI, reg, reg, op == BO_Sub ? (int)(0u - (unsigned)imm) : imm);
+		}
+		else
+		{
+			BCOp bcop = OP_ADD;
+			if (op == BO_Sub)
+				bcop = OP_SUB;
+			else if (op == BO_Mul)
+				bcop = OP_MUL;
+			else if (op == BO_Div)
+				bcop = OP_DIV;
+			else if (op == BO_Rem)
+				bcop = OP_REM;
+			emit(bcop, reg, reg, rightval);
+		}
+		if (byte)
+			emit(OP_TRUNC_C, reg, reg);
+
+		if (gaddr >= 0)
+			emit(byte ? OP_STG_C : OP_STG_I, gaddr, reg);
+		else if (base >= 0)
+			emit(byte ? OP_STX_C : OP_STX_I, base, idx, reg);
+		else if (addr >= 0)
+			emit(byte ? OP_ST_C : OP_ST_I, addr, reg);
+		return post ? old : finish(reg, dst);
+	}
+
+	int binop(BinaryOperator *bop, int dst)
+	{
+		switch (bop->getOpcode())
+		{
+		case BO_Assign:
+			return assign(bop, dst);
+		case BO_AddAssign:
+		case BO_SubAssign:
+		case BO_MulAssign:
+		case BO_DivAssign:
+		case BO_RemAssign:
+			return update(bop->getLHS(), BinaryOperator::getOpForCompoundAssignment(bop->getOpcode()),
+						  bop->getRHS(), false, dst);
+		case BO_Comma:
+			expr(bop->getLHS(), -1);
+			return expr(bop->getRHS(), dst);
+		case BO_LAnd:
+		case BO_LOr:
+		{
+			/// The value is only written once both operands were read
+			std::vector<int> jfalse;
+			branch(bop, false, jfalse);
+			int reg = target(dst);
+			emit(OP_CONST, reg, 1);
+			int jend = emit(OP_JMP, -1);
+			patch(jfalse, here());
+			emit(OP_CONST, reg, 0);
+			patch(jend);
+			return reg;
+		}
+		default:
+			break;
+		}
+
+		Expr *left = bop->getLHS();
+		Expr *right = bop->getRHS();
+		/// A constant added to an integer or a pointer needs no register
+		int imm;
+		if (bop->isAdditiveOp() && !right->getType()->isPointerType() && constant(right, imm))
+		{
+			if (left->getType()->isPointerType())
+				imm *= sizeOf(left->getType()->getPointeeType());
+			if (bop->getOpcode() == BO_Sub)
+				imm = (int)(0u - (unsigned)imm);
+			int leftval = expr(left, -1);
+			int reg = target(dst);
+			emit(OP_ADDI, reg, leftval, imm);
+			return reg;
+		}
+		int leftval = expr(left, -1);
+		int rightval = expr(right, -1);
+		BCOp op;
+		switch (bop->getOpcode())
+		{
+		case BO_Add:
+		case BO_Sub:
+			if (left->getType()->isPointerType() && right->getType()->isPointerType())
+			{
+				int reg = target(dst);
+				emit(OP_SUB, reg, leftval, rightval);
+				int size = sizeOf(left->getType()->getPointeeType());
+				if (size != 1)
+					emit(OP_DIVI, reg, reg, size);
+				return reg;
+			}
+			if (left->getType()->isPointerType())
+			{
+				int size = sizeOf(left->getType()->getPointeeType());
+				if (size != 1)
+				{
+					int scaled = temp();
+					emit(OP_MULI, scaled, rightval, size);
+					rightval = scaled;
+				}
+			}
+			else if (right->getType()->isPointerType())
+			{
+				int size = sizeOf(right->getType()->getPointeeType());
+				if (size != 1)
+				{
+					int scaled = temp();
+					emit(OP_MULI, scaled, leftval, size);
+					leftval = scaled;
+				}
+			}
+			op = bop->getOpcode() == BO_Add ? OP_ADD : OP_SUB;
+			break;
+		case BO_Mul:
+			op = OP_MUL;
+			break;
+		case BO_Div:
+			op = OP_DIV;
+			break;
+		case BO_Rem:
+			op = OP_REM;
+			break;
+		case BO_LT:
+			op = OP_LT;
+			break;
+		case BO_GT:
+			op = OP_GT;
+			break;
+		case BO_LE:
+			op = OP_LE;
+			break;
+		case BO_GE:
+			op = OP_GE;
+			break;
+		case BO_EQ:
+			op = OP_EQ;
+			break;
+		case BO_NE:
+			op = OP_NE;
+			break;
+		default:
+			unsupported(bop);
+			return target(dst);
+		}
+		int reg = target(dst);
+		emit(op, reg, leftval, rightval);
+		return reg;
+	}
+
+	int unop(UnaryOperator *uop, int dst)
+	{
+		switch (uop->getOpcode())
+		{
+		case UO_Plus:
+			return expr(uop->getSubExpr(), dst);
+		case UO_Minus:
+		{
+			int val = expr(uop->getSubExpr(), -1);
+			int reg = target(dst);
+			emit(OP_NEG, reg, val);
+			return reg;
+		}
+		case UO_LNot:
+		{
+			int val = expr(uop->getSubExpr(), -1);
+			int reg = target(dst);
+			emit(OP_NOT, reg, val);
+			return reg;
+		}
+		case UO_AddrOf:
+			return address(uop->getSubExpr(), dst);
+		case UO_PreInc:
+		case UO_PreDec:
+		case UO_PostInc:
+		case UO_PostDec:
+			return update(uop->getSubExpr(), uop->isIncrementOp() ? BO_Add : BO_Sub, nullptr, uop->isPostfix(), dst);
+		default:
+			unsupported(uop);
+			return target(dst);
+		}
+	}
+
+	int cast(CastExpr *castexpr, int dst)
+	{
+		Expr *sub = castexpr->getSubExpr();
+		switch (castexpr->getCastKind())
+		{
+		case CK_LValueToRValue:
+			return load(sub, dst);
+		case CK_ArrayToPointerDecay:
+			return address(sub, dst);
+		case CK_IntegralCast:
+			if (isByte(castexpr->getType()) && !isByte(sub->getType()))
+			{
+				int val = expr(sub, -1);
+				int reg = target(dst);
+				emit(OP_TRUNC_C, reg, val);
+				return reg;
+			}
+			return expr(sub, dst);
+		default:
+			/// The remaining casts between int, char and pointers keep the value
+			return expr(sub, dst);
+		}
+	}
+
+	int call(CallExpr *callexpr, int dst)
+	{
+		const FunctionDecl *callee = callexpr->getDirectCallee();
+		if (!callee)
+		{
+			unsupported(callexpr);
+			return target(dst);
+		}
+		callee = callee->getCanonicalDecl();
+		if (callee == mInput)
+		{
+			int reg = target(dst);
+			emit(OP_GET, reg);
+			return reg;
+		}
+		else if (callee == mOutput)
+		{
+			int val = expr(callexpr->getArg(0), -1);
+			emit(OP_PRINT, val);
+			return finish(val, dst);
+		}
+		else if (callee == mMalloc)
+		{
+			int size = expr(callexpr->getArg(0), -1);
+			int reg = target(dst);
+			emit(OP_MALLOC, reg, size);
+			return reg;
+		}
+		else if (callee == mFree)
+		{
+			int addr = expr(callexpr->getArg(0), -1);
+			emit(OP_FREE, addr);
+			return finish(addr, dst);
+		}
+
+		std::map<const FunctionDecl *, int>::iterator it = mFunctions.find(callee);
+		if (it == mFunctions.end())
+		{
+			unsupported(callexpr);
+			return target(dst);
+		}
+		/// Arguments are evaluated into consecutive registers
+		int base = mNextReg;
+		for (int i = 0; i < callexpr->getNumArgs(); i++)
+			temp();
+		for (int i = 0; i < callexpr->getNumArgs(); i++)
+		{
+			mNextReg = base + callexpr->getNumArgs();
+			expr(callexpr->getArg(i), base + i);
+		}
+		int reg = target(dst);
+		emit(OP_CALL, reg, it->second, base);
+		return reg;
+	}
+
+	/// Value of an integer expression that does not depend on the program state,
+	/// the VM uses C sizes so Clang's evaluator applies as is
+	bool constant(Expr *expr, int &val)
+	{
+		if (mOptLevel == 0 || !expr->isRValue() || !expr->getType()->isIntegerType())
+			return false;
+		if (expr->HasSideEffects(mContext))
+			return false;
+		Expr::EvalResult result;
+		if (!expr->EvaluateAsInt(result, mContext))
+			return false;
+		val = result.Val.getInt().getSExtValue();
+		return true;
+	}
+
+	/// Fused compare and branch jumping if the comparison kind holds
+	static BCOp branchOp(BinaryOperatorKind kind, bool immediate)
+	{
+		int index = 0;
+		switch (kind)
+		{
+		case BO_LT:
+			index = 0;
+			break;
+		case BO_GT:
+			index = 1;
+			break;
+		case BO_LE:
+			index = 2;
+			break;
+		case BO_GE:
+			index = 3;
+			break;
+		case BO_EQ:
+			index = 4;
+			break;
+		default:
+			assert(kind == BO_NE);
+			index = 5;
+			break;
+		}
+		return (BCOp)((immediate ? OP_JLTI : OP_JLT) + index);
+	}
+
+	/// Emit the jumps taken when cond evaluates to when, their indices are
+	/// added to jumps for patch. && and || jump as soon as an operand decides
+	/// and ! swaps the targets, so neither materializes a value. At -O1 a
+	/// comparison branches on its operands, against a constant right operand
+	/// directly.
+	void branch(Expr *cond, bool when, std::vector<int> &jumps)
+	{
+		cond = cond->IgnoreParens();
+		if (BinaryOperator *bop = dyn_cast<BinaryOperator>(cond))
+		{
+			if (bop->isLogicalOp())
+			{
+				/// a || b is true and a && b is false as soon as one operand is
+				if (when == (bop->getOpcode() == BO_LOr))
+				{
+					branch(bop->getLHS(), when, jumps);
+					branch(bop->getRHS(), when, jumps);
+					return;
+				}
+				std::vector<int> decided;
+				branch(bop->getLHS(), !when, decided);
+				branch(bop->getRHS(), when, jumps);
+				patch(decided, here());
+				return;
+			}
+			if (mOptLevel > 0 && bop->isComparisonOp())
+			{
+				BinaryOperatorKind kind = when ? bop->getOpcode() : BinaryOperator::negateComparisonOp(bop->getOpcode());
+				int left = expr(bop->getLHS(), -1);
+				int imm;
+				if (constant(bop->getRHS(), imm))
+				{
+					jumps.push_back(emit(branchOp(kind, true), left, imm, -1));
+					return;
+				}
+				int right = expr(bop->getRHS(), -1);
+				jumps.push_back(emit(branchOp(kind, false), left, right, -1));
+				return;
+			}
+		}
+		else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(cond))
+		{
+			if (uop->getOpcode() == UO_LNot)
+			{
+				branch(uop->getSubExpr(), !when, jumps);
+				return;
+			}
+		}
+		jumps.push_back(emit(when ? OP_JNZ : OP_JZ, expr(cond, -1), -1));
+	}
+
+	/// Evaluate expr, the result is put into dst unless dst is -1
+	int expr(Expr *expr, int dst)
+	{
+		int val;
+		if (!isa<IntegerLiteral>(expr) && constant(expr, val))
+		{
+			int reg = target(dst);
+			emit(OP_CONST, reg, val);
+			return reg;
+		}
+		if (IntegerLiteral *literal = dyn_cast<IntegerLiteral>(expr))
+		{
+			int reg = target(dst);
+			emit(OP_CONST, reg, literal->getValue().getSExtValue());
+			return reg;
+		}
+		else if (CharacterLiteral *literal = dyn_cast<CharacterLiteral>(expr))
+		{
+			int reg = target(dst);
+			emit(OP_CONST, reg, literal->getValue());
+			return reg;
+		}
+		else if (ParenExpr *paren = dyn_cast<ParenExpr>(expr))
+			return this->expr(paren->getSubExpr(), dst);
+		else if (UnaryExprOrTypeTraitExpr *uettexpr = dyn_cast<UnaryExprOrTypeTraitExpr>(expr))
+		{
+			if (uettexpr->getKind() != UETT_SizeOf || uettexpr->getTypeOfArgument()->isVariableArrayType())
+			{
+				unsupported(expr);
+				return target(dst);
+			}
+			int reg = target(dst);
+			emit(OP_CONST, reg, sizeOf(uettexpr->getTypeOfArgument()));
+			return reg;
+		}
+		else if (CastExpr *castexpr = dyn_cast<CastExpr>(expr))
+			return cast(castexpr, dst);
+		else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr))
+			return unop(uop, dst);
+		else if (BinaryOperator *bop = dyn_cast<BinaryOperator>(expr))
+			return binop(bop, dst);
+		else if (ConditionalOperator *condop = dyn_cast<ConditionalOperator>(expr))
+		{
+			std::vector<int> jfalse;
+			branch(condop->getCond(), false, jfalse);
+			int reg = target(dst);
+			this->expr(condop->getTrueExpr(), reg);
+			int jend = emit(OP_JMP, -1);
+			patch(jfalse, here());
+			this->expr(condop->getFalseExpr(), reg);
+			patch(jend);
+			return reg;
+		}
+		else if (CallExpr *callexpr = dyn_cast<CallExpr>(expr))
+			return call(callexpr, dst);
+		else if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr))
+		{
+			if (EnumConstantDecl *enumdecl = dyn_cast<EnumConstantDecl>(declref->getDecl()))
+			{
+				int reg = target(dst);
+				emit(OP_CONST, reg, enumdecl->getInitVal().getSExtValue());
+				return reg;
+			}
+		}
+		unsupported(expr);
+		return target(dst);
+	}
+
+	void decl(DeclStmt *declstmt)
+	{
+		for (Decl *decl : declstmt->decls())
+		{
+			VarDecl *vardecl = dyn_cast<VarDecl>(decl);
+			if (!vardecl)
+				continue;
+			if (mContext.getAsConstantArrayType(vardecl->getType()))
+				continue;
+			if (const VariableArrayType *vararrtype = mContext.getAsVariableArrayType(vardecl->getType()))
+			{
+				int reg = declare(vardecl);
+				int size = expr(vararrtype->getSizeExpr(), -1);
+				int elemsize = sizeOf(vararrtype->getElementType());
+				if (elemsize != 1)
+				{
+					int scaled = temp();
+					emit(OP_MULI, scaled, size, elemsize);
+					size = scaled;
+				}
+				emit(OP_ALLOCA, reg, size);
+			}
+			else if (vardecl->hasInit())
+				expr(vardecl->getInit(), declare(vardecl));
+			else
+				emit(OP_CONST, declare(vardecl), 0);
+		}
+	}
+
+	/// Compile the body of a loop, collecting its break and continue jumps
+	void loopBody(Stmt *body, std::vector<int> &breaks, std::vector<int> &continues)
+	{
+		std::vector<int> *outerBreaks = mBreaks;
+		std::vector<int> *outerContinues = mContinues;
+		mBreaks = &breaks;
+		mContinues = &continues;
+		stmt(body);
+		mBreaks = outerBreaks;
+		mContinues = outerContinues;
+	}
+
+	typedef std::vector<std::pair<int, const SwitchCase *>> CaseList;
+
+	/// Dispatch val over the cases [lo, hi) sorted by value. Dense runs index a
+	/// jump table, larger sparse ones are split in half by a comparison and the
+	/// last few cases are tested one by one. jumps receives the instruction and
+	/// the case index of every jump to a case, jdefault the jumps to the default
+	void dispatch(int val, const CaseList &cases, int lo, int hi, std::vector<std::pair<int, int>> &jumps,
+				  std::vector<int> &jdefault)
+	{
+		int count = hi - lo;
+		long long spread = (long long)cases[hi - 1].first - cases[lo].first + 1;
+		if (count >= MIN_TABLE_CASES && spread <= 2 * count)
+		{
+			/// Entries hold case indices until the labels are placed, -1 for the default
+			BCJumpTable table{cases[lo].first, std::vector<int>(spread, -1)};
+			for (int i = lo; i < hi; i++)
+				table.targets[cases[i].first - table.low] = i;
+			jdefault.push_back(emit(OP_SWITCH, val, mFunc->tables.size(), -1));
+			mFunc->tables.push_back(table);
+			return;
+		}
+		if (count < MIN_SEARCH_CASES)
+		{
+			for (int i = lo; i < hi; i++)
+				jumps.push_back(std::make_pair(emit(OP_JEQI, val, cases[i].first, -1), i));
+			jdefault.push_back(emit(OP_JMP, -1));
+			return;
+		}
+		int mid = lo + count / 2;
+		int jhigh = emit(OP_JGEI, val, cases[mid].first, -1);
+		dispatch(val, cases, lo, mid, jumps, jdefault);
+		patch(jhigh);
+		dispatch(val, cases, mid, hi, jumps, jdefault);
+	}
+
+	/// Whether a case or default label of an enclosing switch lies below stmt,
+	/// the labels of an inner switch belong to it
+	static bool hasCaseLabel(Stmt *stmt)
+	{
+		if (!stmt || isa<SwitchStmt>(stmt))
+			return false;
+		if (isa<SwitchCase>(stmt))
+			return true;
+		for (Stmt *child : stmt->children())
+			if (hasCaseLabel(child))
+				return true;
+		return false;
+	}
+
+	/// Position of a label compiled in the current function
+	int label(const SwitchCase *label)
+	{
+		std::map<const SwitchCase *, int>::iterator it = mLabels.find(label);
+		if (it != mLabels.end())
+			return it->second;
+		unsupported(const_cast<SwitchCase *>(label));
+		return 0;
+	}
+
+	void switchStmt(SwitchStmt *switchstmt)
+	{
+		int val = expr(switchstmt->getCond(), -1);
+		CaseList cases;
+		const SwitchCase *defaultLabel = nullptr;
+		for (const SwitchCase *label = switchstmt->getSwitchCaseList(); label; label = label->getNextSwitchCase())
+		{
+			const CaseStmt *casestmt = dyn_cast<CaseStmt>(label);
+			if (!casestmt)
+				defaultLabel = label;
+			else if (casestmt->caseStmtIsGNURange())
+				unsupported(const_cast<CaseStmt *>(casestmt));
+			else
+				cases.push_back(std::make_pair((int)casestmt->getLHS()->EvaluateKnownConstInt(mContext).getSExtValue(), label));
+		}
+		std::sort(cases.begin(), cases.end(),
+				  [](const std::pair<int, const SwitchCase *> &left, const std::pair<int, const SwitchCase *> &right) {
+					  return left.first < right.first;
+				  });
+
+		std::vector<std::pair<int, int>> jumps;
+		std::vector<int> jdefault;
+		int firstTable = mFunc->tables.size();
+		if (cases.empty())
+			jdefault.push_back(emit(OP_JMP, -1));
+		else
+			dispatch(val, cases, 0, cases.size(), jumps, jdefault);
+		int lastTable = mFunc->tables.size();
+
+		/// Continue statements in the body belong to the enclosing loop
+		std::vector<int> breaks;
+		std::vector<int> *outerBreaks = mBreaks;
+		mBreaks = &breaks;
+		stmt(switchstmt->getBody());
+		mBreaks = outerBreaks;
+		patch(breaks, here());
+
+		/// Values no case matches leave the switch if it has no default
+		int deflt = defaultLabel ? label(defaultLabel) : here();
+		patch(jdefault, deflt);
+		for (const std::pair<int, int> &jump : jumps)
+			*jumpTarget(mFunc->code[jump.first]) = label(cases[jump.second].second);
+		for (int t = firstTable; t < lastTable; t++)
+			for (int &entry : mFunc->tables[t].targets)
+				entry = entry < 0 ? deflt : label(cases[entry].second);
+	}
+
+	void stmt(Stmt *stmt)
+	{
+		if (!stmt)
+			return;
+		mNextReg = mLocalTop;
+		if (CompoundStmt *compound = dyn_cast<CompoundStmt>(stmt))
+		{
+			for (Stmt *child : compound->body())
+				this->stmt(child);
+		}
+		else if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt))
+			decl(declstmt);
+		else if (IfStmt *ifstmt = dyn_cast<IfStmt>(stmt))
+		{
+			int val;
+			if (constant(ifstmt->getCond(), val) && !hasCaseLabel(val ? ifstmt->getElse() : ifstmt->getThen()))
+			{
+				/// Only the branch that can run is compiled, unless a switch jumps into the other
+				this->stmt(val ? ifstmt->getThen() : ifstmt->getElse());
+				return;
+			}
+			std::vector<int> jelse;
+			branch(ifstmt->getCond(), false, jelse);
+			this->stmt(ifstmt->getThen());
+			if (Stmt *elsestmt = ifstmt->getElse())
+			{
+				int jend = emit(OP_JMP, -1);
+				patch(jelse, here());
+				this->stmt(elsestmt);
+				patch(jend);
+			}
+			else
+				patch(jelse, here());
+		}
+		else if (WhileStmt *whilestmt = dyn_cast<WhileStmt>(stmt))
+		{
+			int val;
+			bool known = constant(whilestmt->getCond(), val);
+			/// A loop that never runs is still compiled when a switch jumps into it
+			if (known && !val && !hasCaseLabel(whilestmt->getBody()))
+				return;
+			known = known && val;
+			/// Loops are rotated so every iteration takes a single branch
+			int jcond = known ? -1 : emit(OP_JMP, -1);
+			int top = here();
+			std::vector<int> breaks, continues;
+			loopBody(whilestmt->getBody(), breaks, continues);
+			patch(continues, here());
+			if (jcond >= 0)
+				patch(jcond);
+			mNextReg = mLocalTop;
+			if (known)
+				emit(OP_JMP, top);
+			else
+			{
+				std::vector<int> jtop;
+				branch(whilestmt->getCond(), true, jtop);
+				patch(jtop, top);
+			}
+			patch(breaks, here());
+		}
+		else if (ForStmt *forstmt = dyn_cast<ForStmt>(stmt))
+		{
+			this->stmt(forstmt->getInit());
+			int val;
+			bool known = forstmt->getCond() && constant(forstmt->getCond(), val);
+			if (known && !val && !hasCaseLabel(forstmt->getBody()))
+				return;
+			known = known && val;
+			int jcond = known || !forstmt->getCond() ? -1 : emit(OP_JMP, -1);
+			int top = here();
+			std::vector<int> breaks, continues;
+			loopBody(forstmt->getBody(), breaks, continues);
+			patch(continues, here());
+			this->stmt(forstmt->getInc());
+			if (jcond >= 0)
+				patch(jcond);
+			mNextReg = mLocalTop;
+			Expr *condexpr = forstmt->getCond();
+			if (condexpr && !known)
+			{
+				std::vector<int> jtop;
+				branch(condexpr, true, jtop);
+				patch(jtop, top);
+			}
+			else
+				emit(OP_JMP, top);
+			patch(breaks, here());
+		}
+		else if (SwitchStmt *switchstmt = dyn_cast<SwitchStmt>(stmt))
+			switchStmt(switchstmt);
+		else if (SwitchCase *label = dyn_cast<SwitchCase>(stmt))
+		{
+			mLabels[label] = here();
+			this->stmt(label->getSubStmt());
+		}
+		else if (isa<BreakStmt>(stmt) && mBreaks)
+			mBreaks->push_back(emit(OP_JMP, -1));
+		else if (isa<ContinueStmt>(stmt) && mContinues)
+			mContinues->push_back(emit(OP_JMP, -1));
+		else if (ReturnStmt *retstmt = dyn_cast<ReturnStmt>(stmt))
+		{
+			if (Expr *retexpr = retstmt->getRetValue())
+				emit(OP_RET, expr(retexpr, -1));
+			else
+				emit(OP_RET0);
+		}
+		else if (isa<NullStmt>(stmt))
+			return;
+		else if (Expr *e = dyn_cast<Expr>(stmt))
+		{
+			/// The previous value of a postfix update nobody reads is not kept
+			UnaryOperator *uop = dyn_cast<UnaryOperator>(e->IgnoreParens());
+			if (uop && uop->isIncrementDecrementOp())
+				update(uop->getSubExpr(), uop->isIncrementOp() ? BO_Add : BO_Sub, nullptr, false, -1);
+			else
+				expr(e, -1);
+		}
+		else
+			unsupported(stmt);
+	}
+
+	void function(const FunctionDecl *fdecl, BCFunction &func)
+	{
+		mFunc = &func;
+		mLocals.clear();
+		mLocalTop = 0;
+		mNextReg = 0;
+		mLabels.clear();
+		func.name = fdecl->getNameAsString();
+		func.numParams = fdecl->getNumParams();
+		func.numRegs = 0;
+		for (int i = 0; i < fdecl->getNumParams(); i++)
+			declare(fdecl->getParamDecl(i));
+
+		std::vector<const VarDecl *> arrays;
+		collectArrays(fdecl->getBody(), arrays);
+		for (const VarDecl *vardecl : arrays)
+		{
+			const ConstantArrayType *constarrtype = mContext.getAsConstantArrayType(vardecl->getType());
+			int size = constarrtype->getSize().getSExtValue() * sizeOf(constarrtype->getElementType());
+			int reg = declare(vardecl);
+			int sizereg = temp();
+			emit(OP_CONST, sizereg, size);
+			emit(OP_ALLOCA, reg, sizereg);
+		}
+
+		stmt(fdecl->getBody());
+		emit(OP_RET0);
+		if (mOptLevel > 0)
+			tailCalls(func, fdecl->getReturnType()->isVoidType());
+	}
+
+	/// Index of the instruction control reaches from pc, following unconditional jumps
+	static int follow(const BCFunction &func, int pc)
+	{
+		for (int hops = 0; pc < func.code.size() && func.code[pc].op == OP_JMP && hops < func.code.size(); hops++)
+			pc = func.code[pc].a;
+		return pc;
+	}
+
+	/// Turn calls whose result is returned right away into frame reusing tail calls.
+	/// The result of a call in a void function is dropped, so any call followed
+	/// by RET0 qualifies there. Functions with ALLOCA blocks keep their frames,
+	/// the arguments may point into them. Memoized callees are left to CALL,
+	/// which consults the cache.
+	void tailCalls(BCFunction &func, bool returnsVoid)
+	{
+		for (const BCInstr &in : func.code)
+			if (in.op == OP_ALLOCA)
+				return;
+		for (int pc = 0; pc + 1 < func.code.size(); pc++)
+		{
+			BCInstr &in = func.code[pc];
+			if (in.op != OP_CALL || mProgram.functions[in.b].memoize)
+				continue;
+			const BCInstr &next = func.code[follow(func, pc + 1)];
+			if ((next.op == OP_RET && next.a == in.a) || (next.op == OP_RET0 && returnsVoid))
+				in = BCInstr{OP_TAILCALL, in.b, in.c, 0};
+		}
+	}
+
+	void defineGlobal(const VarDecl *vardecl)
+	{
+		int size = sizeOf(vardecl->getType());
+		int addr = mProgram.data.size();
+		if (!isByte(vardecl->getType()) && addr % sizeof(int))
+			addr += sizeof(int) - addr % sizeof(int);
+		mProgram.data.resize(addr + size);
+		mGlobals[vardecl->getCanonicalDecl()] = addr;
+
+		Expr::EvalResult result;
+		if (const Expr *init = vardecl->getAnyInitializer())
+		{
+			if (!init->EvaluateAsInt(result, mContext))
+			{
+				unsupported(const_cast<Expr *>(init));
+				return;
+			}
+			int val = result.Val.getInt().getSExtValue();
+			if (isByte(vardecl->getType()))
+				mProgram.data[addr] = (char)val;
+			else
+				*(int *)&mProgram.data[addr] = val;
+		}
+	}
+
+public:
+	BytecodeCompiler(const ASTContext &context, BCProgram &program, int optLevel)
+		: mContext(context), mProgram(program), mOptLevel(optLevel), mMemoize(false), mFunctions(), mGlobals(), mFree(NULL), mMalloc(NULL),
+		  mInput(NULL), mOutput(NULL), mFunc(NULL), mLocals(), mLocalTop(0), mNextReg(0), mBreaks(NULL), mContinues(NULL),
+		  mLabels(), mFailed(false), mConsole(&Console::terminal())
+	{
+	}
+
+	void setMemoize(bool memoize)
+	{
+		mMemoize = memoize;
+	}
+
+	void setConsole(Console *console)
+	{
+		mConsole = console;
+	}
+
+	/// Compile the translation unit, returns false if it uses constructs the VM lacks
+	bool compile(TranslationUnitDecl *unit)
+	{
+		std::vector<const FunctionDecl *> bodies;
+		for (Decl *decl : unit->decls())
+		{
+			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(decl))
+			{
+				const FunctionDecl *canonical = fdecl->getCanonicalDecl();
+				if (fdecl->getName().equals("FREE"))
+					mFree = canonical;
+				else if (fdecl->getName().equals("MALLOC"))
+					mMalloc = canonical;
+				else if (fdecl->getName().equals("GET"))
+					mInput = canonical;
+				else if (fdecl->getName().equals("PRINT"))
+					mOutput = canonical;
+				else if (fdecl->doesThisDeclarationHaveABody())
+				{
+					mFunctions[canonical] = bodies.size();
+					bodies.push_back(fdecl);
+					if (fdecl->getName().equals("main"))
+						mProgram.entry = mFunctions[canonical];
+				}
+			}
+			else if (VarDecl *vardecl = dyn_cast<VarDecl>(decl))
+			{
+				if (global(vardecl) < 0)
+					defineGlobal(vardecl);
+			}
+		}
+
+		mProgram.functions.resize(bodies.size());
+		/// Known before the bodies are compiled, calls of memoized functions stay calls
+		if (mMemoize)
+		{
+			PurityAnalysis purity;
+			purity.run(unit, MemoCache::MAX_ARGS);
+			for (int i = 0; i < bodies.size(); i++)
+				mProgram.functions[i].memoize = purity.isPure(bodies[i]);
+		}
+		for (int i = 0; i < bodies.size(); i++)
+			function(bodies[i], mProgram.functions[i]);
+		return !mFailed && mProgram.entry >= 0;
+	}
+};
@@ -0,0 +1,282 @@
+//==--- BytecodeFile.h - Program images of compiled bytecode ---------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// A program image holds a BCProgram as little endian 32 bit words. It is
+/// position independent, every reference is an index or an offset from the
+/// start of the image, so it can be mapped and read in place. The header is
+/// followed by the sections it locates:
+///
+///   functions  name offset and size, parameters, registers, first and number
+///              of instructions, first and number of jump tables, flags
+///   code       op, a, b, c for every instruction, jump targets are indices
+///              into the code of the function, tables indices into its tables
+///   tables     low, first and number of targets
+///   targets    instruction indices
+///   strings    names of the functions, the constant pool of the image
+///   data       initial image of the globals
+///
+/// Constants live in the instructions, so strings are the only pool.
+const char BC_IMAGE_MAGIC[8] = {'A', 'S', 'T', 'B', 'C', '\r', '\n', '\x1a'};
+/// Bump whenever the layout or the meaning of an opcode changes
+const uint32_t BC_IMAGE_VERSION = 1;
+
+enum
+{
+	BC_FUNCTION_MEMOIZE = 1
+};
+
+/// Words of the header after the magic, of a function record, of a table record and of an instruction
+enum
+{
+	BC_HEADER_WORDS = 14,
+	BC_FUNCTION_WORDS = 9,
+	BC_TABLE_WORDS = 3,
+	BC_INSTR_WORDS = 4
+};
+
+class BCImageWriter
+{
+	llvm::raw_ostream &mOS;
+
+	void word(int32_t value)
+	{
+		llvm::support::endian::write<int32_t>(mOS, value, llvm::support::little);
+	}
+
+public:
+	explicit BCImageWriter(llvm::raw_ostream &os) : mOS(os)
+	{
+	}
+
+	void write(const BCProgram &program)
+	{
+		int numFunctions = program.functions.size();
+		int numInstrs = 0, numTables = 0, numTargets = 0, stringsSize = 0;
+		for (const BCFunction &func : program.functions)
+		{
+			numInstrs += func.code.size();
+			numTables += func.tables.size();
+			for (const BCJumpTable &table : func.tables)
+				numTargets += table.targets.size();
+			stringsSize += func.name.size();
+		}
+		int functions = sizeof(BC_IMAGE_MAGIC) + BC_HEADER_WORDS * 4;
+		int code = functions + numFunctions * BC_FUNCTION_WORDS * 4;
+		int tables = code + numInstrs * BC_INSTR_WORDS * 4;
+		int targets = tables + numTables * BC_TABLE_WORDS * 4;
+		int strings = targets + numTargets * 4;
+		int data = strings + stringsSize;
+
+		mOS.write(BC_IMAGE_MAGIC, sizeof(BC_IMAGE_MAGIC));
+		for (int value : {(int)BC_IMAGE_VERSION, program.entry, numFunctions, functions, numInstrs, code, numTables,
+						  tables, numTargets, targets, stringsSize, strings, (int)program.data.size(), data})
+			word(value);
+
+		int firstInstr = 0, firstTable = 0, name = 0;
+		for (const BCFunction &func : program.functions)
+		{
+			for (int value : {name, (int)func.name.size(), func.numParams, func.numRegs, firstInstr,
+							  (int)func.code.size(), firstTable, (int)func.tables.size(),
+							  func.memoize ? (int)BC_FUNCTION_MEMOIZE : 0})
+				word(value);
+			name += func.name.size();
+			firstInstr += func.code.size();
+			firstTable += func.tables.size();
+		}
+		for (const BCFunction &func : program.functions)
+			for (const BCInstr &in : func.code)
+			{
+				word(in.op);
+				word(in.a);
+				word(in.b);
+				word(in.c);
+			}
+		int firstTarget = 0;
+		for (const BCFunction &func : program.functions)
+			for (const BCJumpTable &table : func.tables)
+			{
+				word(table.low);
+				word(firstTarget);
+				word(table.targets.size());
+				firstTarget += table.targets.size();
+			}
+		for (const BCFunction &func : program.functions)
+			for (const BCJumpTable &table : func.tables)
+				for (int target : table.targets)
+					word(target);
+		for (const BCFunction &func : program.functions)
+			mOS << func.name;
+		mOS.write(program.data.data(), program.data.size());
+	}
+};
+
+/// BCImageReader loads a program image, checking that every section lies
+/// inside the image and that every instruction names existing registers,
+/// jump targets, tables, functions and globals and divides by the size of
+/// an element, so the VM can run it as it runs freshly compiled code.
+class BCImageReader
+{
+	llvm::StringRef mImage;
+	std::string mError;
+
+	bool fail(const std::string &message)
+	{
+		mError = message;
+		return false;
+	}
+
+	int32_t word(uint64_t offset)
+	{
+		return llvm::support::endian::read32le(mImage.data() + offset);
+	}
+
+	/// Whether count records of size bytes starting at offset lie inside the image
+	bool inside(int64_t offset, int64_t count, int64_t size)
+	{
+		return offset >= 0 && count >= 0 && offset + count * size <= (int64_t)mImage.size();
+	}
+
+	bool check(const BCProgram &program, const BCFunction &func)
+	{
+		int size = func.code.size();
+		if (func.numParams < 0 || func.numRegs < func.numParams)
+			return fail("bad frame of " + func.name);
+		for (const BCInstr &in : func.code)
+		{
+			if (in.op >= OP_COUNT)
+				return fail("bad opcode in " + func.name);
+			unsigned operands = registerOperands(in.op);
+			if (((operands & OPERAND_A) && (in.a < 0 || in.a >= func.numRegs)) ||
+				((operands & OPERAND_B) && (in.b < 0 || in.b >= func.numRegs)) ||
+				((operands & OPERAND_C) && (in.c < 0 || in.c >= func.numRegs)))
+				return fail("bad register in " + func.name);
+			if (const int *target = jumpTarget(in))
+				if (*target < 0 || *target >= size)
+					return fail("bad jump target in " + func.name);
+			if (in.op == OP_SWITCH && (in.b < 0 || in.b >= func.tables.size()))
+				return fail("bad jump table in " + func.name);
+			/// Globals are the data section at address 0, its size was checked against the image
+			int global = in.op == OP_LDG_I || in.op == OP_LDG_C ? in.b : in.a;
+			int width = in.op == OP_LDG_I || in.op == OP_STG_I ? 4 : 1;
+			if ((in.op == OP_LDG_I || in.op == OP_LDG_C || in.op == OP_STG_I || in.op == OP_STG_C) &&
+				(global < 0 || (int64_t)global + width > (int64_t)program.data.size()))
+				return fail("bad global address in " + func.name);
+			/// The compiler divides only by element sizes, dividing by 0 or INT_MIN by -1 would trap the host
+			if (in.op == OP_DIVI && in.c <= 0)
+				return fail("bad divisor in " + func.name);
+			if (in.op == OP_CALL || in.op == OP_TAILCALL)
+			{
+				int callee = in.op == OP_CALL ? in.b : in.a;
+				int args = in.op == OP_CALL ? in.c : in.b;
+				if (callee < 0 || callee >= program.functions.size())
+					return fail("bad callee in " + func.name);
+				if (args + program.functions[callee].numParams > func.numRegs)
+					return fail("bad arguments in " + func.name);
+			}
+		}
+		if (size == 0 || !(func.code.back().op == OP_RET || func.code.back().op == OP_RET0 ||
+						   func.code.back().op == OP_JMP || func.code.back().op == OP_TAILCALL ||
+						   func.code.back().op == OP_SWITCH))
+			return fail("code of " + func.name + " runs off its end");
+		for (const BCJumpTable &table : func.tables)
+			for (int target : table.targets)
+				if (target < 0 || target >= size)
+					return fail("bad jump table target in " + func.name);
+		return true;
+	}
+
+public:
+	BCImageReader() : mImage(), mError()
+	{
+	}
+
+	/// Fill program from image, false with getError set if it is not a valid image
+	bool read(llvm::StringRef image, BCProgram &program)
+	{
+		mImage = image;
+		int header = sizeof(BC_IMAGE_MAGIC);
+		if (!inside(0, 1, header + BC_HEADER_WORDS * 4) || memcmp(image.data(), BC_IMAGE_MAGIC, header) != 0)
+			return fail("not a bytecode image");
+		if (word(header) != BC_IMAGE_VERSION)
+			return fail("bytecode image version " + std::to_string(word(header)) + ", expected " +
+						std::to_string(BC_IMAGE_VERSION));
+		int32_t fields[BC_HEADER_WORDS];
+		for (int i = 0; i < BC_HEADER_WORDS; i++)
+			fields[i] = word(header + i * 4);
+		int entry = fields[1];
+		int numFunctions = fields[2], functions = fields[3];
+		int numInstrs = fields[4], code = fields[5];
+		int numTables = fields[6], tables = fields[7];
+		int numTargets = fields[8], targets = fields[9];
+		int stringsSize = fields[10], strings = fields[11];
+		int dataSize = fields[12], data = fields[13];
+		if (!inside(functions, numFunctions, BC_FUNCTION_WORDS * 4) || !inside(code, numInstrs, BC_INSTR_WORDS * 4) ||
+			!inside(tables, numTables, BC_TABLE_WORDS * 4) || !inside(targets, numTargets, 4) ||
+			!inside(strings, stringsSize, 1) || !inside(data, dataSize, 1))
+			return fail("truncated bytecode image");
+		if (entry < 0 || entry >= numFunctions)
+			return fail("bad entry function");
+
+		program.functions.resize(numFunctions);
+		for (int index = 0; index < numFunctions; index++)
+		{
+			int record = functions + index * BC_FUNCTION_WORDS * 4;
+			int32_t field[BC_FUNCTION_WORDS];
+			for (int i = 0; i < BC_FUNCTION_WORDS; i++)
+				field[i] = word(record + i * 4);
+			if (field[0] < 0 || field[1] < 0 || (int64_t)field[0] + field[1] > stringsSize || field[4] < 0 ||
+				field[5] < 0 || (int64_t)field[4] + field[5] > numInstrs || field[6] < 0 || field[7] < 0 ||
+				(int64_t)field[6] + field[7] > numTables)
+				return fail("bad function record");
+			BCFunction &func = program.functions[index];
+			func.name = image.substr(strings + field[0], field[1]).str();
+			func.numParams = field[2];
+			func.numRegs = field[3];
+			func.memoize = field[8] & BC_FUNCTION_MEMOIZE;
+			func.code.resize(field[5]);
+			for (int pc = 0; pc < field[5]; pc++)
+			{
+				int instr = code + (field[4] + pc) * BC_INSTR_WORDS * 4;
+				uint32_t op = word(instr);
+				func.code[pc] = BCInstr{op < OP_COUNT ? (BCOp)op : OP_COUNT, word(instr + 4), word(instr + 8),
+										word(instr + 12)};
+			}
+			func.tables.resize(field[7]);
+			for (int i = 0; i < field[7]; i++)
+			{
+				int table = tables + (field[6] + i) * BC_TABLE_WORDS * 4;
+				int first = word(table + 4), count = word(table + 8);
+				if (first < 0 || count < 0 || (int64_t)first + count > numTargets)
+					return fail("bad jump table record");
+				func.tables[i].low = word(table);
+				func.tables[i].targets.resize(count);
+				for (int j = 0; j < count; j++)
+					func.tables[i].targets[j] = word(targets + (first + j) * 4);
+			}
+		}
+		program.data.assign(image.data() + data, image.data() + data + dataSize);
+		for (const BCFunction &func : program.functions)
+			if (!check(program, func))
+				return false;
+		program.entry = entry;
+		return true;
+	}
+
+	const std::string &getError()
+	{
+		return mError;
+	}
+};
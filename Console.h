@@ -0,0 +1,66 @@
+//==--- Console.h - Input and output of an interpreted program -------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <stdio.h>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Console is what a program reads with GET and where PRINT, the GET prompt
+/// and the messages of its run go. The terminal console reads stdin and
+/// writes stderr, batch runs give every program a console of its own that
+/// reads its input from memory and writes to a stream of its own, so
+/// programs running side by side on several threads share no stream.
+class Console
+{
+	llvm::raw_ostream &mOut;
+	/// Input not read yet, unused on the terminal
+	llvm::StringRef mInput;
+	bool mTerminal;
+
+	explicit Console(llvm::raw_ostream &out) : mOut(out), mInput(), mTerminal(true)
+	{
+	}
+
+public:
+	Console(llvm::StringRef input, llvm::raw_ostream &out) : mOut(out), mInput(input), mTerminal(false)
+	{
+	}
+
+	/// The console of the interpreter process
+	static Console &terminal()
+	{
+		static Console console(llvm::errs());
+		return console;
+	}
+
+	/// Prompt for a decimal integer and read it as scanf("%d") does, 0 if there is none
+	int get()
+	{
+		mOut << "Please Input an Integer Value : ";
+		int val = 0;
+		if (mTerminal)
+		{
+			scanf("%d", &val);
+			return val;
+		}
+		mInput = mInput.ltrim();
+		/// consumeInteger takes a minus sign but no plus sign
+		llvm::StringRef rest = mInput.startswith("+") && !mInput.startswith("+-") ? mInput.drop_front() : mInput;
+		if (rest.consumeInteger(10, val))
+			return 0;
+		mInput = rest;
+		return val;
+	}
+
+	void print(int val)
+	{
+		mOut << val;
+	}
+
+	llvm::raw_ostream &out()
+	{
+		return mOut;
+	}
+};
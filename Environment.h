@@ -1,6 +1,10 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool --------------===//
 //===----------------------------------------------------------------------===//
-#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/Decl.h"
@@ -8,261 +12,876 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include "Console.h"
+#include "Memo.h"
+#include "Memory.h"
+#include "Purity.h"
 
 using namespace clang;
 
-/// Heap maps address to a value
-class Heap
+/// Heap holds the global variables followed by the MALLOC blocks
+typedef Memory Heap;
+
+/// Number of nested calls allowed unless --max-depth says otherwise
+const size_t DEFAULT_MAX_DEPTH = 1000000;
+/// Switches with fewer cases search them instead of indexing a table
+const size_t MIN_DENSE_CASES = 4;
+
+/// Shape of a value as far as the walker cares, derived once from its Clang type
+enum ValueKind : unsigned char
+{
+	VK_OTHER,
+	VK_CHAR,
+	VK_INT,
+	VK_POINTER,
+	VK_CONST_ARRAY,
+	VK_VAR_ARRAY
+};
+
+/// Location of a variable, resolved once before execution
+struct VarSlot
+{
+	/// Index into the StackFrame slots, or address in the Heap for globals
+	int index;
+	bool global;
+	ValueKind kind;
+};
+
+/// What the left side of an assignment denotes
+enum TargetKind : unsigned char
+{
+	TK_NONE,
+	TK_VAR,
+	TK_ELEMENT,
+	TK_DEREF
+};
+
+/// What a call expression invokes
+enum CallTarget : unsigned char
+{
+	CALL_USER,
+	CALL_UNDEFINED,
+	CALL_INPUT,
+	CALL_OUTPUT,
+	CALL_MALLOC,
+	CALL_FREE
+};
+
+/// Slot count and constant array bytes of a function, computed before execution
+struct FrameLayout
+{
+	int numSlots;
+	int arrayBytes;
+};
+
+/// Everything a call needs, resolved once per call site by annotate
+struct CallSite
+{
+	CallTarget target;
+	unsigned numArgs;
+	/// Definition of a user function, its frame layout and body
+	FunctionDecl *callee;
+	FrameLayout layout;
+	Stmt *body;
+	/// The caller returns the result right away, the callee reuses its frame
+	bool tail;
+	/// Index of a memoized callee in the memo table, -1 if its calls are not cached
+	int memo;
+};
+
+/// A label below a statement of a switch body, like the labels of Duff's device
+struct NestedLabel
+{
+	/// Index of the body statement holding the label
+	int index;
+	/// Statements from that body statement down to the label
+	std::vector<Stmt *> path;
+};
+
+/// Where a switch statement continues, resolved once per switch by init.
+/// Execution enters the body at the statement holding the matching label.
+/// Entries are indices of body statements, entries above the number of body
+/// statements stand for nested[entry - statements - 1]
+struct SwitchTable
+{
+	/// Dense cases map value - low to their entry
+	int low;
+	std::vector<int> dense;
+	/// Sparse cases keep (value, entry) pairs sorted by value instead
+	std::vector<std::pair<int, int>> sorted;
+	/// Entry for values without a case, the number of body statements if there is no default
+	int deflt;
+	int statements;
+	std::vector<NestedLabel> nested;
+	/// A label is a case range
+	bool unsupported;
+};
+
+/// Facts about an expression computed by annotate, so executing it needs no type queries
+struct NodeInfo
+{
+	/// Kind of the value a reference reads or sizeof measures
+	ValueKind kind;
+	/// Target of an assignment, parentheses already stripped
+	TargetKind target;
+	/// sizeof(expr) leaves the value of its operand on the operand stack
+	bool operand;
+	/// Bytes read or written through a pointer, or by an update of a variable,
+	/// 0 if the pointee is not a scalar. For sizeof the size, or the element
+	/// size of a variable array
+	int width;
+	/// Factors applied to the operands of pointer arithmetic
+	int leftScale;
+	int rightScale;
+	/// Variable read by a reference or written by an assignment
+	VarSlot var;
+};
+
+/// FrameArena holds the frames of all active calls back to back,
+/// pushing and popping a frame only moves the top
+class FrameArena
 {
-	/// Heap maps Variable Declaration to Addresses (represented using an Integer value)
-	std::map<Decl *, int> mVars;
-	/// Heap maps Addresses to Values
-	std::vector<char> mValues;
-	/// FreeList maps Addresses to Intervals
-	std::vector<std::pair<int, int>> mFreeList;
-	/// OccupiedList maps Addresses to Interval Size
-	std::map<int, int> mOccupied;
+	std::vector<char> mBytes;
+	size_t mTop;
 
 public:
-	Heap() : mVars(), mValues(), mFreeList()
+	FrameArena() : mBytes(), mTop(0)
+	{
+	}
+
+	/// Carve size zeroed bytes from the top, returns their offset
+	size_t push(size_t size)
+	{
+		size_t addr = mTop;
+		mTop += size;
+		if (mBytes.size() < mTop)
+			mBytes.resize(mTop > 2 * mBytes.size() ? mTop : 2 * mBytes.size());
+		if (size)
+			memset(&mBytes[addr], 0, size);
+		return addr;
+	}
+
+	/// Release everything above addr
+	void pop(size_t addr)
+	{
+		assert(addr <= mTop);
+		mTop = addr;
+	}
+
+	size_t top()
+	{
+		return mTop;
+	}
+
+	int &word(size_t addr)
+	{
+		return *(int *)&mBytes[addr];
+	}
+};
+
+class StackFrame
+{
+	/// StackFrame maps Variable slots to Value
+	/// Which are either integer or addresses (also represented using an Integer value)
+	/// The slots are followed by the constant arrays of the function in the arena,
+	/// variable arrays are carved above them while the frame is on top
+	FrameArena *mArena;
+	size_t mSlots;
+	size_t mArrays;
+	/// Height of the operand stack when the frame was entered
+	size_t mBase;
+
+public:
+	StackFrame(FrameArena &arena, const FrameLayout &layout, size_t base)
+		: mArena(&arena), mSlots(arena.push(layout.numSlots * sizeof(int) + layout.arrayBytes)),
+		  mArrays(mSlots + layout.numSlots * sizeof(int)), mBase(base)
+	{
+	}
+
+	/// Give the frame memory back to the arena
+	void release()
+	{
+		mArena->pop(mSlots);
+	}
+
+	void setSlot(int index, int val)
+	{
+		mArena->word(mSlots + index * sizeof(int)) = val;
+	}
+
+	int getSlot(int index)
+	{
+		return mArena->word(mSlots + index * sizeof(int));
+	}
+
+	size_t getBase()
 	{
+		return mBase;
 	}
 
+	/// Frame relative address of a variable array of size bytes
 	int Malloc(int size)
 	{
-		for (int i = 0; i < mFreeList.size(); i++)
+		return mArena->push(size) - mArrays;
+	}
+
+	void Update(int addr, int val)
+	{
+		mArena->word(mArrays + addr) = val;
+	}
+
+	int get(int addr)
+	{
+		return mArena->word(mArrays + addr);
+	}
+};
+
+class Environment
+{
+	std::vector<StackFrame> mStack;
+	FrameArena mArena;
+	/// Values of the expressions being evaluated, shared by all frames
+	std::vector<int> mOperands;
+	Heap mHeap;
+
+	/// Slots of the variables and frame layouts of the functions, computed by init
+	llvm::DenseMap<Decl *, VarSlot> mSlots;
+	llvm::DenseMap<FunctionDecl *, FrameLayout> mLayouts;
+	/// Frame relative addresses of the local constant arrays
+	llvm::DenseMap<Decl *, int> mArrayOffsets;
+	/// Per node facts of every function body, computed by init
+	llvm::DenseMap<Stmt *, NodeInfo> mNodes;
+	llvm::DenseMap<CallExpr *, CallSite> mCallSites;
+	llvm::DenseMap<SwitchStmt *, SwitchTable> mSwitches;
+	/// Expression nodes seen and dropped by canonicalize
+	unsigned mExprNodes;
+	unsigned mRemovedNodes;
+	/// Optimization level, 0 disables fold and tail calls
+	int mOptLevel;
+	/// Expressions replaced by literals and statements removed by fold
+	unsigned mFoldedNodes;
+	unsigned mPrunedStmts;
+
+	FunctionDecl *mFree; /// Declartions to the built-in functions
+	FunctionDecl *mMalloc;
+	FunctionDecl *mInput;
+	FunctionDecl *mOutput;
+
+	FunctionDecl *mEntry;
+
+	/// Calls deeper than mMaxDepth trap instead of overflowing the host stack
+	size_t mMaxDepth;
+	/// The walker traps as well when its host stack grows below this address,
+	/// statements and expressions nest without calls. 0 before it is known
+	uintptr_t mStackLimit;
+	bool mTrapped;
+	/// Set by call when it replaced the current frame instead of pushing one
+	bool mTailCalled;
+
+	/// Pure functions whose results are cached when mMemoize is set, by memo index
+	bool mMemoize;
+	std::vector<FunctionDecl *> mMemoized;
+	llvm::DenseMap<FunctionDecl *, int> mMemoIds;
+	MemoCache mMemo;
+	/// Key of a memoized call still running and the number of frames while it runs
+	struct MemoCall
+	{
+		size_t depth;
+		MemoCache::Key key;
+	};
+	std::vector<MemoCall> mMemoCalls;
+
+	/// Where GET reads, PRINT writes and errors are reported
+	Console *mConsole;
+
+	/// Give every parameter and local variable of a function a dense slot number
+	void resolve(FunctionDecl *fdecl)
+	{
+		FrameLayout layout = {0, 0};
+		for (unsigned i = 0; i < fdecl->getNumParams(); i++)
 		{
-			if (mFreeList[i].second - mFreeList[i].first >= size)
-			{
-				int addr = mFreeList[i].first;
-				mFreeList[i].first += size;
-				if (mFreeList[i].first == mFreeList[i].second)
-					mFreeList.erase(mFreeList.begin() + i);
-				mOccupied[addr] = size;
-				return addr;
-			}
+			ParmVarDecl *param = fdecl->getParamDecl(i);
+			mSlots[param] = VarSlot{layout.numSlots++, false, classify(param->getType())};
 		}
-		int addr = mValues.size();
-		mValues.resize(mValues.size() + size);
-		mOccupied[addr] = size;
-		return addr;
+		resolveLocals(fdecl->getBody(), layout);
+		mLayouts[fdecl] = layout;
 	}
-	void Free(int addr)
+
+	void resolveLocals(Stmt *stmt, FrameLayout &layout)
 	{
-		assert(mOccupied.find(addr) != mOccupied.end());
-		int size = mOccupied[addr];
-		mOccupied.erase(addr);
-		for (int i = 0; i < mFreeList.size(); i++)
+		if (!stmt)
+			return;
+		if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt))
 		{
-			if (mFreeList[i].first == addr + size)
-			{
-				mFreeList[i].first = addr;
-				return;
-			}
-			else if (mFreeList[i].second == addr)
-			{
-				mFreeList[i].second = addr + size;
-				if (addr + size == mValues.size())
+			for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++it)
+				if (VarDecl *vardecl = dyn_cast<VarDecl>(*it))
 				{
-					mValues.resize(mFreeList.back().second - mFreeList.back().first);
-					mFreeList.pop_back();
+					mSlots[vardecl] = VarSlot{layout.numSlots++, false, classify(vardecl->getType())};
+					if (const ConstantArrayType *constarrtype = dyn_cast<ConstantArrayType>(vardecl->getType()))
+					{
+						mArrayOffsets[vardecl] = layout.arrayBytes;
+						layout.arrayBytes += constarrtype->getSize().getSExtValue() * sizeof(int);
+					}
 				}
-				return;
-			}
-			else if (mFreeList[i].first > addr + size)
-			{
-				mFreeList.insert(mFreeList.begin() + i, std::make_pair(addr, addr + size));
-				return;
-			}
 		}
-		mFreeList.push_back(std::make_pair(addr, addr + size));
-		if (addr + size == mValues.size())
+		for (Stmt *child : stmt->children())
+			resolveLocals(child, layout);
+	}
+
+	/// Give every global variable a fixed offset in the data segment
+	void resolveGlobals(std::vector<VarDecl *> &globals)
+	{
+		int size = 0;
+		for (VarDecl *vdecl : globals)
 		{
-			mValues.resize(mFreeList.back().second - mFreeList.back().first);
-			mFreeList.pop_back();
+			VarDecl *canonical = vdecl->getCanonicalDecl();
+			if (mSlots.find(canonical) == mSlots.end())
+			{
+				mSlots[canonical] = VarSlot{size, true, classify(vdecl->getType())};
+				if (vdecl->getType()->isCharType())
+					size += sizeof(char);
+				else if (vdecl->getType()->isIntegerType())
+					size += sizeof(int);
+				else if (vdecl->getType()->isPointerType())
+					size += sizeof(int *);
+			}
+			VarSlot var = mSlots[canonical];
+			mSlots[vdecl] = var;
 		}
+		/// The data segment starts at address 0, so offsets are addresses
+		mHeap.Reserve(size);
 	}
-	void Update(int addr, int val)
+
+	VarSlot &slot(Decl *decl)
+	{
+		llvm::DenseMap<Decl *, VarSlot>::iterator it = mSlots.find(decl);
+		assert(it != mSlots.end());
+		return it->second;
+	}
+
+	int load(const VarSlot &var)
 	{
-		*(int *)&mValues[addr] = val;
+		if (!var.global)
+			return mStack.back().getSlot(var.index);
+		if (var.kind == VK_CHAR)
+			return mHeap.getChar(var.index);
+		return mHeap.getInt(var.index);
 	}
-	void Update(int addr, char val)
+
+	void store(const VarSlot &var, int val)
 	{
-		*(char *)&mValues[addr] = val;
+		if (!var.global)
+			mStack.back().setSlot(var.index, val);
+		else if (var.kind == VK_CHAR)
+			mHeap.Update(var.index, (char)val);
+		else
+			mHeap.Update(var.index, val);
 	}
 
-	int getInt(int addr)
+	static ValueKind classify(QualType type)
 	{
-		return *(int *)&mValues[addr];
+		if (type->isCharType())
+			return VK_CHAR;
+		if (type->isIntegerType())
+			return VK_INT;
+		if (type->isPointerType())
+			return VK_POINTER;
+		if (isa<ConstantArrayType>(type))
+			return VK_CONST_ARRAY;
+		if (isa<VariableArrayType>(type))
+			return VK_VAR_ARRAY;
+		return VK_OTHER;
 	}
 
-	char getChar(int addr)
+	/// Bytes moved by a load or store of type, 0 for non scalar types
+	static int accessWidth(QualType type)
 	{
-		return *(char *)&mValues[addr];
+		if (type->isCharType())
+			return sizeof(char);
+		if (type->isIntegerType() || type->isPointerType())
+			return sizeof(int);
+		return 0;
 	}
 
-	void bindDecl(Decl *decl, int val)
+	/// Factor pointer arithmetic applies to offsets from a pointer of type
+	static int pointerScale(QualType type)
 	{
-		if (mVars.find(decl) == mVars.end())
+		if (!type->isPointerType())
+			return 1;
+		QualType pointee = type->getPointeeType();
+		if (pointee->isCharType())
+			return sizeof(char);
+		if (pointee->isIntegerType())
+			return sizeof(int);
+		if (pointee->isPointerType())
+			return sizeof(int *);
+		return 1;
+	}
+
+	CallSite callSite(CallExpr *callexpr)
+	{
+		CallSite site = {CALL_UNDEFINED, callexpr->getNumArgs(), nullptr, FrameLayout{0, 0}, nullptr, false, -1};
+		FunctionDecl *callee = callexpr->getDirectCallee();
+		if (!callee)
+			return site;
+		if (callee == mInput)
+			site.target = CALL_INPUT;
+		else if (callee == mOutput)
+			site.target = CALL_OUTPUT;
+		else if (callee == mMalloc)
+			site.target = CALL_MALLOC;
+		else if (callee == mFree)
+			site.target = CALL_FREE;
+		else if (FunctionDecl *definition = callee->getDefinition())
 		{
-			if (VarDecl *vardecl = dyn_cast<VarDecl>(decl))
-			{
-				if (vardecl->getType()->isCharType())
-				{
-					mVars[decl] = Malloc(sizeof(char));
-					Update(mVars[decl], (char)val);
-				}
-				else if (vardecl->getType()->isIntegerType())
-				{
-					mVars[decl] = Malloc(sizeof(int));
-					Update(mVars[decl], val);
-				}
-				else if (vardecl->getType()->isPointerType())
-				{
-					mVars[decl] = Malloc(sizeof(int *));
-					Update(mVars[decl], val);
-				}
-			}
+			site.target = CALL_USER;
+			site.callee = definition;
+			site.layout = mLayouts.lookup(definition);
+			site.body = definition->getBody();
+			llvm::DenseMap<FunctionDecl *, int>::iterator memo = mMemoIds.find(definition);
+			if (memo != mMemoIds.end())
+				site.memo = memo->second;
 		}
 		else
+			site.callee = callee;
+		return site;
+	}
+
+	/// True if a local array is declared below stmt, arguments may point into it
+	static bool ownsArrays(Stmt *stmt)
+	{
+		if (!stmt)
+			return false;
+		if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt))
+			for (Decl *decl : declstmt->decls())
+				if (VarDecl *vardecl = dyn_cast<VarDecl>(decl))
+					if (vardecl->getType()->isArrayType())
+						return true;
+		for (Stmt *child : stmt->children())
+			if (ownsArrays(child))
+				return true;
+		return false;
+	}
+
+	/// Make expr a tail call if it calls a user function, runs after canonicalize
+	/// so a cast left around a call truncates its result
+	void markTailCall(Expr *expr)
+	{
+		if (CallExpr *callexpr = dyn_cast<CallExpr>(expr))
 		{
-			if (VarDecl *vardecl = dyn_cast<VarDecl>(decl))
-			{
-				if (vardecl->getType()->isCharType())
-					Update(mVars[decl], (char)val);
-				else if (vardecl->getType()->isIntegerType())
-					Update(mVars[decl], val);
-				else if (vardecl->getType()->isPointerType())
-					Update(mVars[decl], val);
-			}
+			CallSite &site = mCallSites[callexpr];
+			if (site.target == CALL_USER && site.memo < 0)
+				site.tail = true;
 		}
 	}
 
-	int getDeclVal(Decl *decl)
+	/// Every return of a call is a tail call
+	void markReturns(Stmt *stmt)
 	{
-		assert(mVars.find(decl) != mVars.end());
-		if (VarDecl *vardecl = dyn_cast<VarDecl>(decl))
+		if (!stmt)
+			return;
+		if (ReturnStmt *retstmt = dyn_cast<ReturnStmt>(stmt))
 		{
-			if (vardecl->getType()->isCharType())
-				return getChar(mVars[decl]);
-			else if (vardecl->getType()->isIntegerType())
-				return getInt(mVars[decl]);
-			else if (vardecl->getType()->isPointerType())
-				return getInt(mVars[decl]);
+			if (retstmt->getRetValue())
+				markTailCall(retstmt->getRetValue());
+			return;
 		}
-		assert(false);
+		for (Stmt *child : stmt->children())
+			markReturns(child);
 	}
-};
-
-class StackFrame
-{
-	/// StackFrame maps Variable Declaration to Value
-	/// Which are either integer or addresses (also represented using an Integer value)
-	std::map<Decl *, int> mVars;
-	std::map<Stmt *, int> mExprs;
-	std::vector<char> mValues;
-	/// The current stmt
-	Stmt *mPC;
-	Heap *mHeap;
 
-public:
-	StackFrame(Heap *mHeap) : mVars(), mExprs(), mValues(), mPC(), mHeap(mHeap)
+	/// A void function returns after the last statement of its body, so a call
+	/// there is a tail call too
+	void markTail(Stmt *stmt)
 	{
+		if (!stmt)
+			return;
+		if (CompoundStmt *compound = dyn_cast<CompoundStmt>(stmt))
+		{
+			if (!compound->body_empty())
+				markTail(compound->body_back());
+		}
+		else if (IfStmt *ifstmt = dyn_cast<IfStmt>(stmt))
+		{
+			markTail(ifstmt->getThen());
+			markTail(ifstmt->getElse());
+		}
+		else if (Expr *expr = dyn_cast<Expr>(stmt))
+			markTailCall(expr);
 	}
 
-	void initDecl(Decl *decl, int val)
+	/// Build the table of every switch below stmt
+	void switches(Stmt *stmt, ASTContext &context)
 	{
-		mVars[decl] = val;
+		if (!stmt)
+			return;
+		if (SwitchStmt *switchstmt = dyn_cast<SwitchStmt>(stmt))
+			mSwitches[switchstmt] = switchTable(switchstmt, context);
+		for (Stmt *child : stmt->children())
+			switches(child, context);
 	}
 
-	void bindDecl(Decl *decl, int val)
+	/// Record the entry of every label below path.back(), the labels of inner switches are theirs
+	void findLabels(int index, std::vector<Stmt *> &path, SwitchTable &table, llvm::DenseMap<SwitchCase *, int> &where)
 	{
-		if (mVars.find(decl) == mVars.end())
+		for (Stmt *child : path.back()->children())
 		{
-			mHeap->bindDecl(decl, val);
+			if (!child || isa<Expr>(child) || isa<SwitchStmt>(child))
+				continue;
+			path.push_back(child);
+			if (SwitchCase *label = dyn_cast<SwitchCase>(child))
+			{
+				where[label] = table.statements + 1 + (int)table.nested.size();
+				table.nested.push_back(NestedLabel{index, path});
+			}
+			findLabels(index, path, table, where);
+			path.pop_back();
 		}
-		else
-			mVars[decl] = val;
 	}
 
-	bool hasDeclVal(Decl *decl)
+	/// Labels at the top of a body statement, directly or below other labels,
+	/// enter at that statement, the others through the path down to them.
+	/// Cases filling at least half of the range they span get a dense table
+	SwitchTable switchTable(SwitchStmt *switchstmt, ASTContext &context)
 	{
-		return mVars.find(decl) != mVars.end();
+		CompoundStmt *compound = dyn_cast<CompoundStmt>(switchstmt->getBody());
+		unsigned count = compound ? compound->size() : 1;
+		SwitchTable table = {0, std::vector<int>(), std::vector<std::pair<int, int>>(), (int)count, (int)count,
+							 std::vector<NestedLabel>(), false};
+		llvm::DenseMap<SwitchCase *, int> where;
+		for (unsigned i = 0; i < count; i++)
+		{
+			Stmt *stmt = compound ? compound->body_begin()[i] : switchstmt->getBody();
+			while (SwitchCase *label = dyn_cast<SwitchCase>(stmt))
+			{
+				where[label] = i;
+				stmt = label->getSubStmt();
+			}
+			if (stmt && !isa<Expr>(stmt) && !isa<SwitchStmt>(stmt))
+			{
+				std::vector<Stmt *> path(1, compound ? compound->body_begin()[i] : switchstmt->getBody());
+				/// The labels on top were recorded already, the search starts below them
+				while (path.back() != stmt)
+					path.push_back(cast<SwitchCase>(path.back())->getSubStmt());
+				findLabels(i, path, table, where);
+			}
+		}
+		for (SwitchCase *label = switchstmt->getSwitchCaseList(); label; label = label->getNextSwitchCase())
+		{
+			llvm::DenseMap<SwitchCase *, int>::iterator it = where.find(label);
+			CaseStmt *casestmt = dyn_cast<CaseStmt>(label);
+			if (it == where.end() || (casestmt && casestmt->caseStmtIsGNURange()))
+				table.unsupported = true;
+			else if (casestmt)
+				table.sorted.push_back(
+					std::make_pair((int)casestmt->getLHS()->EvaluateKnownConstInt(context).getSExtValue(), it->second));
+			else
+				table.deflt = it->second;
+		}
+		std::sort(table.sorted.begin(), table.sorted.end());
+		if (table.sorted.size() < MIN_DENSE_CASES)
+			return table;
+		long long spread = (long long)table.sorted.back().first - table.sorted.front().first + 1;
+		if (spread > 2 * (long long)table.sorted.size())
+			return table;
+		table.low = table.sorted.front().first;
+		table.dense.assign(spread, table.deflt);
+		for (const std::pair<int, int> &entry : table.sorted)
+			table.dense[entry.first - table.low] = entry.second;
+		table.sorted.clear();
+		return table;
 	}
 
-	int getDeclVal(Decl *decl)
+	/// Record the target an assignment or an update writes, left has no parentheses
+	void locate(Expr *left, NodeInfo &info)
 	{
-		if (mVars.find(decl) == mVars.end())
-			return mHeap->getDeclVal(decl);
-		else
-			return mVars.find(decl)->second;
+		if (DeclRefExpr *declexpr = dyn_cast<DeclRefExpr>(left))
+		{
+			info.target = TK_VAR;
+			info.var = slot(declexpr->getFoundDecl());
+			info.width = accessWidth(left->getType());
+		}
+		else if (isa<ArraySubscriptExpr>(left))
+			info.target = TK_ELEMENT;
+		else if (UnaryOperator *unaryop = dyn_cast<UnaryOperator>(left))
+		{
+			assert(unaryop->getOpcode() == UO_Deref);
+			info.target = TK_DEREF;
+			info.width = accessWidth(unaryop->getSubExpr()->getType()->getPointeeType());
+		}
 	}
 
-	void bindStmt(Stmt *stmt, int val)
+	/// Record what every expression below stmt needs at run time
+	void annotate(Stmt *stmt)
 	{
-		mExprs[stmt] = val;
+		if (!stmt)
+			return;
+		if (Expr *expr = dyn_cast<Expr>(stmt))
+		{
+			NodeInfo info = {VK_OTHER, TK_NONE, false, 0, 1, 1, VarSlot{0, false, VK_OTHER}};
+			if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr))
+			{
+				if (uop->getOpcode() == UO_Deref)
+					info.width = accessWidth(uop->getSubExpr()->getType()->getPointeeType());
+				else if (uop->isIncrementDecrementOp())
+				{
+					locate(uop->getSubExpr()->IgnoreParens(), info);
+					info.rightScale = pointerScale(uop->getSubExpr()->getType());
+				}
+			}
+			else if (BinaryOperator *bop = dyn_cast<BinaryOperator>(expr))
+			{
+				Expr *left = bop->getLHS()->IgnoreParens();
+				Expr *right = bop->getRHS()->IgnoreParens();
+				if (bop->isAssignmentOp())
+				{
+					locate(left, info);
+					if (bop->isCompoundAssignmentOp())
+						info.rightScale = pointerScale(left->getType());
+				}
+				else if (bop->isAdditiveOp())
+				{
+					if (left->getType()->isPointerType())
+						info.rightScale = pointerScale(left->getType());
+					else if (right->getType()->isPointerType())
+						info.leftScale = pointerScale(right->getType());
+				}
+			}
+			else if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr))
+			{
+				QualType type = declref->getType();
+				bool value = type->isCharType() || type->isIntegerType() || type->isArrayType() || type->isPointerType();
+				if (value && isa<VarDecl>(declref->getFoundDecl()))
+				{
+					info.kind = classify(type);
+					info.var = slot(declref->getFoundDecl());
+				}
+			}
+			else if (UnaryExprOrTypeTraitExpr *uett = dyn_cast<UnaryExprOrTypeTraitExpr>(expr))
+			{
+				QualType type = uett->getTypeOfArgument();
+				info.kind = classify(type);
+				info.operand = !uett->isArgumentType() || info.kind == VK_VAR_ARRAY;
+				if (info.kind == VK_CHAR)
+					info.width = sizeof(char);
+				else if (info.kind == VK_INT)
+					info.width = sizeof(int);
+				else if (info.kind == VK_POINTER)
+					info.width = sizeof(int *);
+				else if (info.kind == VK_VAR_ARRAY)
+					info.width = sizeof(int);
+				else if (const ConstantArrayType *constarrtype = dyn_cast<ConstantArrayType>(type))
+					info.width = constarrtype->getSize().getSExtValue() * sizeof(int);
+			}
+			else if (CastExpr *castexpr = dyn_cast<CastExpr>(expr))
+			{
+				if (truncates(castexpr))
+					info.width = sizeof(char);
+			}
+			else if (CallExpr *callexpr = dyn_cast<CallExpr>(expr))
+				mCallSites[callexpr] = callSite(callexpr);
+			mNodes[stmt] = info;
+		}
+		for (Stmt *child : stmt->children())
+			annotate(child);
 	}
 
-	bool hasStmtVal(Stmt *stmt)
+	/// Casts from a wider integer to char, the only casts that change a value
+	static bool truncates(CastExpr *castexpr)
 	{
-		return mExprs.find(stmt) != mExprs.end();
+		return castexpr->getCastKind() == CK_IntegralCast && castexpr->getType()->isCharType() &&
+			   !castexpr->getSubExpr()->getType()->isCharType();
 	}
 
-	int getStmtVal(Stmt *stmt)
+	/// Values are ints and pointers are addresses, so these casts only copy their operand
+	static bool preservesValue(CastExpr *castexpr)
 	{
-		assert(mExprs.find(stmt) != mExprs.end());
-		return mExprs[stmt];
+		switch (castexpr->getCastKind())
+		{
+		case CK_LValueToRValue:
+		case CK_NoOp:
+		case CK_FunctionToPointerDecay:
+		case CK_ArrayToPointerDecay:
+		case CK_BitCast:
+		case CK_NullToPointer:
+		case CK_IntegralToPointer:
+		case CK_PointerToIntegral:
+			return true;
+		case CK_IntegralCast:
+			return !truncates(castexpr);
+		default:
+			return false;
+		}
 	}
 
-	void setPC(Stmt *stmt)
+	/// Unlink parentheses and value preserving casts from the tree below stmt,
+	/// their operands take their place in the parent
+	void canonicalize(Stmt *stmt)
 	{
-		mPC = stmt;
+		for (Stmt *&child : stmt->children())
+		{
+			if (!child)
+				continue;
+			for (;;)
+			{
+				if (isa<Expr>(child))
+					mExprNodes++;
+				if (ParenExpr *paren = dyn_cast<ParenExpr>(child))
+					child = paren->getSubExpr();
+				else if (isa<CastExpr>(child) && preservesValue(llvm::cast<CastExpr>(child)))
+					child = llvm::cast<CastExpr>(child)->getSubExpr();
+				else
+					break;
+				mRemovedNodes++;
+			}
+			canonicalize(child);
+		}
 	}
 
-	Stmt *getPC()
+	static bool hasTypeTrait(Stmt *stmt)
 	{
-		return mPC;
+		if (isa<UnaryExprOrTypeTraitExpr>(stmt))
+			return true;
+		for (Stmt *child : stmt->children())
+			if (child && hasTypeTrait(child))
+				return true;
+		return false;
 	}
 
-	int Malloc(int size)
+	/// Compute the value of an integer expression that does not depend on the program state.
+	/// Clang's evaluator follows C sizes, so sizeof is folded with the walker's own sizes
+	/// and expressions containing it are left alone.
+	bool constant(Expr *expr, ASTContext &context, int &val)
 	{
-		int addr = mValues.size();
-		mValues.resize(addr + size);
-		return addr;
+		if (isa<IntegerLiteral>(expr) || isa<CharacterLiteral>(expr))
+			return false;
+		if (!expr->isRValue() || !expr->getType()->isIntegerType())
+			return false;
+		if (UnaryExprOrTypeTraitExpr *uett = dyn_cast<UnaryExprOrTypeTraitExpr>(expr))
+		{
+			const NodeInfo &info = node(uett);
+			if (info.kind == VK_VAR_ARRAY || uett->getKind() != UETT_SizeOf)
+				return false;
+			if (!uett->isArgumentType() && uett->getArgumentExpr()->HasSideEffects(context))
+				return false;
+			val = info.width;
+			return true;
+		}
+		if (hasTypeTrait(expr) || expr->HasSideEffects(context))
+			return false;
+		Expr::EvalResult result;
+		if (!expr->EvaluateAsInt(result, context))
+			return false;
+		val = result.Val.getInt().getSExtValue();
+		return true;
 	}
 
-	void Update(int addr, int val)
+	/// Known truth value of a condition, false if it depends on the program state
+	bool constantCond(Expr *cond, ASTContext &context, bool &truth)
 	{
-		*(int *)&mValues[addr] = val;
+		int val;
+		if (IntegerLiteral *literal = dyn_cast<IntegerLiteral>(cond))
+			val = literal->getValue().getSExtValue();
+		else if (!constant(cond, context, val))
+			return false;
+		truth = val != 0;
+		return true;
 	}
 
-	int get(int addr)
+	/// Whether a case or default label of an enclosing switch lies below stmt,
+	/// the labels of an inner switch belong to it
+	static bool hasCaseLabel(Stmt *stmt)
 	{
-		return *(int *)&mValues[addr];
+		if (!stmt || isa<SwitchStmt>(stmt))
+			return false;
+		if (isa<SwitchCase>(stmt))
+			return true;
+		for (Stmt *child : stmt->children())
+			if (hasCaseLabel(child))
+				return true;
+		return false;
 	}
-};
 
-class Environment
-{
-	std::vector<StackFrame> mStack;
-	Heap mHeap;
+	/// The statement that replaces stmt once constant conditions are known, stmt if none.
+	/// Branches holding a case label stay, a switch can still jump into them
+	Stmt *prune(Stmt *stmt, ASTContext &context)
+	{
+		bool truth;
+		if (IfStmt *ifstmt = dyn_cast<IfStmt>(stmt))
+		{
+			if (!constantCond(ifstmt->getCond(), context, truth) ||
+				hasCaseLabel(truth ? ifstmt->getElse() : ifstmt->getThen()))
+				return stmt;
+			Stmt *taken = truth ? ifstmt->getThen() : ifstmt->getElse();
+			return taken ? taken : new (context) NullStmt(ifstmt->getBeginLoc());
+		}
+		else if (WhileStmt *whilestmt = dyn_cast<WhileStmt>(stmt))
+		{
+			if (!constantCond(whilestmt->getCond(), context, truth) || truth || hasCaseLabel(whilestmt->getBody()))
+				return stmt;
+			return new (context) NullStmt(whilestmt->getBeginLoc());
+		}
+		else if (ForStmt *forstmt = dyn_cast<ForStmt>(stmt))
+		{
+			if (!forstmt->getCond() || !constantCond(forstmt->getCond(), context, truth) || truth ||
+				hasCaseLabel(forstmt->getBody()))
+				return stmt;
+			/// A loop that never runs still performs its initialization
+			if (Stmt *init = forstmt->getInit())
+				return init;
+			return new (context) NullStmt(forstmt->getBeginLoc());
+		}
+		return stmt;
+	}
 
-	FunctionDecl *mFree; /// Declartions to the built-in functions
-	FunctionDecl *mMalloc;
-	FunctionDecl *mInput;
-	FunctionDecl *mOutput;
+	/// Replace constant expressions below stmt by literals and drop statements that cannot run
+	void fold(Stmt *stmt, ASTContext &context)
+	{
+		for (Stmt *&child : stmt->children())
+		{
+			if (!child)
+				continue;
+			int val;
+			if (Expr *expr = dyn_cast<Expr>(child))
+			{
+				if (constant(expr, context, val))
+				{
+					QualType type = expr->getType();
+					llvm::APInt bits(context.getIntWidth(type), val, true);
+					child = IntegerLiteral::Create(context, bits, type, expr->getExprLoc());
+					mFoldedNodes++;
+					continue;
+				}
+			}
+			for (Stmt *pruned = prune(child, context); pruned != child; pruned = prune(child, context))
+			{
+				child = pruned;
+				mPrunedStmts++;
+			}
+			fold(child, context);
+		}
+	}
 
-	FunctionDecl *mEntry;
+	const NodeInfo &node(Stmt *stmt)
+	{
+		llvm::DenseMap<Stmt *, NodeInfo>::iterator it = mNodes.find(stmt);
+		assert(it != mNodes.end());
+		return it->second;
+	}
 
 public:
 	/// Get the declartions to the built-in functions
-	Environment() : mStack(), mHeap(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL)
+	Environment() : mStack(), mArena(), mOperands(), mHeap(), mSlots(), mLayouts(), mArrayOffsets(), mNodes(), mCallSites(), mSwitches(), mExprNodes(0), mRemovedNodes(0), mOptLevel(1), mFoldedNodes(0), mPrunedStmts(0), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL), mMaxDepth(DEFAULT_MAX_DEPTH), mStackLimit(0), mTrapped(false), mTailCalled(false), mMemoize(false), mMemoized(), mMemoIds(), mMemo(), mMemoCalls(), mConsole(&Console::terminal())
 	{
 	}
 
 	/// Initialize the Environment
 	void init(TranslationUnitDecl *unit)
 	{
+		std::vector<VarDecl *> globals;
+		std::vector<FunctionDecl *> functions;
 		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i)
 		{
 			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i))
@@ -277,28 +896,67 @@ public:
 					mOutput = fdecl;
 				else if (fdecl->getName().equals("main"))
 					mEntry = fdecl;
+				if (fdecl->doesThisDeclarationHaveABody())
+					functions.push_back(fdecl);
 			}
 			else if (VarDecl *vdecl = dyn_cast<VarDecl>(*i))
+				globals.push_back(vdecl);
+		}
+		resolveGlobals(globals);
+		for (FunctionDecl *fdecl : functions)
+			resolve(fdecl);
+		/// Call sites copy the memo indices, so they are assigned before annotate
+		if (mMemoize)
+		{
+			PurityAnalysis purity;
+			purity.run(unit, MemoCache::MAX_ARGS);
+			for (FunctionDecl *fdecl : functions)
+				if (purity.isPure(fdecl))
+				{
+					mMemoIds[fdecl] = mMemoized.size();
+					mMemoized.push_back(fdecl);
+				}
+		}
+		/// Annotations copy the slots, so they are taken once all variables are resolved
+		for (FunctionDecl *fdecl : functions)
+			annotate(fdecl->getBody());
+		if (mOptLevel > 0)
+			for (FunctionDecl *fdecl : functions)
+				fold(fdecl->getBody(), unit->getASTContext());
+		/// Annotations look at the operand types before the casts are dropped
+		for (FunctionDecl *fdecl : functions)
+			canonicalize(fdecl->getBody());
+		for (FunctionDecl *fdecl : functions)
+			switches(fdecl->getBody(), unit->getASTContext());
+		/// The entry frame is not pushed by a call, so nothing could run its replacement
+		if (mOptLevel > 0)
+			for (FunctionDecl *fdecl : functions)
+				if (fdecl != mEntry && !ownsArrays(fdecl->getBody()))
+				{
+					markReturns(fdecl->getBody());
+					if (fdecl->getReturnType()->isVoidType())
+						markTail(fdecl->getBody());
+				}
+		for (VarDecl *vdecl : globals)
+		{
+			if (vdecl->hasInit())
 			{
-				if (vdecl->hasInit())
+				Expr *expr = vdecl->getInit();
+				if (IntegerLiteral *literal = dyn_cast<IntegerLiteral>(expr))
 				{
-					Expr *expr = vdecl->getInit();
-					if (IntegerLiteral *literal = dyn_cast<IntegerLiteral>(expr))
-					{
-						int val = literal->getValue().getSExtValue();
-						mHeap.bindDecl(vdecl, val);
-					}
-					else if (CharacterLiteral *literal = dyn_cast<CharacterLiteral>(expr))
-					{
-						int val = literal->getValue();
-						mHeap.bindDecl(vdecl, val);
-					}
+					int val = literal->getValue().getSExtValue();
+					store(slot(vdecl), val);
+				}
+				else if (CharacterLiteral *literal = dyn_cast<CharacterLiteral>(expr))
+				{
+					int val = literal->getValue();
+					store(slot(vdecl), val);
 				}
-				else
-					mHeap.bindDecl(vdecl, 0);
 			}
 		}
-		mStack.push_back(StackFrame(&mHeap));
+		mOperands.reserve(256);
+		mStack.reserve(256);
+		mStack.push_back(StackFrame(mArena, mLayouts.lookup(mEntry->getDefinition()), 0));
 	}
 
 	FunctionDecl *getEntry()
@@ -306,111 +964,183 @@ public:
 		return mEntry;
 	}
 
+	void setMaxDepth(size_t depth)
+	{
+		mMaxDepth = depth;
+	}
+
+	void setStackLimit(uintptr_t limit)
+	{
+		mStackLimit = limit;
+	}
+
+	/// Number of expression nodes in the function bodies before and after canonicalize
+	unsigned getExprNodes()
+	{
+		return mExprNodes;
+	}
+
+	unsigned getRemovedNodes()
+	{
+		return mRemovedNodes;
+	}
+
+	void setOptLevel(int level)
+	{
+		mOptLevel = level;
+	}
+
+	unsigned getFoldedNodes()
+	{
+		return mFoldedNodes;
+	}
+
+	unsigned getPrunedStmts()
+	{
+		return mPrunedStmts;
+	}
+
+	void setMemoize(bool memoize)
+	{
+		mMemoize = memoize;
+	}
+
+	void setConsole(Console *console)
+	{
+		mConsole = console;
+	}
+
+	const std::vector<FunctionDecl *> &getMemoized()
+	{
+		return mMemoized;
+	}
+
+	MemoCache &getMemo()
+	{
+		return mMemo;
+	}
+
+	/// True once a call exceeded the maximum depth, execution has to unwind
+	bool trapped()
+	{
+		return mTrapped;
+	}
+
+	/// Trap with the depth error when the walker is about to run out of host
+	/// stack, which deeply nested code can do well before the call depth does
+	bool stackExhausted()
+	{
+		char here;
+		if ((uintptr_t)&here >= mStackLimit)
+			return false;
+		mConsole->out() << "error: call depth exceeds " << mMaxDepth << ", the host stack is exhausted\n";
+		mTrapped = true;
+		return true;
+	}
+
+	void push(int val)
+	{
+		mOperands.push_back(val);
+	}
+
+	int pop()
+	{
+		assert(!mOperands.empty());
+		int val = mOperands.back();
+		mOperands.pop_back();
+		return val;
+	}
+
+	/// Height of the operand stack, statements release what they leave behind
+	size_t mark()
+	{
+		return mOperands.size();
+	}
+
+	void release(size_t mark)
+	{
+		mOperands.resize(mark);
+	}
+
 	void intliteral(IntegerLiteral *literal)
 	{
-		mStack.back().bindStmt(literal, literal->getValue().getSExtValue());
+		push(literal->getValue().getSExtValue());
 	}
 
 	void charliteral(CharacterLiteral *literal)
 	{
-		mStack.back().bindStmt(literal, literal->getValue());
+		push(literal->getValue());
 	}
 
 	void unop(UnaryOperator *uop)
 	{
-		Expr *expr = uop->getSubExpr();
-		int val = mStack.back().getStmtVal(expr);
+		int val = pop();
 		if (uop->getOpcode() == UO_Minus)
 			val = -val;
 		else if (uop->getOpcode() == UO_Deref)
 		{
-			assert(expr->getType()->isPointerType());
-			if (expr->getType()->getPointeeType()->isCharType())
+			switch (node(uop).width)
+			{
+			case sizeof(char):
 				val = mHeap.getChar(val);
-			else if (expr->getType()->getPointeeType()->isIntegerType())
-				val = mHeap.getInt(val);
-			else if (expr->getType()->getPointeeType()->isPointerType())
+				break;
+			case sizeof(int):
 				val = mHeap.getInt(val);
+				break;
+			}
 		}
-		mStack.back().bindStmt(uop, val);
+		push(val);
 	}
 
+	/// Only truncating casts survive canonicalize
+	void cast(CastExpr *expr)
+	{
+		if (node(expr).width == sizeof(char))
+			push((char)pop());
+	}
+
+	/// For assignments the operands locating the left side were pushed before the value
 	void binop(BinaryOperator *bop)
 	{
-		Expr *left = bop->getLHS();
-		Expr *right = bop->getRHS();
+		const NodeInfo &info = node(bop);
 
 		int val = 0;
 		if (bop->isAssignmentOp())
 		{
-			val = mStack.back().getStmtVal(right);
-			mStack.back().bindStmt(left, val);
-			while (isa<ParenExpr>(left))
-			{
-				ParenExpr *paren = dyn_cast<ParenExpr>(left);
-				left = paren->getSubExpr();
-			}
-			if (DeclRefExpr *declexpr = dyn_cast<DeclRefExpr>(left))
+			val = pop();
+			switch (info.target)
 			{
-				Decl *decl = declexpr->getFoundDecl();
-				mStack.back().bindDecl(decl, val);
-			}
-			else if (ArraySubscriptExpr *arrsub = dyn_cast<ArraySubscriptExpr>(left))
+			case TK_VAR:
+				store(info.var, val);
+				break;
+			case TK_ELEMENT:
 			{
-				Expr *base = arrsub->getBase();
-				Expr *idx = arrsub->getIdx();
-				int addr = mStack.back().getStmtVal(base);
-				int idxval = mStack.back().getStmtVal(idx);
+				int idxval = pop();
+				int addr = pop();
 				mStack.back().Update(addr + idxval * sizeof(int), val);
+				break;
 			}
-			else if (UnaryOperator *unaryop = dyn_cast<UnaryOperator>(left))
+			case TK_DEREF:
 			{
-				assert(unaryop->getOpcode() == UO_Deref);
-				Expr *expr = unaryop->getSubExpr();
-				int addr = mStack.back().getStmtVal(expr);
-				if (expr->getType()->getPointeeType()->isCharType())
+				int addr = pop();
+				if (info.width == sizeof(char))
 					mHeap.Update(addr, (char)val);
-				else if (expr->getType()->getPointeeType()->isIntegerType())
-					mHeap.Update(addr, val);
-				else if (expr->getType()->getPointeeType()->isPointerType())
+				else if (info.width == sizeof(int))
 					mHeap.Update(addr, val);
+				break;
+			}
+			case TK_NONE:
+				break;
 			}
 		}
 		else
 		{
-			while (isa<ParenExpr>(left))
-			{
-				ParenExpr *paren = dyn_cast<ParenExpr>(left);
-				left = paren->getSubExpr();
-			}
-			while (isa<ParenExpr>(right))
-			{
-				ParenExpr *paren = dyn_cast<ParenExpr>(right);
-				right = paren->getSubExpr();
-			}
+			int rightval = pop();
+			int leftval = pop();
 			if (bop->isAdditiveOp())
 			{
-				int leftval = mStack.back().getStmtVal(left);
-				int rightval = mStack.back().getStmtVal(right);
-				if (left->getType()->isPointerType())
-				{
-					if (left->getType()->getPointeeType()->isCharType())
-						rightval *= sizeof(char);
-					else if (left->getType()->getPointeeType()->isIntegerType())
-						rightval *= sizeof(int);
-					else if (left->getType()->getPointeeType()->isPointerType())
-						rightval *= sizeof(int *);
-				}
-				else if (right->getType()->isPointerType())
-				{
-					if (right->getType()->getPointeeType()->isCharType())
-						leftval *= sizeof(char);
-					else if (right->getType()->getPointeeType()->isIntegerType())
-						leftval *= sizeof(int);
-					else if (right->getType()->getPointeeType()->isPointerType())
-						leftval *= sizeof(int *);
-				}
-
+				leftval *= info.leftScale;
+				rightval *= info.rightScale;
 				if (bop->getOpcode() == BO_Add)
 					val = leftval + rightval;
 				else if (bop->getOpcode() == BO_Sub)
@@ -419,271 +1149,339 @@ public:
 			else if (bop->isMultiplicativeOp())
 			{
 				if (bop->getOpcode() == BO_Mul)
-					val = mStack.back().getStmtVal(left) * mStack.back().getStmtVal(right);
+					val = leftval * rightval;
 				else if (bop->getOpcode() == BO_Div)
-					val = mStack.back().getStmtVal(left) / mStack.back().getStmtVal(right);
+					val = leftval / rightval;
 				else if (bop->getOpcode() == BO_Rem)
-					val = mStack.back().getStmtVal(left) % mStack.back().getStmtVal(right);
-				mStack.back().bindStmt(bop, val);
+					val = leftval % rightval;
 			}
 			else if (bop->isRelationalOp())
 			{
 				if (bop->getOpcode() == BO_LT)
-					val = mStack.back().getStmtVal(left) < mStack.back().getStmtVal(right);
+					val = leftval < rightval;
 				else if (bop->getOpcode() == BO_GT)
-					val = mStack.back().getStmtVal(left) > mStack.back().getStmtVal(right);
+					val = leftval > rightval;
 				else if (bop->getOpcode() == BO_LE)
-					val = mStack.back().getStmtVal(left) <= mStack.back().getStmtVal(right);
+					val = leftval <= rightval;
 				else if (bop->getOpcode() == BO_GE)
-					val = mStack.back().getStmtVal(left) >= mStack.back().getStmtVal(right);
+					val = leftval >= rightval;
 			}
 			else if (bop->isEqualityOp())
 			{
 				if (bop->getOpcode() == BO_EQ)
-					val = mStack.back().getStmtVal(left) == mStack.back().getStmtVal(right);
+					val = leftval == rightval;
 				else if (bop->getOpcode() == BO_NE)
-					val = mStack.back().getStmtVal(left) != mStack.back().getStmtVal(right);
+					val = leftval != rightval;
 			}
 		}
-		mStack.back().bindStmt(bop, val);
+		push(val);
+	}
+
+	/// Combine the target of an update with rightval. The operands locating the target
+	/// were pushed, they are popped once and the address is computed once for the
+	/// read and the write. Returns the new value, oldval receives the previous one
+	int update(const NodeInfo &info, BinaryOperatorKind op, int rightval, int &oldval)
+	{
+		int addr = 0;
+		switch (info.target)
+		{
+		case TK_VAR:
+			oldval = load(info.var);
+			break;
+		case TK_ELEMENT:
+		{
+			int idxval = pop();
+			addr = pop() + idxval * sizeof(int);
+			oldval = mStack.back().get(addr);
+			break;
+		}
+		case TK_DEREF:
+			addr = pop();
+			oldval = info.width == sizeof(char) ? mHeap.getChar(addr) : mHeap.getInt(addr);
+			break;
+		case TK_NONE:
+			oldval = 0;
+			break;
+		}
+
+		int val = oldval;
+		switch (op)
+		{
+		case BO_Add:
+			val = oldval + rightval * info.rightScale;
+			break;
+		case BO_Sub:
+			val = oldval - rightval * info.rightScale;
+			break;
+		case BO_Mul:
+			val = oldval * rightval;
+			break;
+		case BO_Div:
+			val = oldval / rightval;
+			break;
+		case BO_Rem:
+			val = oldval % rightval;
+			break;
+		default:
+			break;
+		}
+		if (info.width == sizeof(char))
+			val = (char)val;
+
+		switch (info.target)
+		{
+		case TK_VAR:
+			store(info.var, val);
+			break;
+		case TK_ELEMENT:
+			mStack.back().Update(addr, val);
+			break;
+		case TK_DEREF:
+			if (info.width == sizeof(char))
+				mHeap.Update(addr, (char)val);
+			else if (info.width == sizeof(int))
+				mHeap.Update(addr, val);
+			break;
+		case TK_NONE:
+			break;
+		}
+		return val;
 	}
 
+	/// x op= y, the operands locating x were pushed before the value of y
+	void compound(CompoundAssignOperator *bop)
+	{
+		int rightval = pop();
+		int oldval;
+		push(update(node(bop), BinaryOperator::getOpForCompoundAssignment(bop->getOpcode()), rightval, oldval));
+	}
+
+	/// ++ and -- step by one element, postfix forms yield the previous value
+	void incdec(UnaryOperator *uop)
+	{
+		int oldval;
+		int val = update(node(uop), uop->isIncrementOp() ? BO_Add : BO_Sub, 1, oldval);
+		push(uop->isPostfix() ? oldval : val);
+	}
+
+	/// Index of the body statement a switch enters for the value on the operand stack, -1 if it traps.
+	/// For a label nested in that statement path is set to the statements leading to it, else null
+	int switchIndex(SwitchStmt *switchstmt, const std::vector<Stmt *> *&path)
+	{
+		int val = pop();
+		const SwitchTable &table = mSwitches.find(switchstmt)->second;
+		path = nullptr;
+		if (table.unsupported)
+		{
+			mConsole->out() << "error: unsupported case label in switch\n";
+			mTrapped = true;
+			return -1;
+		}
+		int entry;
+		if (!table.dense.empty())
+		{
+			unsigned offset = (unsigned)val - (unsigned)table.low;
+			entry = offset < table.dense.size() ? table.dense[offset] : table.deflt;
+		}
+		else
+		{
+			std::vector<std::pair<int, int>>::const_iterator it =
+				std::lower_bound(table.sorted.begin(), table.sorted.end(), std::make_pair(val, INT_MIN));
+			entry = it != table.sorted.end() && it->first == val ? it->second : table.deflt;
+		}
+		if (entry <= table.statements)
+			return entry;
+		const NestedLabel &nested = table.nested[entry - table.statements - 1];
+		path = &nested.path;
+		return nested.index;
+	}
+
+	/// Initializers and array sizes were pushed in declaration order
 	void decl(DeclStmt *declstmt)
 	{
+		size_t next = mOperands.size();
+		for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end();
+			 it != ie; ++it)
+		{
+			if (VarDecl *vardecl = dyn_cast<VarDecl>(*it))
+			{
+				if (vardecl->hasInit() || slot(vardecl).kind == VK_VAR_ARRAY)
+					next--;
+			}
+		}
+		size_t base = next;
+
 		for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end();
 			 it != ie; ++it)
 		{
 			Decl *decl = *it;
 			if (VarDecl *vardecl = dyn_cast<VarDecl>(decl))
 			{
-				if (vardecl->getType()->isCharType())
+				const VarSlot &var = slot(vardecl);
+				switch (var.kind)
 				{
+				case VK_CHAR:
+				case VK_INT:
+				case VK_POINTER:
 					if (vardecl->hasInit())
-					{
-						Expr *expr = vardecl->getInit();
-						int val = mStack.back().getStmtVal(expr);
-						mStack.back().initDecl(vardecl, val);
-					}
+						mStack.back().setSlot(var.index, mOperands[next++]);
 					else
-						mStack.back().initDecl(vardecl, 0);
-				}
-				else if (vardecl->getType()->isIntegerType())
+						mStack.back().setSlot(var.index, 0);
+					break;
+				case VK_VAR_ARRAY:
 				{
-					if (vardecl->hasInit())
-					{
-						Expr *expr = vardecl->getInit();
-						int val = mStack.back().getStmtVal(expr);
-						mStack.back().initDecl(vardecl, val);
-					}
-					else
-						mStack.back().initDecl(vardecl, 0);
-				}
-				else if (const VariableArrayType *vararrtype = dyn_cast<VariableArrayType>(vardecl->getType()))
-				{
-					Expr *expr = vararrtype->getSizeExpr();
-					int size = mStack.back().getStmtVal(expr);
-					int addr = mStack.back().Malloc(size * sizeof(int));
-					mStack.back().initDecl(vardecl, addr);
-				}
-				else if (const ConstantArrayType *constarrtype = dyn_cast<ConstantArrayType>(vardecl->getType()))
-				{
-					int size = constarrtype->getSize().getSExtValue();
+					int size = mOperands[next++];
 					int addr = mStack.back().Malloc(size * sizeof(int));
-					mStack.back().initDecl(vardecl, addr);
+					mStack.back().setSlot(var.index, addr);
+					break;
 				}
-				else if (vardecl->getType()->isPointerType())
-				{
+				case VK_CONST_ARRAY:
+					/// The array already has its place in the frame layout
+					mStack.back().setSlot(var.index, mArrayOffsets.lookup(vardecl));
 					if (vardecl->hasInit())
-					{
-						Expr *expr = vardecl->getInit();
-						int addr = mStack.back().getStmtVal(expr);
-						mStack.back().initDecl(vardecl, addr);
-					}
-					else
-						mStack.back().initDecl(vardecl, 0);
+						next++;
+					break;
+				case VK_OTHER:
+					if (vardecl->hasInit())
+						next++;
+					break;
 				}
 			}
 		}
+		release(base);
 	}
 
+	/// Function references push a placeholder so every expression yields one value
 	void declref(DeclRefExpr *declref)
 	{
-		mStack.back().setPC(declref);
-		if (declref->getType()->isCharType())
-		{
-			Decl *decl = declref->getFoundDecl();
-			int val = mStack.back().getDeclVal(decl);
-			mStack.back().bindStmt(declref, val);
-		}
-		else if (declref->getType()->isIntegerType())
-		{
-			Decl *decl = declref->getFoundDecl();
-			int val = mStack.back().getDeclVal(decl);
-			mStack.back().bindStmt(declref, val);
-		}
-		else if (declref->getType()->isArrayType())
-		{
-			Decl *decl = declref->getFoundDecl();
-			int addr = mStack.back().getDeclVal(decl);
-			mStack.back().bindStmt(declref, addr);
-		}
-		else if (declref->getType()->isPointerType())
-		{
-			Decl *decl = declref->getFoundDecl();
-			if (mStack.back().hasDeclVal(decl))
-			{
-				int addr = mStack.back().getDeclVal(decl);
-				mStack.back().bindStmt(declref, addr);
-			}
-		}
+		const NodeInfo &info = node(declref);
+		if (info.kind != VK_OTHER)
+			push(load(info.var));
+		else
+			push(0);
 	}
 
-	void cast(CastExpr *castexpr)
+	/// True once after call replaced the current frame for a tail call
+	bool tailCalled()
 	{
-		mStack.back().setPC(castexpr);
-		if (castexpr->getType()->isCharType())
-		{
-			Expr *expr = castexpr->getSubExpr();
-			int val = mStack.back().getStmtVal(expr);
-			mStack.back().bindStmt(castexpr, val);
-		}
-		else if (castexpr->getType()->isIntegerType())
-		{
-			Expr *expr = castexpr->getSubExpr();
-			int val = mStack.back().getStmtVal(expr);
-			mStack.back().bindStmt(castexpr, val);
-		}
-		else if (castexpr->getType()->isPointerType())
-		{
-			Expr *expr = castexpr->getSubExpr();
-			if (mStack.back().hasStmtVal(expr))
-			{
-				int addr = mStack.back().getStmtVal(expr);
-				mStack.back().bindStmt(castexpr, addr);
-			}
-		}
+		bool tail = mTailCalled;
+		mTailCalled = false;
+		return tail;
 	}
 
+	/// Pops the arguments and the callee, returns the body to run for user functions
 	Stmt *call(CallExpr *callexpr)
 	{
-		mStack.back().setPC(callexpr);
+		llvm::DenseMap<CallExpr *, CallSite>::iterator it = mCallSites.find(callexpr);
+		assert(it != mCallSites.end());
+		const CallSite &site = it->second;
 		int val = 0;
-		FunctionDecl *callee = callexpr->getDirectCallee();
-		if (callee == mInput)
-		{
-			llvm::errs() << "Please Input an Integer Value : ";
-			scanf("%d", &val);
-
-			mStack.back().bindStmt(callexpr, val);
-			return nullptr;
-		}
-		else if (callee == mOutput)
-		{
-			Expr *decl = callexpr->getArg(0);
-			val = mStack.back().getStmtVal(decl);
-			llvm::errs() << val;
-			return nullptr;
-		}
-		else if (callee == mMalloc)
-		{
-			Expr *expr = callexpr->getArg(0);
-			val = mStack.back().getStmtVal(expr);
-			int addr = mHeap.Malloc(val);
-			mStack.back().bindStmt(callexpr, addr);
-			return nullptr;
-		}
-		else if (callee == mFree)
-		{
-			Expr *expr = callexpr->getArg(0);
-			val = mStack.back().getStmtVal(expr);
-			mHeap.Free(val);
-			return nullptr;
-		}
-		else
+		size_t args = mOperands.size() - site.numArgs;
+		switch (site.target)
 		{
+		case CALL_INPUT:
+			val = mConsole->get();
+			break;
+		case CALL_OUTPUT:
+			mConsole->print(mOperands[args]);
+			break;
+		case CALL_MALLOC:
+			val = mHeap.Malloc(mOperands[args]);
+			break;
+		case CALL_FREE:
+			mHeap.Free(mOperands[args]);
+			break;
+		case CALL_UNDEFINED:
+			if (site.callee)
+				mConsole->out() << "error: " << site.callee->getName() << " has no definition\n";
+			else
+				mConsole->out() << "error: indirect calls are not supported\n";
+			mTrapped = true;
+			break;
+		case CALL_USER:
 			/// You could add your code here for Function call Return
-			callee = callee->getDefinition();
-			StackFrame stack(&mHeap);
-			for (int i = 0; i < callexpr->getNumArgs(); i++)
+			if (site.tail)
+			{
+				/// The callee takes over the frame and the operands of the caller
+				size_t base = mStack.back().getBase();
+				mStack.back().release();
+				mStack.back() = StackFrame(mArena, site.layout, base);
+				for (unsigned i = 0; i < site.numArgs; i++)
+					mStack.back().setSlot(i, mOperands[args + i]);
+				release(base);
+				mTailCalled = true;
+				return site.body;
+			}
+			MemoCache::Key key;
+			if (site.memo >= 0)
+			{
+				key = MemoCache::key(site.memo, &mOperands[args], site.numArgs);
+				if (mMemo.lookup(key, val))
+					break;
+			}
+			if (mStack.size() >= mMaxDepth)
 			{
-				Expr *arg = callexpr->getArg(i);
-				int val = mStack.back().getStmtVal(arg);
-				ParmVarDecl *param = callee->getParamDecl(i);
-				stack.initDecl(param, val);
+				mConsole->out() << "error: call depth exceeds " << mMaxDepth << " in " << site.callee->getName() << "\n";
+				mTrapped = true;
+				break;
 			}
-			mStack.push_back(stack);
-			return callee->getBody();
+			mStack.push_back(StackFrame(mArena, site.layout, args - 1));
+			if (site.memo >= 0)
+				mMemoCalls.push_back(MemoCall{mStack.size(), key});
+			/// Parameters occupy the first slots of the frame
+			for (unsigned i = 0; i < site.numArgs; i++)
+				mStack.back().setSlot(i, mOperands[args + i]);
+			release(args - 1);
+			return site.body;
 		}
+		release(args - 1);
+		push(val);
+		return nullptr;
 	}
 
+	/// Pops the frame and pushes the return value for the caller
 	void ret(ReturnStmt *retstmt)
 	{
 		int val = 0;
 		if (retstmt)
 		{
-			if (Expr *expr = retstmt->getRetValue())
+			if (retstmt->getRetValue())
 			{
-				val = mStack.back().getStmtVal(expr);
+				val = pop();
 			}
 		}
-		mStack.pop_back();
-		if (!mStack.empty())
+		if (!mMemoCalls.empty() && mMemoCalls.back().depth == mStack.size())
 		{
-			mStack.back().bindStmt(mStack.back().getPC(), val);
+			mMemo.insert(mMemoCalls.back().key, val);
+			mMemoCalls.pop_back();
 		}
+		release(mStack.back().getBase());
+		mStack.back().release();
+		mStack.pop_back();
+		push(val);
 	}
 
+	/// The operands of the subscript were pushed left to right
 	void arrsub(ArraySubscriptExpr *arrsub)
 	{
-		Expr *base = arrsub->getBase();
-		Expr *idx = arrsub->getIdx();
-		int addr = mStack.back().getStmtVal(base);
-		int idxval = mStack.back().getStmtVal(idx);
+		int rightval = pop();
+		int leftval = pop();
+		int addr = arrsub->getBase() == arrsub->getLHS() ? leftval : rightval;
+		int idxval = arrsub->getBase() == arrsub->getLHS() ? rightval : leftval;
 		int val = mStack.back().get(addr + idxval * sizeof(int));
-		mStack.back().bindStmt(arrsub, val);
+		push(val);
 	}
 
+	/// sizeof(expr) evaluated its operand, sizeof of a variable array type its size
 	void uettop(UnaryExprOrTypeTraitExpr *expr)
 	{
-		if (expr->getArgumentType()->isCharType())
-		{
-			int val = sizeof(char);
-			mStack.back().bindStmt(expr, val);
-		}
-		else if (expr->getArgumentType()->isIntegerType())
-		{
-			int val = sizeof(int);
-			mStack.back().bindStmt(expr, val);
-		}
-		else if (expr->getArgumentType()->isPointerType())
-		{
-			int val = sizeof(int *);
-			mStack.back().bindStmt(expr, val);
-		}
-		else if (const VariableArrayType *vararrtype = dyn_cast<VariableArrayType>(expr->getArgumentType()))
-		{
-			Expr *szexpr = vararrtype->getSizeExpr();
-			int size = mStack.back().getStmtVal(szexpr);
-			int val = size * sizeof(int);
-			mStack.back().bindStmt(expr, val);
-		}
-		else if (const ConstantArrayType *constarrtype = dyn_cast<ConstantArrayType>(expr->getArgumentType()))
-		{
-			int size = constarrtype->getSize().getSExtValue();
-			int val = size * sizeof(int);
-			mStack.back().bindStmt(expr, val);
-		}
-	}
-
-	void paren(ParenExpr *paren)
-	{
-		Expr *expr = paren->getSubExpr();
-		int val = mStack.back().getStmtVal(expr);
-		mStack.back().bindStmt(paren, val);
-	}
-
-	int getStmtVal(Stmt *stmt)
-	{
-		return mStack.back().getStmtVal(stmt);
+		const NodeInfo &info = node(expr);
+		int operand = 0;
+		if (info.operand)
+			operand = pop();
+		if (info.kind == VK_VAR_ARRAY)
+			push(operand * info.width);
+		else
+			push(info.width);
 	}
 };
@@ -0,0 +1,259 @@
+//==--- Inliner.h - Inlining of small bytecode functions -------------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// One call replaced by the body of its callee
+struct InlineReport
+{
+	std::string caller;
+	std::string callee;
+	/// Index of the call in the caller before the pass ran
+	int pc;
+	/// Instructions of the callee body
+	int size;
+};
+
+/// Callers stop growing by inlining at this many instructions
+const int MAX_INLINED_SIZE = 4096;
+
+/// Inliner replaces calls of small functions by a copy of their body. The
+/// copy reads its parameters from the argument registers of the call where
+/// the callee never writes them, its other registers are renamed into
+/// registers above those of the caller, shared by all inlined bodies of the
+/// caller, and its returns move the result to the destination of the call and
+/// jump behind the body. That saves the frame push, the argument copies and
+/// the return of every call.
+///
+/// Functions that call themselves, directly or through others, are never
+/// inlined, nor are functions with memoized results or with allocas, which
+/// are released when the function returns. Callees are processed before
+/// their callers, so bodies are copied with their own calls already inlined.
+class Inliner
+{
+	/// Callees of at most this many instructions are inlined
+	int mThreshold;
+	BCProgram *mProgram;
+	std::vector<InlineReport> mReports;
+	std::vector<bool> mRecursive;
+	std::vector<bool> mDone;
+
+	static int callee(const BCInstr &in)
+	{
+		if (in.op == OP_CALL)
+			return in.b;
+		if (in.op == OP_TAILCALL)
+			return in.a;
+		return -1;
+	}
+
+	/// Whether in writes the register named by its operand a
+	static bool writesA(const BCInstr &in)
+	{
+		switch (in.op)
+		{
+		case OP_ST_I:
+		case OP_ST_C:
+		case OP_STX_I:
+		case OP_STX_C:
+		case OP_SWITCH:
+		case OP_RET:
+		case OP_PRINT:
+		case OP_FREE:
+			return false;
+		default:
+			return (registerOperands(in.op) & OPERAND_A) && !jumpTarget(in);
+		}
+	}
+
+	/// Mark the functions that can reach themselves through calls
+	void findRecursive()
+	{
+		int count = mProgram->functions.size();
+		mRecursive.assign(count, false);
+		for (int func = 0; func < count; func++)
+		{
+			std::vector<bool> seen(count, false);
+			std::vector<int> work(1, func);
+			while (!work.empty() && !mRecursive[func])
+			{
+				int next = work.back();
+				work.pop_back();
+				for (const BCInstr &in : mProgram->functions[next].code)
+				{
+					int target = callee(in);
+					if (target == func)
+						mRecursive[func] = true;
+					else if (target >= 0 && !seen[target])
+					{
+						seen[target] = true;
+						work.push_back(target);
+					}
+				}
+			}
+		}
+	}
+
+	bool inlinable(int index)
+	{
+		const BCFunction &body = mProgram->functions[index];
+		if (mRecursive[index] || body.memoize || (int)body.code.size() > mThreshold)
+			return false;
+		for (const BCInstr &in : body.code)
+			if (in.op == OP_ALLOCA)
+				return false;
+		return true;
+	}
+
+	/// Append the body of function index for call to code. Registers of the
+	/// body that are not read from the arguments start at frame.
+	void expand(BCFunction &func, int index, const BCInstr &call, int frame, std::vector<BCInstr> &code)
+	{
+		const BCFunction &body = mProgram->functions[index];
+		bool tail = call.op == OP_TAILCALL;
+		int args = tail ? call.b : call.c;
+		int size = body.code.size();
+
+		/// Parameters the body writes, or passes on as part of an argument range, get a copy
+		std::vector<bool> copied(body.numParams, false);
+		for (const BCInstr &in : body.code)
+		{
+			if (writesA(in) && in.a < body.numParams)
+				copied[in.a] = true;
+			int target = callee(in);
+			int base = in.op == OP_CALL ? in.c : in.b;
+			for (int i = 0; target >= 0 && i < mProgram->functions[target].numParams; i++)
+				if (base + i < body.numParams)
+					copied[base + i] = true;
+		}
+		std::vector<int> reg(body.numRegs);
+		for (int r = 0; r < body.numRegs; r++)
+			reg[r] = r < body.numParams && !copied[r] ? args + r : frame + r;
+		for (int i = 0; i < body.numParams; i++)
+			if (copied[i])
+				code.push_back(BCInstr{OP_MOV, reg[i], args + i, 0});
+
+		/// Returns become a move of the result and a jump behind the body,
+		/// the jump is left out after the last instruction
+		std::vector<int> at(size + 1);
+		int position = code.size();
+		for (int pc = 0; pc < size; pc++)
+		{
+			at[pc] = position;
+			BCOp op = body.code[pc].op;
+			position++;
+			if (!tail && (op == OP_RET || op == OP_RET0 || op == OP_TAILCALL) && pc + 1 < size)
+				position++;
+		}
+		at[size] = position;
+
+		for (int pc = 0; pc < size; pc++)
+		{
+			BCInstr in = body.code[pc];
+			unsigned operands = registerOperands(in.op);
+			if (operands & OPERAND_A)
+				in.a = reg[in.a];
+			if (operands & OPERAND_B)
+				in.b = reg[in.b];
+			if (operands & OPERAND_C)
+				in.c = reg[in.c];
+			if (int *target = jumpTarget(in))
+				*target = at[*target];
+			if (in.op == OP_SWITCH)
+			{
+				BCJumpTable table = body.tables[in.b];
+				for (int &entry : table.targets)
+					entry = at[entry];
+				in.b = func.tables.size();
+				func.tables.push_back(table);
+			}
+			if (!tail && in.op == OP_RET)
+				in = BCInstr{OP_MOV, call.a, in.a, 0};
+			else if (!tail && in.op == OP_RET0)
+				in = BCInstr{OP_CONST, call.a, 0, 0};
+			else if (!tail && in.op == OP_TAILCALL)
+				in = BCInstr{OP_CALL, call.a, in.a, in.b};
+			code.push_back(in);
+			if (code.size() < at[pc + 1])
+				code.push_back(BCInstr{OP_JMP, at[size], 0, 0});
+		}
+	}
+
+	void function(int index)
+	{
+		if (mDone[index])
+			return;
+		mDone[index] = true;
+		for (const BCInstr &in : mProgram->functions[index].code)
+			if (callee(in) >= 0)
+				function(callee(in));
+
+		BCFunction &func = mProgram->functions[index];
+		int size = func.code.size();
+		int frame = func.numRegs;
+		int tables = func.tables.size();
+		/// Where the code of every instruction of the caller starts, and which instructions are its own
+		std::vector<int> start(size + 1);
+		std::vector<int> own;
+		std::vector<BCInstr> code;
+		for (int pc = 0; pc < size; pc++)
+		{
+			start[pc] = code.size();
+			const BCInstr &in = func.code[pc];
+			int target = callee(in);
+			if (target >= 0 && inlinable(target) &&
+				code.size() + mProgram->functions[target].code.size() + (size - pc) <= MAX_INLINED_SIZE)
+			{
+				const BCFunction &body = mProgram->functions[target];
+				expand(func, target, in, frame, code);
+				func.numRegs = std::max(func.numRegs, frame + body.numRegs);
+				mReports.push_back(InlineReport{func.name, body.name, pc, (int)body.code.size()});
+				continue;
+			}
+			own.push_back(code.size());
+			code.push_back(in);
+		}
+		start[size] = code.size();
+		for (int pc : own)
+			if (int *target = jumpTarget(code[pc]))
+				*target = start[*target];
+		for (int table = 0; table < tables; table++)
+			for (int &entry : func.tables[table].targets)
+				entry = start[entry];
+		func.code.swap(code);
+	}
+
+public:
+	Inliner(int threshold) : mThreshold(threshold), mProgram(nullptr), mReports(), mRecursive(), mDone()
+	{
+	}
+
+	void run(BCProgram &program)
+	{
+		mProgram = &program;
+		findRecursive();
+		mDone.assign(program.functions.size(), false);
+		for (int index = 0; index < program.functions.size(); index++)
+			function(index);
+	}
+
+	const std::vector<InlineReport> &getReports()
+	{
+		return mReports;
+	}
+
+	/// One line per inlined call, call sites are instruction indices before the pass ran
+	void print(llvm::raw_ostream &os)
+	{
+		for (const InlineReport &report : mReports)
+			os << "inline: " << report.callee << " into " << report.caller << " at " << report.pc << ", "
+			   << report.size << " instructions\n";
+	}
+};
@@ -0,0 +1,680 @@
+//==--- JIT.h - Native tier compiling hot bytecode functions with ORC -------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils.h"
+
+#include "VM.h"
+
+/// Errors native code reports through jitTrap
+enum JITError
+{
+	JIT_DEPTH,
+	JIT_DIVISION
+};
+
+/// Services of the VM called from native code. Anything that may grow the
+/// Memory refreshes ctx->base, native code reloads it afterwards.
+static int jitInput(NativeContext *ctx)
+{
+	return ctx->vm->input();
+}
+
+static void jitOutput(NativeContext *ctx, int val)
+{
+	ctx->vm->output(val);
+}
+
+static int jitMalloc(NativeContext *ctx, int size)
+{
+	int addr = ctx->vm->getMemory().Malloc(size);
+	ctx->base = ctx->vm->getMemory().base();
+	return addr;
+}
+
+static void jitFree(NativeContext *ctx, int addr)
+{
+	ctx->vm->getMemory().Free(addr);
+	ctx->base = ctx->vm->getMemory().base();
+}
+
+static int jitAlloca(NativeContext *ctx, int size)
+{
+	int addr = ctx->vm->allocateLocal(size);
+	ctx->base = ctx->vm->getMemory().base();
+	return addr;
+}
+
+static int64_t jitAllocaMark(NativeContext *ctx)
+{
+	return ctx->vm->allocaMark();
+}
+
+static void jitReleaseAllocas(NativeContext *ctx, int64_t mark)
+{
+	ctx->vm->releaseAllocas(mark);
+	ctx->base = ctx->vm->getMemory().base();
+}
+
+static void jitTrap(NativeContext *ctx, int error, int func)
+{
+	const std::string &name = ctx->vm->getProgram().functions[func].name;
+	if (error == JIT_DEPTH)
+		ctx->vm->getConsole().out() << "error: call depth exceeds " << ctx->maxDepth << " in " << name << "\n";
+	else
+		ctx->vm->getConsole().out() << "error: division by zero in " << name << "\n";
+	ctx->trapped = 1;
+}
+
+/// JIT lowers bytecode functions to LLVM IR and compiles them with ORC.
+/// Every function gets a direct entry bc_<index>(ctx, params...) used by native
+/// callers, the VM enters through wrappers taking a register array.
+class JIT : public Tier
+{
+	const BCProgram &mProgram;
+	unsigned mThreshold;
+	std::unique_ptr<llvm::orc::LLJIT> mJIT;
+	llvm::orc::ThreadSafeContext mContext;
+	/// Functions whose direct entry has been added to the JIT
+	std::vector<bool> mDefined;
+	/// Functions left to the VM, the memoized ones and their callers, so
+	/// every call of a memoized function goes through the cache
+	std::vector<bool> mInterpreted;
+	/// Entries handed to the VM, keyed by function and first instruction
+	std::map<std::pair<int, int>, NativeEntry> mEntries;
+	unsigned mModules;
+
+	/// State of the module being built
+	llvm::Module *mModule;
+	llvm::StructType *mCtxType;
+
+	/// State of the function being lowered
+	struct Lowering
+	{
+		llvm::IRBuilder<> *builder;
+		int func;
+		bool osr;
+		/// The context as passed and as a NativeContext pointer
+		llvm::Value *raw;
+		llvm::Value *ctx;
+		llvm::Value *baseSlot;
+		std::vector<llvm::Value *> regs;
+		llvm::Value *mark;
+		llvm::BasicBlock *unwind;
+	};
+
+	JIT(const BCProgram &program, unsigned threshold, std::unique_ptr<llvm::orc::LLJIT> jit)
+		: mProgram(program), mThreshold(threshold), mJIT(std::move(jit)),
+		  mContext(std::make_unique<llvm::LLVMContext>()), mDefined(program.functions.size(), false),
+		  mInterpreted(program.functions.size(), false), mEntries(), mModules(0), mModule(nullptr), mCtxType(nullptr)
+	{
+		for (bool changed = true; changed;)
+		{
+			changed = false;
+			for (int i = 0; i < program.functions.size(); i++)
+			{
+				bool interpreted = program.functions[i].memoize;
+				for (const BCInstr &in : program.functions[i].code)
+					if ((in.op == OP_CALL && mInterpreted[in.b]) || (in.op == OP_TAILCALL && mInterpreted[in.a]))
+						interpreted = true;
+				if (interpreted && !mInterpreted[i])
+				{
+					mInterpreted[i] = true;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	llvm::LLVMContext &context()
+	{
+		return *mContext.getContext();
+	}
+
+	llvm::Type *i32()
+	{
+		return llvm::Type::getInt32Ty(context());
+	}
+
+	llvm::Type *i64()
+	{
+		return llvm::Type::getInt64Ty(context());
+	}
+
+	llvm::Type *i8ptr()
+	{
+		return llvm::Type::getInt8PtrTy(context());
+	}
+
+	llvm::Function *direct(int func)
+	{
+		std::string name = "bc_" + std::to_string(func);
+		if (llvm::Function *fn = mModule->getFunction(name))
+			return fn;
+		std::vector<llvm::Type *> params(1 + mProgram.functions[func].numParams, i32());
+		params[0] = i8ptr();
+		llvm::FunctionType *type = llvm::FunctionType::get(i32(), params, false);
+		return llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, mModule);
+	}
+
+	llvm::FunctionCallee helper(const char *name, llvm::Type *result, llvm::ArrayRef<llvm::Type *> params)
+	{
+		return mModule->getOrInsertFunction(name, llvm::FunctionType::get(result, params, false));
+	}
+
+	llvm::Value *field(Lowering &l, unsigned index)
+	{
+		return l.builder->CreateStructGEP(mCtxType, l.ctx, index);
+	}
+
+	void reloadBase(Lowering &l)
+	{
+		l.builder->CreateStore(l.builder->CreateLoad(i8ptr(), field(l, 0)), l.baseSlot);
+	}
+
+	llvm::Value *reg(Lowering &l, int index)
+	{
+		return l.builder->CreateLoad(i32(), l.regs[index]);
+	}
+
+	void setReg(Lowering &l, int index, llvm::Value *val)
+	{
+		l.builder->CreateStore(val, l.regs[index]);
+	}
+
+	/// Host pointer of an address, typed for an access of type
+	llvm::Value *memory(Lowering &l, llvm::Value *addr, llvm::Type *type)
+	{
+		llvm::IRBuilder<> &b = *l.builder;
+		llvm::Value *base = b.CreateLoad(i8ptr(), l.baseSlot);
+		llvm::Value *ptr = b.CreateGEP(b.getInt8Ty(), base, b.CreateZExt(addr, i64()));
+		return b.CreateBitCast(ptr, type->getPointerTo());
+	}
+
+	llvm::Value *load(Lowering &l, llvm::Value *addr, bool byte)
+	{
+		llvm::IRBuilder<> &b = *l.builder;
+		llvm::Type *type = byte ? b.getInt8Ty() : i32();
+		llvm::Value *val = b.CreateAlignedLoad(type, memory(l, addr, type), llvm::MaybeAlign(1));
+		return byte ? b.CreateSExt(val, i32()) : val;
+	}
+
+	void store(Lowering &l, llvm::Value *addr, llvm::Value *val, bool byte)
+	{
+		llvm::IRBuilder<> &b = *l.builder;
+		llvm::Type *type = byte ? b.getInt8Ty() : i32();
+		if (byte)
+			val = b.CreateTrunc(val, type);
+		b.CreateAlignedStore(val, memory(l, addr, type), llvm::MaybeAlign(1));
+	}
+
+	/// Undo what the entry of the function did
+	void epilogue(Lowering &l)
+	{
+		llvm::IRBuilder<> &b = *l.builder;
+		if (l.mark)
+			b.CreateCall(helper("jit_release_allocas", b.getVoidTy(), {i8ptr(), i64()}), {l.raw, l.mark});
+		if (!l.osr)
+		{
+			llvm::Value *depth = field(l, 2);
+			b.CreateStore(b.CreateSub(b.CreateLoad(i64(), depth), b.getInt64(1)), depth);
+		}
+	}
+
+	void ret(Lowering &l, llvm::Value *val)
+	{
+		epilogue(l);
+		l.builder->CreateRet(val);
+	}
+
+	/// Report error and return to the VM
+	void trap(Lowering &l, int error)
+	{
+		llvm::IRBuilder<> &b = *l.builder;
+		b.CreateCall(helper("jit_trap", b.getVoidTy(), {i8ptr(), i32(), i32()}),
+					 {l.raw, b.getInt32(error), b.getInt32(l.func)});
+		b.CreateRet(b.getInt32(0));
+	}
+
+	void lower(int index, llvm::Function *fn, bool osr, int start)
+	{
+		const BCFunction &func = mProgram.functions[index];
+		llvm::LLVMContext &C = context();
+		llvm::IRBuilder<> b(llvm::BasicBlock::Create(C, "entry", fn));
+		llvm::Function::arg_iterator args = fn->arg_begin();
+		llvm::Value *ctx8 = &*args++;
+
+		Lowering l = {&b, index, osr, ctx8, b.CreateBitCast(ctx8, mCtxType->getPointerTo()), nullptr, {}, nullptr, nullptr};
+		l.baseSlot = b.CreateAlloca(i8ptr());
+		for (int i = 0; i < func.numRegs; i++)
+			l.regs.push_back(b.CreateAlloca(i32()));
+
+		if (osr)
+		{
+			llvm::Value *array = &*args;
+			for (int i = 0; i < func.numRegs; i++)
+				setReg(l, i, b.CreateLoad(i32(), b.CreateGEP(i32(), array, b.getInt32(i))));
+		}
+		else
+		{
+			for (int i = 0; i < func.numRegs; i++)
+				setReg(l, i, i < func.numParams ? (llvm::Value *)&*args++ : b.getInt32(0));
+			llvm::Value *depthField = field(l, 2);
+			llvm::Value *depth = b.CreateAdd(b.CreateLoad(i64(), depthField), b.getInt64(1));
+			b.CreateStore(depth, depthField);
+			llvm::BasicBlock *deep = llvm::BasicBlock::Create(C, "deep", fn);
+			llvm::BasicBlock *body = llvm::BasicBlock::Create(C, "body", fn);
+			b.CreateCondBr(b.CreateICmpSGT(depth, b.CreateLoad(i64(), field(l, 3))), deep, body);
+			b.SetInsertPoint(deep);
+			trap(l, JIT_DEPTH);
+			b.SetInsertPoint(body);
+		}
+		reloadBase(l);
+		for (const BCInstr &in : func.code)
+			if (in.op == OP_ALLOCA)
+			{
+				l.mark = b.CreateCall(helper("jit_alloca_mark", i64(), {i8ptr()}), {ctx8});
+				break;
+			}
+
+		/// Every jump target and every instruction after a jump or return starts a block
+		std::map<int, llvm::BasicBlock *> blocks;
+		blocks[start] = nullptr;
+		for (int pc = 0; pc < func.code.size(); pc++)
+		{
+			const BCInstr &in = func.code[pc];
+			const int *target = jumpTarget(in);
+			if (target)
+				blocks[*target] = nullptr;
+			if (in.op == OP_SWITCH)
+				for (int entry : func.tables[in.b].targets)
+					blocks[entry] = nullptr;
+			if (target || in.op == OP_TAILCALL || in.op == OP_RET || in.op == OP_RET0)
+				blocks[pc + 1] = nullptr;
+		}
+		for (std::map<int, llvm::BasicBlock *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+			it->second = llvm::BasicBlock::Create(C, "pc" + std::to_string(it->first), fn);
+		b.CreateBr(blocks[start]);
+		b.SetInsertPoint(llvm::BasicBlock::Create(C, "dead", fn));
+
+		for (int pc = 0; pc < func.code.size(); pc++)
+		{
+			std::map<int, llvm::BasicBlock *>::iterator leader = blocks.find(pc);
+			if (leader != blocks.end())
+			{
+				if (!b.GetInsertBlock()->getTerminator())
+					b.CreateBr(leader->second);
+				b.SetInsertPoint(leader->second);
+			}
+			const BCInstr &in = func.code[pc];
+			switch (in.op)
+			{
+			case OP_CONST:
+				setReg(l, in.a, b.getInt32(in.b));
+				break;
+			case OP_MOV:
+				setReg(l, in.a, reg(l, in.b));
+				break;
+			case OP_LDG_I:
+			case OP_LDG_C:
+				setReg(l, in.a, load(l, b.getInt32(in.b), in.op == OP_LDG_C));
+				break;
+			case OP_STG_I:
+			case OP_STG_C:
+				store(l, b.getInt32(in.a), reg(l, in.b), in.op == OP_STG_C);
+				break;
+			case OP_LD_I:
+			case OP_LD_C:
+				setReg(l, in.a, load(l, reg(l, in.b), in.op == OP_LD_C));
+				break;
+			case OP_ST_I:
+			case OP_ST_C:
+				store(l, reg(l, in.a), reg(l, in.b), in.op == OP_ST_C);
+				break;
+			case OP_LDX_I:
+			case OP_LDX_C:
+			{
+				llvm::Value *offset = reg(l, in.c);
+				if (in.op == OP_LDX_I)
+					offset = b.CreateMul(offset, b.getInt32(sizeof(int)));
+				setReg(l, in.a, load(l, b.CreateAdd(reg(l, in.b), offset), in.op == OP_LDX_C));
+				break;
+			}
+			case OP_STX_I:
+			case OP_STX_C:
+			{
+				llvm::Value *offset = reg(l, in.b);
+				if (in.op == OP_STX_I)
+					offset = b.CreateMul(offset, b.getInt32(sizeof(int)));
+				store(l, b.CreateAdd(reg(l, in.a), offset), reg(l, in.c), in.op == OP_STX_C);
+				break;
+			}
+			case OP_ADD:
+				setReg(l, in.a, b.CreateAdd(reg(l, in.b), reg(l, in.c)));
+				break;
+			case OP_SUB:
+				setReg(l, in.a, b.CreateSub(reg(l, in.b), reg(l, in.c)));
+				break;
+			case OP_MUL:
+				setReg(l, in.a, b.CreateMul(reg(l, in.b), reg(l, in.c)));
+				break;
+			case OP_DIV:
+			case OP_REM:
+			{
+				llvm::Value *divisor = reg(l, in.c);
+				llvm::BasicBlock *zero = llvm::BasicBlock::Create(C, "zero", fn);
+				llvm::BasicBlock *next = llvm::BasicBlock::Create(C, "divide", fn);
+				b.CreateCondBr(b.CreateICmpEQ(divisor, b.getInt32(0)), zero, next);
+				b.SetInsertPoint(zero);
+				trap(l, JIT_DIVISION);
+				b.SetInsertPoint(next);
+				llvm::Value *dividend = reg(l, in.b);
+				setReg(l, in.a, in.op == OP_DIV ? b.CreateSDiv(dividend, divisor) : b.CreateSRem(dividend, divisor));
+				break;
+			}
+			case OP_LT:
+				setReg(l, in.a, b.CreateZExt(b.CreateICmpSLT(reg(l, in.b), reg(l, in.c)), i32()));
+				break;
+			case OP_GT:
+				setReg(l, in.a, b.CreateZExt(b.CreateICmpSGT(reg(l, in.b), reg(l, in.c)), i32()));
+				break;
+			case OP_LE:
+				setReg(l, in.a, b.CreateZExt(b.CreateICmpSLE(reg(l, in.b), reg(l, in.c)), i32()));
+				break;
+			case OP_GE:
+				setReg(l, in.a, b.CreateZExt(b.CreateICmpSGE(reg(l, in.b), reg(l, in.c)), i32()));
+				break;
+			case OP_EQ:
+				setReg(l, in.a, b.CreateZExt(b.CreateICmpEQ(reg(l, in.b), reg(l, in.c)), i32()));
+				break;
+			case OP_NE:
+				setReg(l, in.a, b.CreateZExt(b.CreateICmpNE(reg(l, in.b), reg(l, in.c)), i32()));
+				break;
+			case OP_MULI:
+				setReg(l, in.a, b.CreateMul(reg(l, in.b), b.getInt32(in.c)));
+				break;
+			case OP_DIVI:
+				setReg(l, in.a, b.CreateSDiv(reg(l, in.b), b.getInt32(in.c)));
+				break;
+			case OP_ADDI:
+				setReg(l, in.a, b.CreateAdd(reg(l, in.b), b.getInt32(in.c)));
+				break;
+			case OP_NEG:
+				setReg(l, in.a, b.CreateNeg(reg(l, in.b)));
+				break;
+			case OP_NOT:
+				setReg(l, in.a, b.CreateZExt(b.CreateICmpEQ(reg(l, in.b), b.getInt32(0)), i32()));
+				break;
+			case OP_TRUNC_C:
+				setReg(l, in.a, b.CreateSExt(b.CreateTrunc(reg(l, in.b), b.getInt8Ty()), i32()));
+				break;
+			case OP_JMP:
+				b.CreateBr(blocks[in.a]);
+				break;
+			case OP_JZ:
+			case OP_JNZ:
+			{
+				llvm::Value *cond = b.CreateICmpNE(reg(l, in.a), b.getInt32(0));
+				if (in.op == OP_JZ)
+					b.CreateCondBr(cond, blocks[pc + 1], blocks[in.b]);
+				else
+					b.CreateCondBr(cond, blocks[in.b], blocks[pc + 1]);
+				break;
+			}
+			case OP_JLT:
+			case OP_JGT:
+			case OP_JLE:
+			case OP_JGE:
+			case OP_JEQ:
+			case OP_JNE:
+			case OP_JLTI:
+			case OP_JGTI:
+			case OP_JLEI:
+			case OP_JGEI:
+			case OP_JEQI:
+			case OP_JNEI:
+			{
+				static const llvm::CmpInst::Predicate predicates[] = {llvm::CmpInst::ICMP_SLT, llvm::CmpInst::ICMP_SGT,
+																	  llvm::CmpInst::ICMP_SLE, llvm::CmpInst::ICMP_SGE,
+																	  llvm::CmpInst::ICMP_EQ, llvm::CmpInst::ICMP_NE};
+				bool immediate = in.op >= OP_JLTI;
+				llvm::Value *right = immediate ? b.getInt32(in.b) : reg(l, in.b);
+				llvm::Value *cond = b.CreateICmp(predicates[in.op - (immediate ? OP_JLTI : OP_JLT)], reg(l, in.a), right);
+				b.CreateCondBr(cond, blocks[in.c], blocks[pc + 1]);
+				break;
+			}
+			case OP_SWITCH:
+			{
+				/// LLVM picks a jump table or a search tree for the cases again
+				const BCJumpTable &table = func.tables[in.b];
+				llvm::SwitchInst *sw = b.CreateSwitch(reg(l, in.a), blocks[in.c], table.targets.size());
+				for (int i = 0; i < table.targets.size(); i++)
+					if (table.targets[i] != in.c)
+						sw->addCase(b.getInt32(table.low + i), blocks[table.targets[i]]);
+				break;
+			}
+			case OP_CALL:
+			{
+				std::vector<llvm::Value *> callArgs(1, ctx8);
+				for (int i = 0; i < mProgram.functions[in.b].numParams; i++)
+					callArgs.push_back(reg(l, in.c + i));
+				setReg(l, in.a, b.CreateCall(direct(in.b), callArgs));
+				reloadBase(l);
+				/// A trap in the callee unwinds all native frames
+				if (!l.unwind)
+				{
+					llvm::BasicBlock *current = b.GetInsertBlock();
+					l.unwind = llvm::BasicBlock::Create(C, "unwind", fn);
+					b.SetInsertPoint(l.unwind);
+					b.CreateRet(b.getInt32(0));
+					b.SetInsertPoint(current);
+				}
+				llvm::BasicBlock *next = llvm::BasicBlock::Create(C, "return", fn);
+				llvm::Value *trapped = b.CreateLoad(i32(), field(l, 4));
+				b.CreateCondBr(b.CreateICmpNE(trapped, b.getInt32(0)), l.unwind, next);
+				b.SetInsertPoint(next);
+				break;
+			}
+			case OP_TAILCALL:
+			{
+				/// The frame is given up before the call so LLVM can turn it into a jump
+				std::vector<llvm::Value *> callArgs(1, ctx8);
+				for (int i = 0; i < mProgram.functions[in.a].numParams; i++)
+					callArgs.push_back(reg(l, in.b + i));
+				epilogue(l);
+				llvm::CallInst *result = b.CreateCall(direct(in.a), callArgs);
+				result->setTailCall();
+				b.CreateRet(result);
+				break;
+			}
+			case OP_RET:
+				ret(l, reg(l, in.a));
+				break;
+			case OP_RET0:
+				ret(l, b.getInt32(0));
+				break;
+			case OP_ALLOCA:
+				setReg(l, in.a, b.CreateCall(helper("jit_alloca", i32(), {i8ptr(), i32()}), {ctx8, reg(l, in.b)}));
+				reloadBase(l);
+				break;
+			case OP_GET:
+				setReg(l, in.a, b.CreateCall(helper("jit_input", i32(), {i8ptr()}), {ctx8}));
+				break;
+			case OP_PRINT:
+				b.CreateCall(helper("jit_output", b.getVoidTy(), {i8ptr(), i32()}), {ctx8, reg(l, in.a)});
+				break;
+			case OP_MALLOC:
+				setReg(l, in.a, b.CreateCall(helper("jit_malloc", i32(), {i8ptr(), i32()}), {ctx8, reg(l, in.b)}));
+				reloadBase(l);
+				break;
+			case OP_FREE:
+				b.CreateCall(helper("jit_free", b.getVoidTy(), {i8ptr(), i32()}), {ctx8, reg(l, in.a)});
+				reloadBase(l);
+				break;
+			default:
+				break;
+			}
+		}
+		/// Falling off the end, or jumping there, returns 0 like the VM
+		for (llvm::BasicBlock &block : *fn)
+			if (!block.getTerminator())
+			{
+				b.SetInsertPoint(&block);
+				ret(l, b.getInt32(0));
+			}
+	}
+
+	/// Add the direct entries of func and of every function it may call that is not compiled yet
+	void lowerClosure(int func, std::vector<int> &lowered)
+	{
+		std::vector<int> work(1, func);
+		std::vector<bool> seen(mProgram.functions.size(), false);
+		seen[func] = true;
+		while (!work.empty())
+		{
+			int index = work.back();
+			work.pop_back();
+			if (!mDefined[index])
+			{
+				lower(index, direct(index), false, 0);
+				lowered.push_back(index);
+			}
+			for (const BCInstr &in : mProgram.functions[index].code)
+			{
+				int callee = in.op == OP_CALL ? in.b : in.op == OP_TAILCALL ? in.a : -1;
+				if (callee >= 0 && !seen[callee])
+				{
+					seen[callee] = true;
+					work.push_back(callee);
+				}
+			}
+		}
+	}
+
+	void optimize(llvm::Module &module)
+	{
+		llvm::legacy::FunctionPassManager passes(&module);
+		passes.add(llvm::createPromoteMemoryToRegisterPass());
+		passes.add(llvm::createTailCallEliminationPass());
+		passes.add(llvm::createInstructionCombiningPass());
+		passes.add(llvm::createReassociatePass());
+		passes.add(llvm::createGVNPass());
+		passes.add(llvm::createCFGSimplificationPass());
+		passes.add(llvm::createLICMPass());
+		passes.add(llvm::createInstructionCombiningPass());
+		passes.doInitialization();
+		for (llvm::Function &fn : module)
+			if (!fn.isDeclaration())
+				passes.run(fn);
+		passes.doFinalization();
+	}
+
+public:
+	/// Set up ORC for the host, null if the native target is unavailable
+	static std::unique_ptr<JIT> create(const BCProgram &program, unsigned threshold)
+	{
+		/// Targets register once, batch runs create JITs on several threads
+		static const bool initialized = (llvm::InitializeNativeTarget(), llvm::InitializeNativeTargetAsmPrinter(), true);
+		(void)initialized;
+		llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> jit = llvm::orc::LLJITBuilder().create();
+		if (!jit)
+		{
+			llvm::errs() << "jit: " << llvm::toString(jit.takeError()) << "\n";
+			return nullptr;
+		}
+		llvm::orc::LLJIT &lljit = **jit;
+		llvm::orc::SymbolMap symbols;
+		const llvm::JITSymbolFlags flags = llvm::JITSymbolFlags::Exported;
+		symbols[lljit.mangleAndIntern("jit_input")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitInput), flags);
+		symbols[lljit.mangleAndIntern("jit_output")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitOutput), flags);
+		symbols[lljit.mangleAndIntern("jit_malloc")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitMalloc), flags);
+		symbols[lljit.mangleAndIntern("jit_free")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitFree), flags);
+		symbols[lljit.mangleAndIntern("jit_alloca")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitAlloca), flags);
+		symbols[lljit.mangleAndIntern("jit_alloca_mark")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitAllocaMark), flags);
+		symbols[lljit.mangleAndIntern("jit_release_allocas")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitReleaseAllocas), flags);
+		symbols[lljit.mangleAndIntern("jit_trap")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jitTrap), flags);
+		if (llvm::Error err = lljit.getMainJITDylib().define(llvm::orc::absoluteSymbols(symbols)))
+		{
+			llvm::errs() << "jit: " << llvm::toString(std::move(err)) << "\n";
+			return nullptr;
+		}
+		return std::unique_ptr<JIT>(new JIT(program, threshold, std::move(*jit)));
+	}
+
+	virtual unsigned threshold()
+	{
+		return mThreshold;
+	}
+
+	virtual NativeEntry compile(int func, int pc)
+	{
+		if (mInterpreted[func])
+			return nullptr;
+		std::pair<int, int> key(func, pc);
+		std::map<std::pair<int, int>, NativeEntry>::iterator it = mEntries.find(key);
+		if (it != mEntries.end())
+			return it->second;
+
+		std::unique_ptr<llvm::Module> module(new llvm::Module("bc_module_" + std::to_string(mModules++), context()));
+		module->setDataLayout(mJIT->getDataLayout());
+		mModule = module.get();
+		/// Mirrors NativeContext
+		mCtxType = llvm::StructType::get(context(), {i8ptr(), i8ptr(), i64(), i64(), i32()});
+
+		std::vector<int> lowered;
+		lowerClosure(func, lowered);
+		std::string name = "bc_" + std::to_string(func) + "_at_" + std::to_string(pc);
+		llvm::FunctionType *type = llvm::FunctionType::get(i32(), {i8ptr(), i32()->getPointerTo()}, false);
+		llvm::Function *entry = llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, mModule);
+		if (pc == 0)
+		{
+			/// Calls from the VM pass the arguments in place of the register file
+			llvm::IRBuilder<> b(llvm::BasicBlock::Create(context(), "entry", entry));
+			llvm::Function::arg_iterator args = entry->arg_begin();
+			llvm::Value *ctx = &*args++;
+			llvm::Value *array = &*args;
+			std::vector<llvm::Value *> callArgs(1, ctx);
+			for (int i = 0; i < mProgram.functions[func].numParams; i++)
+				callArgs.push_back(b.CreateLoad(i32(), b.CreateGEP(i32(), array, b.getInt32(i))));
+			b.CreateRet(b.CreateCall(direct(func), callArgs));
+		}
+		else
+			lower(func, entry, true, pc);
+		mModule = nullptr;
+
+		NativeEntry result = nullptr;
+		if (llvm::verifyModule(*module, &llvm::errs()))
+		{
+			mEntries[key] = result;
+			return result;
+		}
+		optimize(*module);
+		if (llvm::Error err = mJIT->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), mContext)))
+		{
+			llvm::errs() << "jit: " << llvm::toString(std::move(err)) << "\n";
+			mEntries[key] = result;
+			return result;
+		}
+		for (int index : lowered)
+			mDefined[index] = true;
+		llvm::Expected<llvm::JITEvaluatedSymbol> symbol = mJIT->lookup(name);
+		if (symbol)
+			result = (NativeEntry)symbol->getAddress();
+		else
+			llvm::errs() << "jit: " << llvm::toString(symbol.takeError()) << "\n";
+		mEntries[key] = result;
+		return result;
+	}
+};
@@ -0,0 +1,699 @@
+//==--- LoopOpt.h - Loop invariant code motion and strength reduction -----===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// What LoopOptimizer did to one loop
+struct LoopReport
+{
+	std::string function;
+	/// Instructions of the loop before the pass ran
+	int begin;
+	int end;
+	/// Opcodes of the instructions moved in front of the loop
+	std::vector<BCOp> hoisted;
+	/// Addresses computed from an induction variable that became registers stepped with it
+	int reduced;
+};
+
+/// LoopOptimizer rewrites the loops of a compiled program. Instructions
+/// computing the same value in every iteration move to a preheader run once
+/// before the loop, and addresses base + s * i of an induction variable i
+/// stepped by a constant become a register stepped alongside i, so an
+/// element access costs one instruction instead of three.
+///
+/// A loop is the range between a backward jump and its target, which is the
+/// shape the BytecodeCompiler emits. Inner loops are done first, so what they
+/// hoist can leave the outer loop in turn.
+class LoopOptimizer
+{
+	enum
+	{
+		USE_A = 1,
+		USE_B = 2,
+		USE_C = 4
+	};
+
+	struct Loop
+	{
+		int begin;
+		int end;
+		/// Index into mReports
+		int report;
+	};
+
+	/// The only instruction control enters a loop at from outside, and the
+	/// instruction its preheader goes in front of
+	struct Entry
+	{
+		int pc;
+		int site;
+	};
+
+	/// Instructions to add and drop, applied by rebuild
+	struct Edits
+	{
+		std::vector<BCInstr> preheader;
+		/// Instructions to put right after an instruction
+		std::map<int, std::vector<BCInstr>> after;
+		std::vector<bool> removed;
+	};
+
+	const BCProgram *mProgram;
+	std::vector<LoopReport> mReports;
+
+	/// Operands of op read as registers, calls read a range instead
+	static unsigned useMask(BCOp op)
+	{
+		switch (op)
+		{
+		case OP_MOV:
+		case OP_LD_I:
+		case OP_LD_C:
+		case OP_STG_I:
+		case OP_STG_C:
+		case OP_MULI:
+		case OP_DIVI:
+		case OP_ADDI:
+		case OP_NEG:
+		case OP_NOT:
+		case OP_TRUNC_C:
+		case OP_ALLOCA:
+		case OP_MALLOC:
+			return USE_B;
+		case OP_ST_I:
+		case OP_ST_C:
+			return USE_A | USE_B;
+		case OP_LDX_I:
+		case OP_LDX_C:
+			return USE_B | USE_C;
+		case OP_STX_I:
+		case OP_STX_C:
+			return USE_A | USE_B | USE_C;
+		case OP_JZ:
+		case OP_JNZ:
+		case OP_JLTI:
+		case OP_JGTI:
+		case OP_JLEI:
+		case OP_JGEI:
+		case OP_JEQI:
+		case OP_JNEI:
+		case OP_SWITCH:
+		case OP_RET:
+		case OP_PRINT:
+		case OP_FREE:
+			return USE_A;
+		case OP_JLT:
+		case OP_JGT:
+		case OP_JLE:
+		case OP_JGE:
+		case OP_JEQ:
+		case OP_JNE:
+			return USE_A | USE_B;
+		default:
+			return op >= OP_ADD && op <= OP_NE ? USE_B | USE_C : 0;
+		}
+	}
+
+	/// Register written by in, -1 if none
+	static int def(const BCInstr &in)
+	{
+		switch (in.op)
+		{
+		case OP_STG_I:
+		case OP_STG_C:
+		case OP_ST_I:
+		case OP_ST_C:
+		case OP_STX_I:
+		case OP_STX_C:
+		case OP_TAILCALL:
+		case OP_RET:
+		case OP_RET0:
+		case OP_PRINT:
+		case OP_FREE:
+			return -1;
+		default:
+			return in.op >= OP_JMP && in.op <= OP_SWITCH ? -1 : in.a;
+		}
+	}
+
+	void uses(const BCInstr &in, std::vector<int> &regs)
+	{
+		regs.clear();
+		if (in.op == OP_CALL || in.op == OP_TAILCALL)
+		{
+			int callee = in.op == OP_CALL ? in.b : in.a;
+			int base = in.op == OP_CALL ? in.c : in.b;
+			for (int i = 0; i < mProgram->functions[callee].numParams; i++)
+				regs.push_back(base + i);
+			return;
+		}
+		unsigned mask = useMask(in.op);
+		if (mask & USE_A)
+			regs.push_back(in.a);
+		if (mask & USE_B)
+			regs.push_back(in.b);
+		if (mask & USE_C)
+			regs.push_back(in.c);
+	}
+
+	/// Arithmetic that cannot trap and reads no memory
+	static bool movable(BCOp op)
+	{
+		switch (op)
+		{
+		case OP_CONST:
+		case OP_MOV:
+		case OP_MULI:
+		case OP_DIVI:
+		case OP_ADDI:
+		case OP_NEG:
+		case OP_NOT:
+		case OP_TRUNC_C:
+			return true;
+		default:
+			return op >= OP_ADD && op <= OP_NE && op != OP_DIV && op != OP_REM;
+		}
+	}
+
+	static void successors(const BCFunction &func, int pc, std::vector<int> &succs)
+	{
+		succs.clear();
+		const BCInstr &in = func.code[pc];
+		if (in.op == OP_RET || in.op == OP_RET0 || in.op == OP_TAILCALL)
+			return;
+		if (in.op == OP_SWITCH)
+			succs.insert(succs.end(), func.tables[in.b].targets.begin(), func.tables[in.b].targets.end());
+		if (const int *target = jumpTarget(in))
+			succs.push_back(*target);
+		if (in.op != OP_JMP && in.op != OP_SWITCH)
+			succs.push_back(pc + 1);
+	}
+
+	/// Registers live on entry to every instruction
+	std::vector<llvm::BitVector> liveness(const BCFunction &func)
+	{
+		int size = func.code.size();
+		std::vector<llvm::BitVector> live(size, llvm::BitVector(func.numRegs));
+		std::vector<int> succs, regs;
+		for (bool changed = true; changed;)
+		{
+			changed = false;
+			for (int pc = size - 1; pc >= 0; pc--)
+			{
+				llvm::BitVector in(func.numRegs);
+				successors(func, pc, succs);
+				for (int succ : succs)
+					in |= live[succ];
+				int reg = def(func.code[pc]);
+				if (reg >= 0)
+					in.reset(reg);
+				uses(func.code[pc], regs);
+				for (int use : regs)
+					in.set(use);
+				if (in != live[pc])
+				{
+					live[pc] = in;
+					changed = true;
+				}
+			}
+		}
+		return live;
+	}
+
+	/// Registers that have to keep their value across the boundary of loop:
+	/// live where control enters it or leaves it
+	llvm::BitVector boundary(const BCFunction &func, const Loop &loop, const Entry &entry,
+							 const std::vector<llvm::BitVector> &live)
+	{
+		llvm::BitVector regs = live[entry.pc];
+		std::vector<int> succs;
+		for (int pc = loop.begin; pc <= loop.end; pc++)
+		{
+			successors(func, pc, succs);
+			for (int succ : succs)
+				if (succ < loop.begin || succ > loop.end)
+					regs |= live[succ];
+		}
+		return regs;
+	}
+
+	/// Find where control enters loop, false if it has several entries or
+	/// no place for a preheader
+	bool entry(const BCFunction &func, const Loop &loop, Entry &entry)
+	{
+		/// Control enters a loop at the start of the function from the caller
+		entry.pc = loop.begin == 0 ? 0 : -1;
+		std::vector<int> succs;
+		for (int pc = 0; pc < func.code.size(); pc++)
+		{
+			if (pc >= loop.begin && pc <= loop.end)
+				continue;
+			successors(func, pc, succs);
+			for (int succ : succs)
+				if (succ >= loop.begin && succ <= loop.end)
+				{
+					if (entry.pc >= 0 && entry.pc != succ)
+						return false;
+					entry.pc = succ;
+				}
+		}
+		if (entry.pc == loop.begin)
+			entry.site = loop.begin;
+		else if (entry.pc > 0 && loop.begin > 0 && func.code[loop.begin - 1].op == OP_JMP &&
+				 func.code[loop.begin - 1].a == entry.pc)
+			/// A rotated loop is entered by the jump to its condition
+			entry.site = loop.begin - 1;
+		else
+			return false;
+		return true;
+	}
+
+	/// Apply edits to func, the preheader goes in front of site. Jumps from
+	/// outside loop to site run the preheader, jumps to removed instructions
+	/// go to what follows them. The ranges of loop and the pending loops,
+	/// which contain it or are disjoint from it, are moved along.
+	void rebuild(BCFunction &func, Loop &loop, int site, const Edits &edits, std::vector<Loop> &pending)
+	{
+		int size = func.code.size();
+		/// Where the code emitted for each instruction starts, and where the instruction itself is
+		std::vector<int> start(size), self(size);
+		int next = 0;
+		for (int pc = 0; pc < size; pc++)
+		{
+			start[pc] = next;
+			if (pc == site)
+				next += edits.preheader.size();
+			self[pc] = next;
+			if (!edits.removed[pc])
+				next++;
+			std::map<int, std::vector<BCInstr>>::const_iterator it = edits.after.find(pc);
+			if (it != edits.after.end())
+				next += it->second.size();
+		}
+
+		std::vector<BCInstr> code;
+		code.reserve(next);
+		for (int pc = 0; pc < size; pc++)
+		{
+			if (pc == site)
+				code.insert(code.end(), edits.preheader.begin(), edits.preheader.end());
+			if (!edits.removed[pc])
+			{
+				BCInstr in = func.code[pc];
+				bool inside = pc >= loop.begin && pc <= loop.end;
+				if (int *target = jumpTarget(in))
+					*target = inside ? self[*target] : start[*target];
+				if (in.op == OP_SWITCH)
+					for (int &entry : func.tables[in.b].targets)
+						entry = inside ? self[entry] : start[entry];
+				code.push_back(in);
+			}
+			std::map<int, std::vector<BCInstr>>::const_iterator it = edits.after.find(pc);
+			if (it != edits.after.end())
+				code.insert(code.end(), it->second.begin(), it->second.end());
+		}
+		func.code.swap(code);
+		loop.begin = self[loop.begin];
+		loop.end = self[loop.end];
+		for (Loop &other : pending)
+		{
+			other.begin = start[other.begin];
+			other.end = self[other.end];
+		}
+	}
+
+	/// Move the invariant instructions of loop to its preheader, false if there were none
+	bool hoist(BCFunction &func, Loop &loop, std::vector<Loop> &pending)
+	{
+		Entry where;
+		if (!entry(func, loop, where))
+			return false;
+		std::vector<llvm::BitVector> live = liveness(func);
+		llvm::BitVector pinned = boundary(func, loop, where, live);
+		std::vector<int> defs(func.numRegs, 0);
+		for (int pc = loop.begin; pc <= loop.end; pc++)
+			if (def(func.code[pc]) >= 0)
+				defs[def(func.code[pc])]++;
+
+		/// An instruction is invariant if its operands are, hoisting one makes its users candidates
+		Edits edits;
+		edits.removed.assign(func.code.size(), false);
+		std::vector<int> regs;
+		for (bool changed = true; changed;)
+		{
+			changed = false;
+			for (int pc = loop.begin; pc <= loop.end; pc++)
+			{
+				const BCInstr &in = func.code[pc];
+				int reg = def(in);
+				if (edits.removed[pc] || !movable(in.op) || defs[reg] != 1 || pinned.test(reg))
+					continue;
+				uses(in, regs);
+				bool invariant = true;
+				for (int use : regs)
+					invariant = invariant && defs[use] == 0;
+				if (!invariant)
+					continue;
+				edits.removed[pc] = true;
+				edits.preheader.push_back(in);
+				mReports[loop.report].hoisted.push_back(in.op);
+				defs[reg] = 0;
+				changed = true;
+			}
+		}
+		if (edits.preheader.empty())
+			return false;
+		rebuild(func, loop, where.site, edits, pending);
+		return true;
+	}
+
+	/// Replace one address base + s * i by a register stepped with the induction variable i,
+	/// false if no address qualifies. The address has to be computed in the same iteration,
+	/// before i is stepped, and be dead outside the loop.
+	bool reduce(BCFunction &func, Loop &loop, std::vector<Loop> &pending)
+	{
+		Entry where;
+		if (!entry(func, loop, where))
+			return false;
+		std::vector<llvm::BitVector> live = liveness(func);
+		llvm::BitVector pinned = boundary(func, loop, where, live);
+		std::vector<int> defs(func.numRegs, 0), defpc(func.numRegs, -1), usecount(func.numRegs, 0);
+		std::vector<int> regs;
+		for (int pc = loop.begin; pc <= loop.end; pc++)
+		{
+			int reg = def(func.code[pc]);
+			if (reg >= 0)
+			{
+				defs[reg]++;
+				defpc[reg] = pc;
+			}
+			uses(func.code[pc], regs);
+			for (int use : regs)
+				usecount[use]++;
+		}
+		/// Instructions of inner loops may run several times per iteration
+		std::vector<bool> inner(func.code.size(), false);
+		std::vector<bool> leader(func.code.size() + 1, false);
+		leader[where.pc] = true;
+		std::vector<int> succs;
+		for (int pc = loop.begin; pc <= loop.end; pc++)
+		{
+			successors(func, pc, succs);
+			for (int succ : succs)
+			{
+				if (succ != pc + 1)
+				{
+					leader[succ] = true;
+					leader[pc + 1] = true;
+				}
+				if (succ <= pc && pc != loop.end)
+					for (int body = succ; body <= pc; body++)
+						inner[body] = true;
+			}
+		}
+
+		for (int pcadd = loop.begin; pcadd <= loop.end; pcadd++)
+		{
+			const BCInstr &add = func.code[pcadd];
+			int addr = add.a;
+			if (add.op != OP_ADD || defs[addr] != 1 || pinned.test(addr) || add.b == add.c)
+				continue;
+			for (int side = 0; side < 2; side++)
+			{
+				int base = side ? add.c : add.b;
+				int index = side ? add.b : add.c;
+				if (defs[base] != 0)
+					continue;
+				/// index is i itself, or s * i computed right before in the same block
+				int scale = 1;
+				int iv = index;
+				int pcmul = -1;
+				if (defs[index] == 1 && func.code[defpc[index]].op == OP_MULI)
+				{
+					pcmul = defpc[index];
+					bool sameBlock = pcmul < pcadd;
+					for (int pc = pcmul + 1; sameBlock && pc <= pcadd; pc++)
+						sameBlock = !leader[pc] && !jumpTarget(func.code[pc - 1]);
+					if (!sameBlock || usecount[index] != 1 || pinned.test(index))
+						continue;
+					scale = func.code[pcmul].c;
+					iv = func.code[pcmul].b;
+				}
+				if (defs[iv] != 1)
+					continue;
+				int pcstep = defpc[iv];
+				const BCInstr &step = func.code[pcstep];
+				if (step.op != OP_ADDI || step.b != iv || inner[pcstep] || pcstep < pcadd)
+					continue;
+				/// Every use of the address comes before i is stepped, and can read a register
+				bool usable = true;
+				for (int pc = loop.begin; usable && pc <= loop.end; pc++)
+				{
+					uses(func.code[pc], regs);
+					if (std::find(regs.begin(), regs.end(), addr) == regs.end())
+						continue;
+					usable = pc > pcadd && pc < pcstep && func.code[pc].op != OP_CALL && func.code[pc].op != OP_TAILCALL;
+				}
+				if (!usable)
+					continue;
+
+				int ptr = func.numRegs++;
+				Edits edits;
+				edits.removed.assign(func.code.size(), false);
+				if (scale == 1)
+					edits.preheader.push_back(BCInstr{OP_ADD, ptr, base, iv});
+				else
+				{
+					edits.preheader.push_back(BCInstr{OP_MULI, ptr, iv, scale});
+					edits.preheader.push_back(BCInstr{OP_ADD, ptr, base, ptr});
+				}
+				edits.after[pcstep].push_back(BCInstr{OP_ADDI, ptr, ptr, step.c * scale});
+				edits.removed[pcadd] = true;
+				if (pcmul >= 0)
+					edits.removed[pcmul] = true;
+				for (int pc = pcadd + 1; pc < pcstep; pc++)
+				{
+					BCInstr &in = func.code[pc];
+					unsigned mask = useMask(in.op);
+					if ((mask & USE_A) && in.a == addr)
+						in.a = ptr;
+					if ((mask & USE_B) && in.b == addr)
+						in.b = ptr;
+					if ((mask & USE_C) && in.c == addr)
+						in.c = ptr;
+				}
+				mReports[loop.report].reduced++;
+				rebuild(func, loop, where.site, edits, pending);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static int find(std::vector<int> &parent, int web)
+	{
+		while (parent[web] != web)
+			web = parent[web] = parent[parent[web]];
+		return web;
+	}
+
+	/// Give every web of a register, the definitions reaching common uses,
+	/// a register of its own. The compiler reuses its temporaries in every
+	/// statement, so without this a value computed in a loop would look
+	/// defined several times. Webs read as call arguments keep their
+	/// register, the arguments have to stay adjacent.
+	void splitWebs(BCFunction &func)
+	{
+		int size = func.code.size();
+		/// Definitions 0 to numRegs - 1 stand for the values registers have on entry
+		std::vector<int> defpc(func.numRegs, -1), site(size, -1);
+		for (int pc = 0; pc < size; pc++)
+			if (def(func.code[pc]) >= 0)
+			{
+				site[pc] = defpc.size();
+				defpc.push_back(pc);
+			}
+		int numDefs = defpc.size();
+		std::vector<llvm::BitVector> defsOf(func.numRegs, llvm::BitVector(numDefs));
+		for (int web = 0; web < numDefs; web++)
+			defsOf[web < func.numRegs ? web : def(func.code[defpc[web]])].set(web);
+
+		/// Reaching definitions
+		std::vector<llvm::BitVector> reach(size, llvm::BitVector(numDefs));
+		for (int reg = 0; reg < func.numRegs; reg++)
+			reach[0].set(reg);
+		std::vector<int> succs, regs;
+		for (bool changed = true; changed;)
+		{
+			changed = false;
+			for (int pc = 0; pc < size; pc++)
+			{
+				llvm::BitVector out = reach[pc];
+				if (site[pc] >= 0)
+				{
+					out.reset(defsOf[def(func.code[pc])]);
+					out.set(site[pc]);
+				}
+				successors(func, pc, succs);
+				for (int succ : succs)
+				{
+					llvm::BitVector merged = reach[succ];
+					merged |= out;
+					if (merged != reach[succ])
+					{
+						reach[succ] = merged;
+						changed = true;
+					}
+				}
+			}
+		}
+
+		std::vector<int> parent(numDefs);
+		for (int web = 0; web < numDefs; web++)
+			parent[web] = web;
+		std::vector<bool> fixed(numDefs, false), read(numDefs, false);
+		for (int pc = 0; pc < size; pc++)
+		{
+			const BCInstr &in = func.code[pc];
+			uses(in, regs);
+			for (int use : regs)
+			{
+				llvm::BitVector reaching = reach[pc];
+				reaching &= defsOf[use];
+				int first = reaching.find_first();
+				for (int web = first; web >= 0; web = reaching.find_next(web))
+					parent[find(parent, web)] = find(parent, first);
+				if (first >= 0)
+				{
+					read[first] = true;
+					fixed[first] = fixed[first] || in.op == OP_CALL || in.op == OP_TAILCALL;
+				}
+			}
+		}
+		for (int web = 0; web < numDefs; web++)
+		{
+			int root = find(parent, web);
+			read[root] = read[root] || read[web];
+			fixed[root] = fixed[root] || fixed[web];
+		}
+
+		/// The webs of the entry values that are read and the webs of call arguments
+		/// keep their register, as does the first other web of a register, the rest
+		/// get new ones
+		std::vector<int> assigned(numDefs, -1);
+		std::vector<bool> kept(func.numRegs, false);
+		for (int web = 0; web < numDefs; web++)
+		{
+			int root = find(parent, web);
+			int reg = web < func.numRegs ? web : def(func.code[defpc[web]]);
+			if (assigned[root] < 0 && (web < func.numRegs ? read[root] : fixed[root]))
+			{
+				assigned[root] = reg;
+				kept[reg] = true;
+			}
+		}
+		for (int web = func.numRegs; web < numDefs; web++)
+		{
+			int root = find(parent, web);
+			if (assigned[root] >= 0)
+				continue;
+			int reg = def(func.code[defpc[web]]);
+			assigned[root] = kept[reg] ? func.numRegs++ : reg;
+			kept[reg] = true;
+		}
+
+		for (int pc = 0; pc < size; pc++)
+		{
+			BCInstr &in = func.code[pc];
+			if (in.op == OP_CALL || in.op == OP_TAILCALL)
+				continue;
+			unsigned mask = useMask(in.op);
+			int *operands[] = {&in.a, &in.b, &in.c};
+			for (int bit = 0; bit < 3; bit++)
+				if (mask & (1 << bit))
+				{
+					llvm::BitVector reaching = reach[pc];
+					reaching &= defsOf[*operands[bit]];
+					int first = reaching.find_first();
+					if (first >= 0)
+						*operands[bit] = assigned[find(parent, first)];
+				}
+		}
+		for (int pc = 0; pc < size; pc++)
+			if (site[pc] >= 0)
+				func.code[pc].a = assigned[find(parent, site[pc])];
+	}
+
+	void function(BCFunction &func)
+	{
+		/// Backward jumps close loops, several jumps back to one instruction close the same loop
+		std::map<int, int> ends;
+		std::vector<int> succs;
+		for (int pc = 0; pc < func.code.size(); pc++)
+		{
+			successors(func, pc, succs);
+			for (int succ : succs)
+				if (succ <= pc)
+					ends[succ] = std::max(ends[succ], pc);
+		}
+		if (!ends.empty())
+			splitWebs(func);
+		std::vector<Loop> pending;
+		for (const std::pair<const int, int> &range : ends)
+		{
+			pending.push_back(Loop{range.first, range.second, (int)mReports.size()});
+			mReports.push_back(LoopReport{func.name, range.first, range.second, std::vector<BCOp>(), 0});
+		}
+		/// Loops nest, so the shorter of two overlapping ones is inside the other
+		std::sort(pending.begin(), pending.end(),
+				  [](const Loop &left, const Loop &right) { return left.end - left.begin > right.end - right.begin; });
+		while (!pending.empty())
+		{
+			Loop loop = pending.back();
+			pending.pop_back();
+			hoist(func, loop, pending);
+			for (int limit = loop.end - loop.begin; limit > 0 && reduce(func, loop, pending); limit--)
+				;
+		}
+	}
+
+public:
+	LoopOptimizer() : mProgram(nullptr), mReports()
+	{
+	}
+
+	void run(BCProgram &program)
+	{
+		mProgram = &program;
+		for (BCFunction &func : program.functions)
+			function(func);
+	}
+
+	const std::vector<LoopReport> &getReports()
+	{
+		return mReports;
+	}
+
+	/// One line per loop, ranges are instruction indices before the pass ran
+	void print(llvm::raw_ostream &os)
+	{
+		for (const LoopReport &report : mReports)
+		{
+			os << "loop-opt: " << report.function << " [" << report.begin << ", " << report.end << "]: hoisted "
+			   << report.hoisted.size();
+			for (size_t i = 0; i < report.hoisted.size(); i++)
+				os << (i ? " " : " (") << opName(report.hoisted[i]) << (i + 1 == report.hoisted.size() ? ")" : "");
+			os << ", reduced " << report.reduced << "\n";
+		}
+	}
+};
@@ -0,0 +1,109 @@
+//==--- Memo.h - Bounded cache of the results of pure function calls ------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+/// MemoCache maps a function and its argument tuple to the value the call
+/// returned. It is direct mapped, a new result evicts whatever occupied its
+/// entry, so the memory use is fixed no matter how many calls are made.
+class MemoCache
+{
+public:
+	enum
+	{
+		/// Functions with more parameters are not memoized
+		MAX_ARGS = 4,
+		CAPACITY = 1 << 16
+	};
+
+	struct Key
+	{
+		int func;
+		int numArgs;
+		int args[MAX_ARGS];
+	};
+
+private:
+	struct Entry
+	{
+		Key key;
+		int value;
+		bool valid;
+	};
+
+	/// Allocated by the first insert, programs that never miss pay nothing
+	std::vector<Entry> mEntries;
+	uint64_t mHits;
+	uint64_t mMisses;
+
+	static unsigned hash(const Key &key)
+	{
+		unsigned h = key.func * 0x9e3779b9u;
+		for (int i = 0; i < key.numArgs; i++)
+			h = (h ^ (unsigned)key.args[i]) * 0x01000193u;
+		return (h ^ (h >> 16)) & (CAPACITY - 1);
+	}
+
+	static bool same(const Key &left, const Key &right)
+	{
+		if (left.func != right.func || left.numArgs != right.numArgs)
+			return false;
+		for (int i = 0; i < left.numArgs; i++)
+			if (left.args[i] != right.args[i])
+				return false;
+		return true;
+	}
+
+public:
+	MemoCache() : mEntries(), mHits(0), mMisses(0)
+	{
+	}
+
+	static Key key(int func, const int *args, int numArgs)
+	{
+		Key key = {func, numArgs, {0}};
+		for (int i = 0; i < numArgs; i++)
+			key.args[i] = args[i];
+		return key;
+	}
+
+	/// Sets value and counts a hit if the result of the call is known
+	bool lookup(const Key &key, int &value)
+	{
+		if (!mEntries.empty())
+		{
+			const Entry &entry = mEntries[hash(key)];
+			if (entry.valid && same(entry.key, key))
+			{
+				mHits++;
+				value = entry.value;
+				return true;
+			}
+		}
+		mMisses++;
+		return false;
+	}
+
+	void insert(const Key &key, int value)
+	{
+		if (mEntries.empty())
+			mEntries.resize(CAPACITY);
+		Entry &entry = mEntries[hash(key)];
+		entry.key = key;
+		entry.value = value;
+		entry.valid = true;
+	}
+
+	uint64_t hits()
+	{
+		return mHits;
+	}
+
+	uint64_t misses()
+	{
+		return mMisses;
+	}
+};
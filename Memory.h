@@ -0,0 +1,257 @@
+//==--- Memory.h - Byte addressed memory shared by the execution engines ---===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <assert.h>
+
+#include <vector>
+
+#include "llvm/Support/MathExtras.h"
+
+/// Memory maps address to a value, addresses are represented using an Integer value.
+///
+/// The bytes below the heap hold the data segment set up by Reserve. Every heap
+/// block starts with an 8 byte header holding its size and the size of the block
+/// physically before it. Blocks of at most SMALL_LIMIT bytes are recycled through
+/// one free list per size class and never merged. Larger free blocks are merged
+/// with free large neighbours and kept in power of two bins. Malloc and Free take
+/// constant time.
+class Memory
+{
+	enum
+	{
+		ALIGN = 8,
+		HEADER = 8,
+		MIN_BLOCK = 16,
+		SMALL_LIMIT = 256,
+		NUM_SMALL = SMALL_LIMIT / ALIGN + 1,
+		NUM_LARGE = 32
+	};
+	/// Flags kept in the low bits of the block size
+	enum
+	{
+		USED = 1,
+		LARGE_FREE = 2,
+		FLAGS = 7
+	};
+
+protected:
+	/// Memory maps Addresses to Values
+	std::vector<char> mValues;
+	/// First address of the heap, the bytes below hold the data segment
+	int mHeapBase;
+	/// Size of the block ending at the top of the heap, 0 if the heap is empty
+	int mLastSize;
+	/// Heads of the free lists of the small size classes, -1 if empty
+	int mSmall[NUM_SMALL];
+	/// Heads of the free lists of the large bins, bin k holds sizes in [2^k, 2^(k+1))
+	int mLarge[NUM_LARGE];
+	/// Bit k is set if mLarge[k] is not empty
+	unsigned mLargeMask;
+
+	int &field(int addr)
+	{
+		return *(int *)&mValues[addr];
+	}
+
+	/// Header of the block starting at block: size | flags, then the previous block size
+	int blockSize(int block)
+	{
+		return field(block) & ~FLAGS;
+	}
+
+	int blockFlags(int block)
+	{
+		return field(block) & FLAGS;
+	}
+
+	void setHeader(int block, int size, int flags)
+	{
+		field(block) = size | flags;
+	}
+
+	int &prevSize(int block)
+	{
+		return field(block + 4);
+	}
+
+	/// Free large blocks are doubly linked through their payload
+	int &nextFree(int block)
+	{
+		return field(block + HEADER);
+	}
+
+	int &prevFree(int block)
+	{
+		return field(block + HEADER + 4);
+	}
+
+	/// Tell the block following block about its new size
+	void setFollower(int block, int size)
+	{
+		if (block + size == mValues.size())
+			mLastSize = size;
+		else
+			prevSize(block + size) = size;
+	}
+
+	void link(int block, int size)
+	{
+		int bin = llvm::Log2_32(size);
+		setHeader(block, size, LARGE_FREE);
+		setFollower(block, size);
+		nextFree(block) = mLarge[bin];
+		prevFree(block) = -1;
+		if (mLarge[bin] >= 0)
+			prevFree(mLarge[bin]) = block;
+		mLarge[bin] = block;
+		mLargeMask |= 1u << bin;
+	}
+
+	void unlink(int block)
+	{
+		int bin = llvm::Log2_32(blockSize(block));
+		int next = nextFree(block);
+		int prev = prevFree(block);
+		if (prev >= 0)
+			nextFree(prev) = next;
+		else
+			mLarge[bin] = next;
+		if (next >= 0)
+			prevFree(next) = prev;
+		if (mLarge[bin] < 0)
+			mLargeMask &= ~(1u << bin);
+	}
+
+	/// Cut a fresh block from the top of the heap
+	int carve(int size)
+	{
+		int block = mValues.size();
+		mValues.resize(block + size);
+		setHeader(block, size, USED);
+		prevSize(block) = mLastSize;
+		mLastSize = size;
+		return block + HEADER;
+	}
+
+	/// Hand out a large free block, giving back the tail if it is large itself
+	int take(int block, int size)
+	{
+		unlink(block);
+		int rest = blockSize(block) - size;
+		if (rest > SMALL_LIMIT)
+		{
+			setHeader(block, size, USED);
+			prevSize(block + size) = size;
+			link(block + size, rest);
+		}
+		else
+			setHeader(block, blockSize(block), USED);
+		return block + HEADER;
+	}
+
+public:
+	Memory() : mValues(), mHeapBase(0), mLastSize(0), mLargeMask(0)
+	{
+		for (int i = 0; i < NUM_SMALL; i++)
+			mSmall[i] = -1;
+		for (int i = 0; i < NUM_LARGE; i++)
+			mLarge[i] = -1;
+	}
+
+	/// Place a data segment of size bytes at address 0, must precede any Malloc
+	void Reserve(int size)
+	{
+		assert(mValues.size() == mHeapBase);
+		mHeapBase = (size + ALIGN - 1) & ~(ALIGN - 1);
+		mValues.resize(mHeapBase);
+	}
+
+	int Malloc(int size)
+	{
+		int need = (size + HEADER + ALIGN - 1) & ~(ALIGN - 1);
+		if (need < MIN_BLOCK)
+			need = MIN_BLOCK;
+		if (need <= SMALL_LIMIT)
+		{
+			int cls = need / ALIGN;
+			int block = mSmall[cls];
+			if (block < 0)
+				return carve(need);
+			mSmall[cls] = nextFree(block);
+			setHeader(block, need, USED);
+			return block + HEADER;
+		}
+
+		/// Try the head of the bin need falls in, then any block of a larger bin
+		int bin = llvm::Log2_32(need);
+		if (mLarge[bin] >= 0 && blockSize(mLarge[bin]) >= need)
+			return take(mLarge[bin], need);
+		unsigned larger = bin + 1 < NUM_LARGE ? mLargeMask & (~0u << (bin + 1)) : 0;
+		if (larger)
+			return take(mLarge[llvm::countTrailingZeros(larger)], need);
+		return carve(need);
+	}
+
+	void Free(int addr)
+	{
+		int block = addr - HEADER;
+		assert(block >= mHeapBase && block < mValues.size());
+		assert(blockFlags(block) == USED);
+		int size = blockSize(block);
+		if (size <= SMALL_LIMIT)
+		{
+			setHeader(block, size, 0);
+			nextFree(block) = mSmall[size / ALIGN];
+			mSmall[size / ALIGN] = block;
+			return;
+		}
+
+		int prev = prevSize(block);
+		if (prev && blockFlags(block - prev) == LARGE_FREE)
+		{
+			unlink(block - prev);
+			block -= prev;
+			size += prev;
+		}
+		int next = block + size;
+		if (next < mValues.size() && blockFlags(next) == LARGE_FREE)
+		{
+			unlink(next);
+			size += blockSize(next);
+		}
+		if (block + size == mValues.size())
+		{
+			/// The block is at the top, give it back
+			mLastSize = prevSize(block);
+			mValues.resize(block);
+			return;
+		}
+		link(block, size);
+	}
+
+	void Update(int addr, int val)
+	{
+		*(int *)&mValues[addr] = val;
+	}
+	void Update(int addr, char val)
+	{
+		*(char *)&mValues[addr] = val;
+	}
+
+	/// Host address of address 0, valid until the next Reserve or Malloc
+	char *base()
+	{
+		return mValues.data();
+	}
+
+	int getInt(int addr)
+	{
+		return *(int *)&mValues[addr];
+	}
+
+	char getChar(int addr)
+	{
+		return *(char *)&mValues[addr];
+	}
+};
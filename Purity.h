@@ -0,0 +1,120 @@
+//==--- Purity.h - Find the functions whose result depends on the arguments ===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseSet.h"
+
+using namespace clang;
+
+/// PurityAnalysis finds the functions that only compute a value from their
+/// int and char parameters. Their bodies touch nothing but scalar locals and
+/// call nothing but other pure functions, so repeating a call with the same
+/// arguments yields the same result and has no effect.
+class PurityAnalysis
+{
+	/// Canonical declarations of the pure functions
+	llvm::DenseSet<const FunctionDecl *> mPure;
+
+	static bool scalar(QualType type)
+	{
+		return type->isIntegerType();
+	}
+
+	/// Check stmt against the rules that need no other function, the
+	/// functions it calls are collected in callees
+	static bool local(const Stmt *stmt, std::vector<const FunctionDecl *> &callees)
+	{
+		if (!stmt)
+			return true;
+		if (const DeclRefExpr *declref = dyn_cast<DeclRefExpr>(stmt))
+		{
+			const ValueDecl *decl = declref->getDecl();
+			if (const VarDecl *vardecl = dyn_cast<VarDecl>(decl))
+				return vardecl->hasLocalStorage() && scalar(vardecl->getType());
+			return isa<FunctionDecl>(decl) || isa<EnumConstantDecl>(decl);
+		}
+		if (const DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt))
+		{
+			for (const Decl *decl : declstmt->decls())
+				if (const VarDecl *vardecl = dyn_cast<VarDecl>(decl))
+					if (!vardecl->hasLocalStorage() || !scalar(vardecl->getType()))
+						return false;
+		}
+		else if (const UnaryOperator *uop = dyn_cast<UnaryOperator>(stmt))
+		{
+			if (uop->getOpcode() == UO_Deref || uop->getOpcode() == UO_AddrOf)
+				return false;
+		}
+		else if (isa<ArraySubscriptExpr>(stmt))
+			return false;
+		else if (const CallExpr *callexpr = dyn_cast<CallExpr>(stmt))
+		{
+			/// The builtins have no definition
+			const FunctionDecl *callee = callexpr->getDirectCallee();
+			if (!callee || !callee->getDefinition())
+				return false;
+			callees.push_back(callee->getCanonicalDecl());
+		}
+		for (const Stmt *child : stmt->children())
+			if (!local(child, callees))
+				return false;
+		return true;
+	}
+
+public:
+	PurityAnalysis() : mPure()
+	{
+	}
+
+	/// Analyze the functions of unit taking at most maxParams parameters
+	void run(TranslationUnitDecl *unit, unsigned maxParams)
+	{
+		std::map<const FunctionDecl *, std::vector<const FunctionDecl *>> calls;
+		for (Decl *decl : unit->decls())
+		{
+			FunctionDecl *fdecl = dyn_cast<FunctionDecl>(decl);
+			if (!fdecl || !fdecl->doesThisDeclarationHaveABody() || fdecl->isMain())
+				continue;
+			if (!scalar(fdecl->getReturnType()) || fdecl->getNumParams() > maxParams)
+				continue;
+			bool candidate = true;
+			for (const ParmVarDecl *param : fdecl->parameters())
+				candidate = candidate && scalar(param->getType());
+			std::vector<const FunctionDecl *> callees;
+			if (candidate && local(fdecl->getBody(), callees))
+			{
+				calls[fdecl->getCanonicalDecl()] = callees;
+				mPure.insert(fdecl->getCanonicalDecl());
+			}
+		}
+
+		/// Recursive calls were assumed pure, drop callers of impure functions until nothing changes
+		for (bool changed = true; changed;)
+		{
+			changed = false;
+			for (std::map<const FunctionDecl *, std::vector<const FunctionDecl *>>::iterator it = calls.begin(); it != calls.end(); ++it)
+			{
+				if (!mPure.count(it->first))
+					continue;
+				for (const FunctionDecl *callee : it->second)
+					if (!mPure.count(callee))
+					{
+						mPure.erase(it->first);
+						changed = true;
+						break;
+					}
+			}
+		}
+	}
+
+	bool isPure(const FunctionDecl *fdecl)
+	{
+		return mPure.count(fdecl->getCanonicalDecl());
+	}
+};
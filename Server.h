@@ -0,0 +1,392 @@
+//==--- Server.h - Serving program runs from a warm process ----------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Default of --timeout, in milliseconds
+const unsigned DEFAULT_SERVE_TIMEOUT_MS = 10000;
+/// Default of --memory-limit, in megabytes
+const unsigned DEFAULT_SERVE_MEMORY_MB = 512;
+/// Largest program or input a request may carry
+const size_t MAX_REQUEST_BYTES = 64 << 20;
+
+/// Server runs programs for clients of a Unix domain socket, or for a framed
+/// stream on stdin and stdout. A request is the line
+///
+///   run <source bytes> <input bytes> [flag ...]
+///
+/// followed by the program and the text GET reads. The flags are those of
+/// the command line and add to the flags the server was started with. The
+/// reply streams what the program prints as chunks "out <bytes>\n<bytes>"
+/// and ends with "exit <status>", "exit signal <number>" or "exit timeout".
+/// Malformed requests get "error <message>". Several requests may follow
+/// each other on one connection.
+///
+/// The server process initializes the frontend once, then forks its
+/// workers, which inherit it warm. Every request runs in a process forked
+/// from a worker and is killed when its time is up, so a runaway or
+/// crashing program never takes a worker down with it. The run function
+/// caps its memory with limitMemory once it knows what it reserves.
+class Server
+{
+public:
+	/// Runs a program with the given flags, returns its exit status
+	typedef std::function<int(llvm::StringRef source, const std::vector<std::string> &flags)> RunFn;
+
+private:
+	RunFn mRun;
+	unsigned mWorkers;
+	unsigned mTimeoutMs;
+
+	typedef std::chrono::steady_clock Clock;
+
+	static bool writeAll(int fd, const char *data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t written = write(fd, data, size);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return false;
+			data += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	static bool writeAll(int fd, llvm::StringRef text)
+	{
+		return writeAll(fd, text.data(), text.size());
+	}
+
+	static bool readAll(int fd, std::string &data, size_t size)
+	{
+		data.resize(size);
+		size_t done = 0;
+		while (done < size)
+		{
+			ssize_t got = read(fd, &data[done], size - done);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				return false;
+			done += got;
+		}
+		return true;
+	}
+
+	/// Read up to a newline, false at the end of the stream
+	static bool readLine(int fd, std::string &line)
+	{
+		line.clear();
+		char c;
+		while (true)
+		{
+			ssize_t got = read(fd, &c, 1);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				return !line.empty();
+			if (c == '\n')
+				return true;
+			line += c;
+		}
+	}
+
+	/// Run one program in a child process, streaming its output to out
+	bool run(int out, const std::string &source, const std::string &input, const std::vector<std::string> &flags)
+	{
+		int toChild[2], fromChild[2];
+		if (pipe(toChild) != 0)
+			return writeAll(out, "error cannot create a pipe\n");
+		if (pipe(fromChild) != 0)
+		{
+			close(toChild[0]);
+			close(toChild[1]);
+			return writeAll(out, "error cannot create a pipe\n");
+		}
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			dup2(toChild[0], STDIN_FILENO);
+			dup2(fromChild[1], STDOUT_FILENO);
+			dup2(fromChild[1], STDERR_FILENO);
+			close(toChild[0]);
+			close(toChild[1]);
+			close(fromChild[0]);
+			close(fromChild[1]);
+			if (out != STDOUT_FILENO)
+				close(out);
+			/// stdio may remember the end of an earlier input
+			clearerr(stdin);
+			int status = mRun(source, flags);
+			llvm::outs().flush();
+			llvm::errs().flush();
+			fflush(stdout);
+			_exit(status);
+		}
+		close(toChild[0]);
+		close(fromChild[1]);
+		if (pid < 0)
+		{
+			close(toChild[1]);
+			close(fromChild[0]);
+			return writeAll(out, "error cannot fork\n");
+		}
+
+		/// Feed the input while collecting the output, the program may print before it reads
+		fcntl(toChild[1], F_SETFL, O_NONBLOCK);
+		size_t fed = 0;
+		if (input.empty())
+		{
+			close(toChild[1]);
+			toChild[1] = -1;
+		}
+		Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(mTimeoutMs);
+		bool timedOut = false, connected = true;
+		char buffer[4096];
+		while (true)
+		{
+			long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+			if (left <= 0)
+			{
+				timedOut = true;
+				break;
+			}
+			pollfd fds[2] = {{fromChild[0], POLLIN, 0}, {toChild[1], POLLOUT, 0}};
+			if (poll(fds, toChild[1] >= 0 ? 2 : 1, left) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			if (toChild[1] >= 0 && (fds[1].revents & (POLLOUT | POLLERR | POLLHUP)))
+			{
+				ssize_t written = write(toChild[1], input.data() + fed, input.size() - fed);
+				if (written > 0)
+					fed += written;
+				if (written < 0 && errno != EAGAIN && errno != EINTR)
+					fed = input.size();
+				if (fed == input.size())
+				{
+					close(toChild[1]);
+					toChild[1] = -1;
+				}
+			}
+			if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+			{
+				ssize_t got = read(fromChild[0], buffer, sizeof(buffer));
+				if (got < 0 && errno == EINTR)
+					continue;
+				if (got <= 0)
+					break;
+				std::string header = "out " + std::to_string(got) + "\n";
+				connected = connected && writeAll(out, header) && writeAll(out, buffer, got);
+			}
+		}
+		if (toChild[1] >= 0)
+			close(toChild[1]);
+		close(fromChild[0]);
+		/// The program may have closed its output and still be running, the deadline holds until it is reaped
+		int status = 0;
+		bool reaped = false;
+		while (!timedOut && !reaped)
+		{
+			pid_t done = waitpid(pid, &status, WNOHANG);
+			if (done == pid || (done < 0 && errno != EINTR))
+				reaped = true;
+			else if (Clock::now() >= deadline)
+				timedOut = true;
+			else
+				usleep(1000);
+		}
+		if (timedOut)
+		{
+			kill(pid, SIGKILL);
+			while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+				;
+		}
+		std::string result;
+		if (timedOut)
+			result = "exit timeout\n";
+		else if (WIFSIGNALED(status))
+			result = "exit signal " + std::to_string(WTERMSIG(status)) + "\n";
+		else
+			result = "exit " + std::to_string(WEXITSTATUS(status)) + "\n";
+		return connected && writeAll(out, result);
+	}
+
+	/// Answer requests read from in on out until either end closes
+	void session(int in, int out)
+	{
+		std::string line;
+		while (readLine(in, line))
+		{
+			std::vector<std::string> words;
+			llvm::SmallVector<llvm::StringRef, 8> parts;
+			llvm::StringRef(line).split(parts, ' ', -1, false);
+			for (llvm::StringRef part : parts)
+				words.push_back(part.str());
+			unsigned long long sourceSize, inputSize;
+			if (words.size() < 3 || words[0] != "run" || llvm::StringRef(words[1]).getAsInteger(10, sourceSize) ||
+				llvm::StringRef(words[2]).getAsInteger(10, inputSize) || sourceSize > MAX_REQUEST_BYTES ||
+				inputSize > MAX_REQUEST_BYTES)
+			{
+				/// The stream cannot be resynchronized after a bad header
+				writeAll(out, "error expected: run <source bytes> <input bytes> [flag ...]\n");
+				return;
+			}
+			std::string source, input;
+			if (!readAll(in, source, sourceSize) || !readAll(in, input, inputSize))
+				return;
+			std::vector<std::string> flags(words.begin() + 3, words.end());
+			if (!run(out, source, input, flags))
+				return;
+		}
+	}
+
+	/// Parse something small so the pages of the frontend are loaded before workers fork
+	static void warmUp(const RunFn &run)
+	{
+		rlimit memory;
+		getrlimit(RLIMIT_AS, &memory);
+		int null = open("/dev/null", O_RDWR);
+		int saved[3] = {dup(STDIN_FILENO), dup(STDOUT_FILENO), dup(STDERR_FILENO)};
+		for (int fd = 0; fd < 3; fd++)
+			dup2(null, fd);
+		run("int main() { return 0; }", std::vector<std::string>());
+		llvm::errs().flush();
+		for (int fd = 0; fd < 3; fd++)
+		{
+			dup2(saved[fd], fd);
+			close(saved[fd]);
+		}
+		close(null);
+		setrlimit(RLIMIT_AS, &memory);
+	}
+
+	void worker(int listener)
+	{
+		/// Workers go away with the server
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		while (true)
+		{
+			int conn = accept(listener, nullptr, nullptr);
+			if (conn < 0)
+			{
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				_exit(1);
+			}
+			session(conn, conn);
+			close(conn);
+		}
+	}
+
+	pid_t spawn(int listener)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+			worker(listener);
+		return pid;
+	}
+
+public:
+	Server(RunFn run, unsigned workers, unsigned timeoutMs) : mRun(run), mWorkers(workers), mTimeoutMs(timeoutMs)
+	{
+		if (mWorkers == 0)
+			mWorkers = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	}
+
+	/// Limit the address space of the calling process to what it maps now
+	/// plus bytes, false if the limit could not be set
+	static bool limitMemory(size_t bytes)
+	{
+		long pages = 0;
+		if (FILE *statm = fopen("/proc/self/statm", "r"))
+		{
+			if (fscanf(statm, "%ld", &pages) != 1)
+				pages = 0;
+			fclose(statm);
+		}
+		/// Only the soft limit, so warming up can lift it again
+		rlimit limit;
+		getrlimit(RLIMIT_AS, &limit);
+		limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, (rlim_t)pages * sysconf(_SC_PAGESIZE) + bytes);
+		return setrlimit(RLIMIT_AS, &limit) == 0;
+	}
+
+	/// Serve requests framed on stdin, replies on stdout, one at a time
+	int stream()
+	{
+		signal(SIGPIPE, SIG_IGN);
+		warmUp(mRun);
+		session(STDIN_FILENO, STDOUT_FILENO);
+		return 0;
+	}
+
+	/// Serve clients of the Unix domain socket at path until the process is killed
+	int listen(llvm::StringRef path)
+	{
+		signal(SIGPIPE, SIG_IGN);
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+		{
+			llvm::errs() << "error: socket path too long: " << path << "\n";
+			return 1;
+		}
+		memcpy(addr.sun_path, path.data(), path.size());
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(addr.sun_path);
+		if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listener, SOMAXCONN) != 0)
+		{
+			llvm::errs() << "error: cannot listen on " << path << ": " << strerror(errno) << "\n";
+			return 1;
+		}
+		warmUp(mRun);
+		std::vector<pid_t> workers;
+		for (unsigned i = 0; i < mWorkers; i++)
+			workers.push_back(spawn(listener));
+		llvm::errs() << "serve: listening on " << path << " with " << mWorkers << " workers\n";
+		/// Replace workers that died
+		while (true)
+		{
+			int status;
+			pid_t pid = wait(&status);
+			if (pid < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return 1;
+			}
+			for (pid_t &slot : workers)
+				if (slot == pid)
+					slot = spawn(listener);
+		}
+	}
+};
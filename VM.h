@@ -0,0 +1,610 @@
+//==--- VM.h - Dispatch loop for the register bytecode ---------------------===//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+#include "Console.h"
+#include "Memo.h"
+#include "Memory.h"
+
+class VM;
+
+/// State shared with native code, generated code mirrors this layout
+struct NativeContext
+{
+	/// Address 0 of the VM Memory, reloaded by native code after anything that may grow it
+	char *base;
+	VM *vm;
+	/// Number of active calls, VM frames included
+	int64_t depth;
+	int64_t maxDepth;
+	/// Set once native code hit an error, every native caller returns at once
+	int trapped;
+};
+
+/// Native code for a function, registers are taken from regs
+typedef int (*NativeEntry)(NativeContext *ctx, int *regs);
+
+/// Compiles functions that became hot to native code
+class Tier
+{
+public:
+	virtual ~Tier() {}
+
+	/// Calls plus loop back edges after which a function is compiled
+	virtual unsigned threshold() = 0;
+
+	/// Entry of func starting at instruction pc, null if it cannot be compiled.
+	/// At pc 0 regs holds the arguments, elsewhere the whole register file.
+	virtual NativeEntry compile(int func, int pc) = 0;
+};
+
+/// Counts of the executed opcodes and of the opcode pairs and triples executed
+/// back to back, the sequences worth fusing into superinstructions
+class OpcodeProfile
+{
+	std::vector<uint64_t> mSingles;
+	std::vector<uint64_t> mPairs;
+	std::vector<uint64_t> mTriples;
+	/// The two opcodes executed last, OP_COUNT before there were any
+	unsigned mLast;
+	unsigned mBeforeLast;
+	uint64_t mTotal;
+
+	/// The rows most frequent entries of counts, each a sequence of length opcodes
+	void table(llvm::raw_ostream &os, const char *title, const std::vector<uint64_t> &counts, int length, unsigned rows)
+	{
+		std::vector<unsigned> order;
+		for (unsigned i = 0; i < counts.size(); i++)
+			if (counts[i])
+				order.push_back(i);
+		std::stable_sort(order.begin(), order.end(), [&](unsigned left, unsigned right) { return counts[left] > counts[right]; });
+		if (order.size() > rows)
+			order.resize(rows);
+		os << "profile: " << title << "\n";
+		for (unsigned index : order)
+		{
+			os << llvm::format("%14llu %6.2f%% ", (unsigned long long)counts[index], 100.0 * counts[index] / mTotal);
+			unsigned scale = 1;
+			for (int i = 1; i < length; i++)
+				scale *= OP_COUNT;
+			for (; scale; scale /= OP_COUNT)
+				os << " " << opName((BCOp)(index / scale % OP_COUNT));
+			os << "\n";
+		}
+	}
+
+public:
+	OpcodeProfile() : mSingles(OP_COUNT), mPairs(OP_COUNT * OP_COUNT), mTriples(OP_COUNT * OP_COUNT * OP_COUNT),
+					  mLast(OP_COUNT), mBeforeLast(OP_COUNT), mTotal(0)
+	{
+	}
+
+	void record(BCOp op)
+	{
+		mTotal++;
+		mSingles[op]++;
+		if (mLast < OP_COUNT)
+		{
+			mPairs[mLast * OP_COUNT + op]++;
+			if (mBeforeLast < OP_COUNT)
+				mTriples[(mBeforeLast * OP_COUNT + mLast) * OP_COUNT + op]++;
+		}
+		mBeforeLast = mLast;
+		mLast = op;
+	}
+
+	void print(llvm::raw_ostream &os, unsigned rows)
+	{
+		os << "profile: " << mTotal << " instructions\n";
+		table(os, "opcodes", mSingles, 1, rows);
+		table(os, "pairs", mPairs, 2, rows);
+		table(os, "triples", mTriples, 3, rows);
+	}
+};
+
+/// VM executes a BCProgram, calls are kept on an explicit frame stack
+class VM
+{
+	struct Frame
+	{
+		const BCFunction *func;
+		/// Index of the next instruction, saved while a callee runs
+		int pc;
+		/// First register of the frame in mRegs
+		int base;
+		/// Caller register receiving the return value
+		int dst;
+		/// Number of entries of mAllocas owned by the callers
+		int allocas;
+		/// The result goes to the cache under the last key of mMemoKeys
+		bool memo;
+	};
+
+	const BCProgram &mProgram;
+	Memory mMemory;
+	std::vector<int> mRegs;
+	std::vector<Frame> mFrames;
+	/// Addresses of the ALLOCA blocks that are still live
+	std::vector<int> mAllocas;
+	/// Calls nested deeper than this trap instead of growing the frame stack
+	size_t mMaxDepth;
+
+	/// Optional native tier with the per function counters deciding when to use it
+	Tier *mTier;
+	std::vector<unsigned> mHeat;
+	std::vector<NativeEntry> mNative;
+	/// Functions the tier failed to compile
+	std::vector<bool> mCold;
+
+	/// Results of the memoized functions, keys of the calls still running
+	MemoCache mMemo;
+	std::vector<MemoCache::Key> mMemoKeys;
+
+	/// Filled while instructions run if profiling was asked for
+	std::unique_ptr<OpcodeProfile> mProfile;
+
+	/// Where GET reads, PRINT writes and errors are reported
+	Console *mConsole;
+
+	bool hot(int func)
+	{
+		return !mCold[func] && ++mHeat[func] >= mTier->threshold();
+	}
+
+	NativeEntry compile(int func, int pc)
+	{
+		NativeEntry entry = mTier->compile(func, pc);
+		if (!entry)
+			mCold[func] = true;
+		return entry;
+	}
+
+	/// Run native code on top of the current frames, false if it trapped
+	bool callNative(NativeEntry entry, int *regs, int &result)
+	{
+		NativeContext ctx = {mMemory.base(), this, (int64_t)mFrames.size(), (int64_t)mMaxDepth, 0};
+		int val = entry(&ctx, regs);
+		if (ctx.trapped)
+			return false;
+		result = val;
+		return true;
+	}
+
+	void error(const char *msg)
+	{
+		mConsole->out() << "error: " << msg << " in " << mFrames.back().func->name << "\n";
+	}
+
+public:
+	VM(const BCProgram &program, size_t maxDepth) : mProgram(program), mMemory(), mRegs(), mFrames(), mAllocas(), mMaxDepth(maxDepth),
+		  mTier(nullptr), mHeat(), mNative(), mCold(), mMemo(), mMemoKeys(), mProfile(), mConsole(&Console::terminal())
+	{
+		mMemory.Reserve(program.data.size());
+		for (int i = 0; i < program.data.size(); i++)
+			mMemory.Update(i, program.data[i]);
+	}
+
+	void setTier(Tier *tier)
+	{
+		mTier = tier;
+		mHeat.assign(mProgram.functions.size(), 0);
+		mNative.assign(mProgram.functions.size(), nullptr);
+		mCold.assign(mProgram.functions.size(), false);
+	}
+
+	const BCProgram &getProgram()
+	{
+		return mProgram;
+	}
+
+	/// Services of the builtins, shared with native code
+	int input()
+	{
+		return mConsole->get();
+	}
+
+	void output(int val)
+	{
+		mConsole->print(val);
+	}
+
+	void setConsole(Console *console)
+	{
+		mConsole = console;
+	}
+
+	Console &getConsole()
+	{
+		return *mConsole;
+	}
+
+	Memory &getMemory()
+	{
+		return mMemory;
+	}
+
+	MemoCache &getMemo()
+	{
+		return mMemo;
+	}
+
+	/// Count the interpreted opcode sequences, native code is not counted
+	void enableProfile()
+	{
+		mProfile.reset(new OpcodeProfile());
+	}
+
+	OpcodeProfile *getProfile()
+	{
+		return mProfile.get();
+	}
+
+	/// Zeroed block released when the function that allocated it returns
+	int allocateLocal(int size)
+	{
+		int addr = mMemory.Malloc(size);
+		for (int i = 0; i < size; i++)
+			mMemory.Update(addr + i, (char)0);
+		mAllocas.push_back(addr);
+		return addr;
+	}
+
+	size_t allocaMark()
+	{
+		return mAllocas.size();
+	}
+
+	void releaseAllocas(size_t mark)
+	{
+		while (mAllocas.size() > mark)
+		{
+			mMemory.Free(mAllocas.back());
+			mAllocas.pop_back();
+		}
+	}
+
+	/// Run the entry function, returns false if execution trapped
+	bool run()
+	{
+		return mProfile ? execute<true>() : execute<false>();
+	}
+
+private:
+	/// The dispatch loop, compiled twice so counting costs nothing unless profiling
+	template <bool PROFILE>
+	bool execute()
+	{
+		assert(mProgram.entry >= 0);
+		const BCFunction *func = &mProgram.functions[mProgram.entry];
+		mRegs.assign(func->numRegs, 0);
+		mFrames.push_back(Frame{func, 0, 0, -1, 0, false});
+
+		const BCInstr *code = func->code.data();
+		const BCInstr *ip = code;
+		int *regs = mRegs.data();
+		int retval = 0;
+
+		for (;;)
+		{
+			const BCInstr &in = *ip++;
+			if (PROFILE)
+				mProfile->record(in.op);
+			switch (in.op)
+			{
+			case OP_CONST:
+				regs[in.a] = in.b;
+				break;
+			case OP_MOV:
+				regs[in.a] = regs[in.b];
+				break;
+			case OP_LDG_I:
+				regs[in.a] = mMemory.getInt(in.b);
+				break;
+			case OP_LDG_C:
+				regs[in.a] = mMemory.getChar(in.b);
+				break;
+			case OP_STG_I:
+				mMemory.Update(in.a, regs[in.b]);
+				break;
+			case OP_STG_C:
+				mMemory.Update(in.a, (char)regs[in.b]);
+				break;
+			case OP_LD_I:
+				regs[in.a] = mMemory.getInt(regs[in.b]);
+				break;
+			case OP_LD_C:
+				regs[in.a] = mMemory.getChar(regs[in.b]);
+				break;
+			case OP_ST_I:
+				mMemory.Update(regs[in.a], regs[in.b]);
+				break;
+			case OP_ST_C:
+				mMemory.Update(regs[in.a], (char)regs[in.b]);
+				break;
+			case OP_LDX_I:
+				regs[in.a] = mMemory.getInt(regs[in.b] + regs[in.c] * (int)sizeof(int));
+				break;
+			case OP_LDX_C:
+				regs[in.a] = mMemory.getChar(regs[in.b] + regs[in.c]);
+				break;
+			case OP_STX_I:
+				mMemory.Update(regs[in.a] + regs[in.b] * (int)sizeof(int), regs[in.c]);
+				break;
+			case OP_STX_C:
+				mMemory.Update(regs[in.a] + regs[in.b], (char)regs[in.c]);
+				break;
+			case OP_ADD:
+				regs[in.a] = regs[in.b] + regs[in.c];
+				break;
+			case OP_SUB:
+				regs[in.a] = regs[in.b] - regs[in.c];
+				break;
+			case OP_MUL:
+				regs[in.a] = regs[in.b] * regs[in.c];
+				break;
+			case OP_DIV:
+				if (regs[in.c] == 0)
+				{
+					error("division by zero");
+					return false;
+				}
+				regs[in.a] = regs[in.b] / regs[in.c];
+				break;
+			case OP_REM:
+				if (regs[in.c] == 0)
+				{
+					error("division by zero");
+					return false;
+				}
+				regs[in.a] = regs[in.b] % regs[in.c];
+				break;
+			case OP_LT:
+				regs[in.a] = regs[in.b] < regs[in.c];
+				break;
+			case OP_GT:
+				regs[in.a] = regs[in.b] > regs[in.c];
+				break;
+			case OP_LE:
+				regs[in.a] = regs[in.b] <= regs[in.c];
+				break;
+			case OP_GE:
+				regs[in.a] = regs[in.b] >= regs[in.c];
+				break;
+			case OP_EQ:
+				regs[in.a] = regs[in.b] == regs[in.c];
+				break;
+			case OP_NE:
+				regs[in.a] = regs[in.b] != regs[in.c];
+				break;
+			case OP_MULI:
+				regs[in.a] = regs[in.b] * in.c;
+				break;
+			case OP_DIVI:
+				regs[in.a] = regs[in.b] / in.c;
+				break;
+			case OP_ADDI:
+				regs[in.a] = regs[in.b] + in.c;
+				break;
+			case OP_NEG:
+				regs[in.a] = -regs[in.b];
+				break;
+			case OP_NOT:
+				regs[in.a] = !regs[in.b];
+				break;
+			case OP_TRUNC_C:
+				regs[in.a] = (char)regs[in.b];
+				break;
+			case OP_JMP:
+				ip = code + in.a;
+				if (mTier && ip <= &in)
+					goto backedge;
+				break;
+			case OP_JZ:
+				if (!regs[in.a])
+				{
+					ip = code + in.b;
+					if (mTier && ip <= &in)
+						goto backedge;
+				}
+				break;
+			case OP_JNZ:
+				if (regs[in.a])
+				{
+					ip = code + in.b;
+					if (mTier && ip <= &in)
+						goto backedge;
+				}
+				break;
+			case OP_JLT:
+				if (regs[in.a] < regs[in.b])
+					goto branch;
+				break;
+			case OP_JGT:
+				if (regs[in.a] > regs[in.b])
+					goto branch;
+				break;
+			case OP_JLE:
+				if (regs[in.a] <= regs[in.b])
+					goto branch;
+				break;
+			case OP_JGE:
+				if (regs[in.a] >= regs[in.b])
+					goto branch;
+				break;
+			case OP_JEQ:
+				if (regs[in.a] == regs[in.b])
+					goto branch;
+				break;
+			case OP_JNE:
+				if (regs[in.a] != regs[in.b])
+					goto branch;
+				break;
+			case OP_JLTI:
+				if (regs[in.a] < in.b)
+					goto branch;
+				break;
+			case OP_JGTI:
+				if (regs[in.a] > in.b)
+					goto branch;
+				break;
+			case OP_JLEI:
+				if (regs[in.a] <= in.b)
+					goto branch;
+				break;
+			case OP_JGEI:
+				if (regs[in.a] >= in.b)
+					goto branch;
+				break;
+			case OP_JEQI:
+				if (regs[in.a] == in.b)
+					goto branch;
+				break;
+			case OP_JNEI:
+				if (regs[in.a] != in.b)
+					goto branch;
+				break;
+			case OP_SWITCH:
+			{
+				/// The case labels follow the dispatch, so it never jumps back
+				const BCJumpTable &table = mFrames.back().func->tables[in.b];
+				unsigned offset = (unsigned)regs[in.a] - (unsigned)table.low;
+				ip = code + (offset < table.targets.size() ? table.targets[offset] : in.c);
+				break;
+			}
+			branch:
+				ip = code + in.c;
+				if (mTier && ip <= &in)
+					goto backedge;
+				break;
+			backedge:
+			{
+				/// A hot loop continues in native code from its header until the function returns
+				int func = mFrames.back().func - mProgram.functions.data();
+				if (!hot(func))
+					break;
+				NativeEntry entry = compile(func, ip - code);
+				if (!entry)
+					break;
+				if (!callNative(entry, regs, retval))
+					return false;
+				goto leave;
+			}
+			case OP_CALL:
+			{
+				const BCFunction *callee = &mProgram.functions[in.b];
+				MemoCache::Key key;
+				if (callee->memoize)
+				{
+					key = MemoCache::key(in.b, regs + in.c, callee->numParams);
+					if (mMemo.lookup(key, regs[in.a]))
+						break;
+				}
+				if (mTier && (mNative[in.b] || (hot(in.b) && (mNative[in.b] = compile(in.b, 0)))))
+				{
+					if (!callNative(mNative[in.b], regs + in.c, regs[in.a]))
+						return false;
+					break;
+				}
+				if (mFrames.size() >= mMaxDepth)
+				{
+					mConsole->out() << "error: call depth exceeds " << mMaxDepth << " in " << callee->name << "\n";
+					return false;
+				}
+				Frame &caller = mFrames.back();
+				caller.pc = ip - code;
+				int base = caller.base + caller.func->numRegs;
+				if (mRegs.size() < base + callee->numRegs)
+				{
+					mRegs.resize(base + callee->numRegs);
+					regs = mRegs.data() + caller.base;
+				}
+				int *args = regs + in.c;
+				regs = mRegs.data() + base;
+				for (int i = 0; i < callee->numParams; i++)
+					regs[i] = args[i];
+				mFrames.push_back(Frame{callee, 0, base, in.a, (int)mAllocas.size(), callee->memoize});
+				if (callee->memoize)
+					mMemoKeys.push_back(key);
+				code = callee->code.data();
+				ip = code;
+				break;
+			}
+			case OP_TAILCALL:
+			{
+				const BCFunction *callee = &mProgram.functions[in.a];
+				if (mTier && (mNative[in.a] || (hot(in.a) && (mNative[in.a] = compile(in.a, 0)))))
+				{
+					if (!callNative(mNative[in.a], regs + in.b, retval))
+						return false;
+					goto leave;
+				}
+				/// The callee takes over the frame, its parameters are the first registers
+				Frame &frame = mFrames.back();
+				for (int i = 0; i < callee->numParams; i++)
+					regs[i] = regs[in.b + i];
+				if (mRegs.size() < frame.base + callee->numRegs)
+				{
+					mRegs.resize(frame.base + callee->numRegs);
+					regs = mRegs.data() + frame.base;
+				}
+				frame.func = callee;
+				code = callee->code.data();
+				ip = code;
+				break;
+			}
+			case OP_RET:
+				retval = regs[in.a];
+				goto leave;
+			case OP_RET0:
+				retval = 0;
+			leave:
+			{
+				Frame &frame = mFrames.back();
+				releaseAllocas(frame.allocas);
+				if (frame.memo)
+				{
+					mMemo.insert(mMemoKeys.back(), retval);
+					mMemoKeys.pop_back();
+				}
+				int dst = frame.dst;
+				mFrames.pop_back();
+				if (mFrames.empty())
+					return true;
+				Frame &caller = mFrames.back();
+				code = caller.func->code.data();
+				ip = code + caller.pc;
+				regs = mRegs.data() + caller.base;
+				regs[dst] = retval;
+				break;
+			}
+			case OP_ALLOCA:
+				regs[in.a] = allocateLocal(regs[in.b]);
+				break;
+			case OP_GET:
+				regs[in.a] = input();
+				break;
+			case OP_PRINT:
+				output(regs[in.a]);
+				break;
+			case OP_MALLOC:
+				regs[in.a] = mMemory.Malloc(regs[in.b]);
+				break;
+			case OP_FREE:
+				mMemory.Free(regs[in.a]);
+				break;
+			default:
+				error("invalid opcode");
+				return false;
+			}
+		}
+	}
+};
@@ -0,0 +1,120 @@
+//==--- AllocatorBench.cpp - Stress MALLOC/FREE patterns of linked programs ===//
+//===----------------------------------------------------------------------===//
+//
+// Replays the allocation pattern of bench/malloc_stress.c directly against the
+// Memory allocator and against the linear first fit allocator it replaced:
+// build a list of n small nodes, free every other one, then allocate n/2
+// blocks that do not fit the holes and free everything.
+//
+//===----------------------------------------------------------------------===//
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "../Memory.h"
+
+/// The first fit allocator scanning a sorted free list, kept as the baseline
+class LinearMemory
+{
+	std::vector<char> mValues;
+	std::vector<std::pair<int, int>> mFreeList;
+	std::map<int, int> mOccupied;
+
+public:
+	int Malloc(int size)
+	{
+		for (int i = 0; i < mFreeList.size(); i++)
+		{
+			if (mFreeList[i].second - mFreeList[i].first >= size)
+			{
+				int addr = mFreeList[i].first;
+				mFreeList[i].first += size;
+				if (mFreeList[i].first == mFreeList[i].second)
+					mFreeList.erase(mFreeList.begin() + i);
+				mOccupied[addr] = size;
+				return addr;
+			}
+		}
+		int addr = mValues.size();
+		mValues.resize(mValues.size() + size);
+		mOccupied[addr] = size;
+		return addr;
+	}
+	void Free(int addr)
+	{
+		int size = mOccupied[addr];
+		mOccupied.erase(addr);
+		for (int i = 0; i < mFreeList.size(); i++)
+		{
+			if (mFreeList[i].first == addr + size)
+			{
+				mFreeList[i].first = addr;
+				return;
+			}
+			else if (mFreeList[i].second == addr)
+			{
+				mFreeList[i].second = addr + size;
+				if (addr + size == mValues.size())
+				{
+					mValues.resize(mFreeList.back().first);
+					mFreeList.pop_back();
+				}
+				return;
+			}
+			else if (mFreeList[i].first > addr + size)
+			{
+				mFreeList.insert(mFreeList.begin() + i, std::make_pair(addr, addr + size));
+				return;
+			}
+		}
+		mFreeList.push_back(std::make_pair(addr, addr + size));
+		if (addr + size == mValues.size())
+		{
+			mValues.resize(mFreeList.back().first);
+			mFreeList.pop_back();
+		}
+	}
+};
+
+/// Returns the seconds taken by the stress pattern with n nodes
+template <typename Allocator>
+double stress(int n)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	Allocator heap;
+	std::vector<int> nodes;
+	for (int i = 0; i < n; i++)
+		nodes.push_back(heap.Malloc(2 * sizeof(int)));
+	std::vector<int> live;
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 2)
+			heap.Free(nodes[i]);
+		else
+			live.push_back(nodes[i]);
+	}
+	for (int i = 0; i < n / 2; i++)
+		live.push_back(heap.Malloc(3 * sizeof(int)));
+	for (int i = live.size() - 1; i >= 0; i--)
+		heap.Free(live[i]);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+	int limit = argc > 1 ? atoi(argv[1]) : 80000;
+	printf("%10s %14s %14s %10s\n", "nodes", "linear ns/op", "bins ns/op", "speedup");
+	for (int n = 10000; n <= limit; n *= 2)
+	{
+		/// Each run performs 3n allocator calls
+		double linear = stress<LinearMemory>(n);
+		double bins = stress<Memory>(n);
+		printf("%10d %14.1f %14.1f %9.1fx\n", n, linear * 1e9 / (3 * n), bins * 1e9 / (3 * n), linear / bins);
+	}
+	return 0;
+}
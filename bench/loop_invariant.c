@@ -0,0 +1,24 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+/* The bound n * 2 is the same in every iteration and *(p + i) is an
+   address stepped with i */
+int main() {
+   int n;
+   int i;
+   int sum;
+   int *p;
+   n = GET();
+   p = (int *)MALLOC(sizeof(int) * n * 2);
+   for (i = 0; i < n * 2; i++) {
+      *(p + i) = i;
+   }
+   sum = 0;
+   for (i = 0; i < n * 2; i++) {
+      sum = (sum + *(p + i)) % 1000003;
+   }
+   FREE(p);
+   PRINT(sum);
+}
@@ -0,0 +1,47 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int n;
+   int i;
+   int count;
+   int **head;
+   int **node;
+   int **next;
+
+   n = GET();
+   head = 0;
+   for (i = 0; i < n; i = i + 1) {
+      node = (int **)MALLOC(sizeof(int *) * 2);
+      *node = (int *)head;
+      head = node;
+   }
+
+   node = head;
+   while (node != 0) {
+      next = (int **)*node;
+      if (next != 0) {
+         *node = *next;
+         FREE(next);
+         next = (int **)*node;
+      }
+      node = next;
+   }
+
+   for (i = 0; i < n / 2; i = i + 1) {
+      node = (int **)MALLOC(sizeof(int *) * 3);
+      *node = (int *)head;
+      head = node;
+   }
+
+   count = 0;
+   while (head != 0) {
+      count = count + 1;
+      next = (int **)*head;
+      FREE(head);
+      head = next;
+   }
+   PRINT(count);
+}
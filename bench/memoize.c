@@ -0,0 +1,36 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int calls;
+
+int fib(int n) {
+   if (n < 2)
+      return n;
+   return fib(n - 1) + fib(n - 2);
+}
+
+int binom(int n, int k) {
+   if (k == 0)
+      return 1;
+   if (k == n)
+      return 1;
+   return binom(n - 1, k - 1) + binom(n - 1, k);
+}
+
+/* Stores a global, so every call has to run */
+int counted(int n) {
+   calls = calls + 1;
+   return n;
+}
+
+int main() {
+   int n;
+   n = GET();
+   PRINT(fib(n));
+   PRINT(binom(n, n / 2));
+   PRINT(counted(n));
+   PRINT(counted(n));
+   PRINT(calls);
+}
@@ -0,0 +1,53 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+/* Every step dispatches on the state, the cases form a dense range */
+int main() {
+   int n;
+   int i;
+   int acc;
+   int state;
+   n = GET();
+   i = 0;
+   acc = 0;
+   state = 0;
+   while (i < n) {
+      switch (state) {
+      case 0:
+         acc += 1;
+         state = 3;
+         break;
+      case 1:
+         acc += 2;
+         state = 5;
+         break;
+      case 2:
+         acc -= 1;
+         state = 7;
+         break;
+      case 3:
+         acc *= 1;
+         state = 1;
+         break;
+      case 4:
+         acc += 3;
+         state = 6;
+         break;
+      case 5:
+         acc %= 1000003;
+         state = 4;
+         break;
+      case 6:
+         acc += i;
+         state = 2;
+         break;
+      case 7:
+         i++;
+         state = 0;
+         break;
+      }
+   }
+   PRINT(acc);
+}
@@ -0,0 +1,35 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int total;
+
+int odd(int n);
+
+int even(int n) {
+   if (n == 0)
+      return 1;
+   return odd(n - 1);
+}
+
+int odd(int n) {
+   if (n == 0)
+      return 0;
+   return even(n - 1);
+}
+
+void count(int n) {
+   if (n > 0) {
+      total = total + 1;
+      count(n - 1);
+   }
+}
+
+int main() {
+   int n;
+   n = GET();
+   count(n);
+   PRINT(total);
+   PRINT(even(n));
+}
@@ -0,0 +1,19 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+  int a;
+  a = 0;
+  if (2 > 1)
+    a = 10;
+  else
+    a = 20;
+  while (0)
+    a = 30;
+  for (a = a + sizeof(int); 1 < 0; a = a + 1)
+    a = 40;
+  PRINT(a);
+  PRINT(3 * 4 - 2);
+}
@@ -0,0 +1,35 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int calls;
+
+int touch(int v) {
+  calls = calls + 1;
+  return v;
+}
+
+int main() {
+  int a[4];
+  int i;
+  int n;
+  a[0] = 3;
+  a[1] = 0;
+  a[2] = 5;
+  n = 0;
+  i = 0;
+  while (i < 3 && a[i] != 0) {
+    n = n + a[i];
+    i = i + 1;
+  }
+  PRINT(n);
+  if (0 && touch(1))
+    PRINT(9);
+  if (1 || touch(1))
+    PRINT(calls);
+  PRINT(touch(0) || touch(2));
+  PRINT(!(touch(1) && touch(0)));
+  PRINT(i > 0 ? touch(7) : touch(8));
+  PRINT(calls);
+}
@@ -0,0 +1,56 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int calls;
+int g;
+
+int touch(int v) {
+  calls++;
+  return v;
+}
+
+int main() {
+  int a[4];
+  int *p;
+  char c;
+  int i;
+  int n;
+  for (i = 0; i < 4; i++)
+    a[i] = i;
+  PRINT(i);
+  a[touch(1)] += 5;
+  PRINT(a[1]);
+  PRINT(calls);
+  PRINT(a[2]++);
+  PRINT(++a[2]);
+  n = 7;
+  n *= 3;
+  n -= 2;
+  n /= 4;
+  n %= 3;
+  PRINT(n);
+  p = MALLOC(3 * sizeof(int));
+  *p = 1;
+  *(p + 1) = 2;
+  *(p + 2) = 3;
+  *p++ += 4;
+  PRINT(*p);
+  PRINT(*(p - 1));
+  p += 1;
+  (*p)--;
+  PRINT(*p);
+  --p;
+  --p;
+  PRINT(*p);
+  c = 126;
+  c++;
+  c++;
+  PRINT(c);
+  g = 10;
+  g -= 3;
+  g++;
+  PRINT(g);
+  FREE(p);
+}
@@ -0,0 +1,84 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int classify(int c) {
+  switch (c) {
+  case 1:
+  case 2:
+    return 10;
+  case 100:
+    return 20;
+  case -5:
+    return 30;
+  case 7000:
+    return 40;
+  case 31:
+    return 50;
+  default:
+    return 0;
+  }
+}
+
+int main() {
+  int state = 0;
+  int steps = 0;
+  int sum = 0;
+  int i;
+  while (state != 5) {
+    steps++;
+    switch (state) {
+    case 0:
+      state = 2;
+      break;
+    case 1:
+      state = 4;
+      break;
+    case 2:
+      state = 1;
+      continue;
+    case 3:
+      state = 5;
+      break;
+    case 4:
+      state = 3;
+    default:
+      sum += 100;
+    }
+    sum++;
+  }
+  PRINT(steps);
+  PRINT(sum);
+  for (i = 0; i < 8; i++) {
+    switch (i % 4) {
+    case 0:
+      sum += 1;
+    case 1:
+      sum += 2;
+      break;
+    case 3:
+      sum += 4;
+    }
+  }
+  PRINT(sum);
+  PRINT(classify(2));
+  PRINT(classify(7000));
+  PRINT(classify(-5));
+  PRINT(classify(8));
+  PRINT(classify(31));
+  switch (steps) {
+  case 5:
+    switch (sum) {
+    case 122:
+      PRINT(7);
+      break;
+    default:
+      PRINT(8);
+    }
+    PRINT(9);
+    break;
+  default:
+    PRINT(6);
+  }
+}
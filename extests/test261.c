@@ -0,0 +1,80 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int copy(int *to, int *from, int count) {
+  int n = (count + 3) / 4;
+  switch (count % 4) {
+  case 0:
+    while (n > 0) {
+      *to = *from;
+      to = to + 1;
+      from = from + 1;
+    case 3:
+      *to = *from;
+      to = to + 1;
+      from = from + 1;
+    case 2:
+      *to = *from;
+      to = to + 1;
+      from = from + 1;
+    case 1:
+      *to = *from;
+      to = to + 1;
+      from = from + 1;
+      n = n - 1;
+    }
+  }
+  return count;
+}
+
+int nested(int c) {
+  int sum = 0;
+  int i = 0;
+  switch (c) {
+  case 0:
+    for (i = 0; i < 3; i++) {
+      sum += 1;
+    case 1:
+      sum += 10;
+      if (i == 1) {
+        sum += 100;
+      case 2:
+        sum += 1000;
+        break;
+      }
+    }
+    sum += 5;
+    break;
+  default:
+    while (sum < 3) {
+      sum++;
+      {
+      case 3:
+        sum += 20;
+      }
+    }
+  }
+  return sum;
+}
+
+int main() {
+  int a[7];
+  int b[7];
+  int i;
+  int sum = 0;
+  for (i = 0; i < 7; i++) {
+    a[i] = i + 1;
+    b[i] = 0;
+  }
+  copy(b, a, 7);
+  for (i = 0; i < 7; i++)
+    sum = sum * 10 + b[i];
+  PRINT(sum);
+  PRINT(nested(0));
+  PRINT(nested(1));
+  PRINT(nested(2));
+  PRINT(nested(3));
+  PRINT(nested(4));
+}
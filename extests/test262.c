@@ -0,0 +1,41 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int pick(int c) {
+  int sum = 0;
+  switch (c) {
+  case 0:
+    sum += 1;
+    if (0) {
+    case 1:
+      sum += 10;
+    }
+    sum += 100;
+    if (1) {
+      sum += 1000;
+    } else {
+    case 2:
+      sum += 10000;
+    }
+    while (0) {
+    case 3:
+      sum += 2;
+      break;
+    }
+    for (; 0;) {
+    default:
+      sum += 3;
+    }
+  }
+  return sum;
+}
+
+int main() {
+  PRINT(pick(0));
+  PRINT(pick(1));
+  PRINT(pick(2));
+  PRINT(pick(3));
+  PRINT(pick(4));
+}
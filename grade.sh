@@ -21,9 +21,8 @@ for file in $file_list; do
     echo "testing $file"
     # result given by our interpreter
     filename="$TEST_DIR/$file"
-    ccode=$(cat $filename)
     # make $correct as the user input, you can change it if you like
-    actual=$(echo $correct|($ASTI "$ccode" 2>&1>/dev/null)) 
+    actual=$(echo $correct|($ASTI "$filename" 2>&1>/dev/null)) 
     # result given by gcc
     gcc $filename $LIBCODE -o a.out
     expected=$(echo $correct|./a.out)
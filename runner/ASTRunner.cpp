@@ -0,0 +1,68 @@
+//==--- runner/ASTRunner.cpp - Runs bytecode images without Clang ---------===//
+//===----------------------------------------------------------------------===//
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "BytecodeFile.h"
+#include "VM.h"
+
+/// Same defaults as ast-interpreter
+const size_t DEFAULT_MAX_DEPTH = 1000000;
+const unsigned PROFILE_ROWS = 20;
+
+/// ast-runner runs program images written by ast-interpreter --emit-bytecode
+/// in the bytecode VM. It links LLVMSupport only, so it starts without
+/// loading the Clang libraries.
+int main(int argc, char **argv)
+{
+   size_t maxDepth = DEFAULT_MAX_DEPTH;
+   bool profileOpcodes = false;
+   int argi = 1;
+   for (; argi < argc; argi++)
+   {
+      llvm::StringRef arg(argv[argi]);
+      if (arg.startswith("--max-depth="))
+      {
+         if (arg.substr(strlen("--max-depth=")).getAsInteger(10, maxDepth) || maxDepth == 0)
+         {
+            llvm::errs() << "error: invalid " << arg << "\n";
+            return 1;
+         }
+      }
+      else if (arg == "--profile-opcodes")
+         profileOpcodes = true;
+      else
+         break;
+   }
+   if (argi + 1 != argc)
+   {
+      llvm::errs() << "usage: ast-runner [--max-depth=N] [--profile-opcodes] <image.astbc | ->\n";
+      return 1;
+   }
+
+   llvm::StringRef input(argv[argi]);
+   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> image =
+       llvm::MemoryBuffer::getFileOrSTDIN(input, -1, false);
+   if (!image)
+   {
+      llvm::errs() << "error: cannot read " << input << ": " << image.getError().message() << "\n";
+      return 1;
+   }
+   BCProgram program;
+   BCImageReader reader;
+   if (!reader.read((*image)->getBuffer(), program))
+   {
+      llvm::errs() << "error: " << input << ": " << reader.getError() << "\n";
+      return 1;
+   }
+   /// The program owns its code now, the mapping can go
+   image->reset();
+
+   VM vm(program, maxDepth);
+   if (profileOpcodes)
+      vm.enableProfile();
+   bool ok = vm.run();
+   if (OpcodeProfile *profile = vm.getProfile())
+      profile->print(llvm::errs(), PROFILE_ROWS);
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+//==--- unittests/ImageForge.cpp - Writes program images for ast-runner ---===//
+//===----------------------------------------------------------------------===//
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "BytecodeFile.h"
+
+/// image-forge writes a small program image, valid or broken the way its
+/// case names, so the tests can check that ast-runner runs the one and
+/// rejects the others before executing anything.
+int main(int argc, char **argv)
+{
+   if (argc != 3)
+   {
+      llvm::errs() << "usage: image-forge <case> <image.astbc>\n";
+      return 1;
+   }
+   llvm::StringRef kind(argv[1]);
+
+   /// main prints 42 through a call of add, the globals are 8 bytes
+   BCFunction entry = {"main", 0, 4, {}, {}, false};
+   BCFunction add = {"add", 2, 3, {{OP_ADD, 2, 0, 1}, {OP_RET, 2, 0, 0}}, {}, false};
+   BCInstr bad = {OP_CONST, 0, 0, 0};
+   if (kind == "opcode")
+      bad = {OP_COUNT, 0, 0, 0};
+   else if (kind == "register")
+      bad = {OP_MOV, 0, 4, 0};
+   else if (kind == "jump-target")
+      bad = {OP_JMP, 99, 0, 0};
+   else if (kind == "jump-table")
+      bad = {OP_SWITCH, 0, 1, 3};
+   else if (kind == "table-target")
+   {
+      bad = {OP_SWITCH, 0, 0, 3};
+      entry.tables.push_back(BCJumpTable{0, {99}});
+   }
+   else if (kind == "callee")
+      bad = {OP_CALL, 0, 2, 0};
+   else if (kind == "arguments")
+      bad = {OP_CALL, 0, 1, 3};
+   else if (kind == "frame")
+      add.numRegs = 1;
+   else if (kind == "load-global")
+      bad = {OP_LDG_I, 0, 5, 0};
+   else if (kind == "store-global")
+      bad = {OP_STG_C, 8, 0, 0};
+   else if (kind == "negative-global")
+      bad = {OP_LDG_C, 0, -1, 0};
+   else if (kind == "divide-by-zero")
+      bad = {OP_DIVI, 0, 0, 0};
+   else if (kind == "divide-by-negative")
+      bad = {OP_DIVI, 0, 0, -1};
+   else if (kind != "valid" && kind != "off-end" && kind != "version" && kind != "truncated")
+   {
+      llvm::errs() << "error: unknown case " << kind << "\n";
+      return 1;
+   }
+   entry.code = {bad, {OP_CONST, 1, 40, 0}, {OP_CONST, 2, 2, 0}, {OP_CALL, 0, 1, 1}, {OP_PRINT, 0, 0, 0}};
+   if (kind != "off-end")
+      entry.code.push_back({OP_RET0, 0, 0, 0});
+
+   BCProgram program;
+   program.functions = {entry, add};
+   program.data.assign(8, 0);
+   program.entry = 0;
+   std::string image;
+   llvm::raw_string_ostream os(image);
+   BCImageWriter(os).write(program);
+   os.flush();
+   if (kind == "version")
+      image[sizeof(BC_IMAGE_MAGIC)] = BC_IMAGE_VERSION + 1;
+   if (kind == "truncated")
+      image.resize(image.size() - 1);
+
+   std::error_code error;
+   llvm::raw_fd_ostream file(argv[2], error);
+   if (error)
+   {
+      llvm::errs() << "error: cannot write " << argv[2] << ": " << error.message() << "\n";
+      return 1;
+   }
+   file << image;
+   return 0;
+}
@@ -0,0 +1,31 @@
+//==--- unittests/ServeHarness.cpp - Serves stand-in programs -------------===//
+//===----------------------------------------------------------------------===//
+#include <unistd.h>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Server.h"
+
+/// serve-harness answers requests on stdin and stdout like --serve=- with a
+/// 500 ms timeout, but runs stand-ins instead of C programs: the source
+/// close-output closes its output and then spins without end, any other
+/// source is printed back. Interpreted programs cannot close their output,
+/// the stand-in checks that the server still kills such a run in time.
+int main()
+{
+   Server server(
+       [](llvm::StringRef source, const std::vector<std::string> &flags) -> int {
+          if (source == "close-output")
+          {
+             close(STDOUT_FILENO);
+             close(STDERR_FILENO);
+             volatile unsigned spins = 0;
+             while (true)
+                spins++;
+          }
+          llvm::errs() << source;
+          return 0;
+       },
+       1, 500);
+   return server.stream();
+}